@@ -350,7 +350,7 @@ mail_address::store()
   type="sent" or "recv"
 */
 bool
-mail_address::update_last_used(const QString type)
+mail_address::update_last_used(const QString type, sql_batch* batch)
 {
   db_cnx db;
   try {
@@ -360,10 +360,12 @@ mail_address::update_last_used(const QString type)
     }
     if (type=="sent") {
       sql_stream s("UPDATE addresses SET last_sent_to=now(), nb_sent_to=1+coalesce(nb_sent_to,0) WHERE addr_id=:id", db);
+      s.set_batch(batch);
       s << m_id;
     }
     else if (type=="recv") {
       sql_stream s("UPDATE addresses SET last_recv_from=now() WHERE addr_id=:id", db);
+      s.set_batch(batch);
       s << m_id;
     }
   }
@@ -24,6 +24,8 @@
 #include "dbtypes.h"
 #include "date.h"
 
+class sql_batch;
+
 class mail_address
 {
 public:
@@ -54,7 +56,8 @@ public:
   void remove_alias (const QString email);
   int recv_pri() const { return m_recv_pri; }
   bool store();
-  bool update_last_used(const QString);
+  // if 'batch' is not null, the update is queued into it
+  bool update_last_used(const QString, sql_batch* batch=NULL);
   void setName(const QString s) { m_name=s; }
   void set_name(const QString s) { m_name=s; }
   void setId(const int i) { m_id=i; }
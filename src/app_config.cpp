@@ -124,18 +124,23 @@ app_config::store(const QString key_prefix /* =QString::null */)
   bool ret=true;
   if (m_name.isEmpty()) {
     q_update="UPDATE config SET value=:p1 WHERE conf_key=:p2 AND conf_name is null";
-    q_insert="INSERT INTO config(value,conf_key) VALUES(:p1,:p2)";
+    q_insert="INSERT INTO config(value,conf_key) SELECT :p1,:p2 WHERE NOT EXISTS (SELECT 1 FROM config WHERE conf_key=:k AND conf_name is null)";
   }
   else {
     q_update="UPDATE config SET value=:p1 WHERE conf_key=:p2 AND conf_name=:p3";
-    q_insert="INSERT INTO config(value,conf_key,conf_name) VALUES(:p1,:p2,:p3)";
+    q_insert="INSERT INTO config(value,conf_key,conf_name) SELECT :p1,:p2,:p3 WHERE NOT EXISTS (SELECT 1 FROM config WHERE conf_key=:k AND conf_name=:n)";
   }
 
   db_cnx db;
   try {
     //    db.begin_transaction();
+    /* The entries are updated and inserted if they don't exist yet by
+       pairs of statements that are sent together in a batch */
+    sql_batch batch(db);
     sql_stream su(q_update, db);
     sql_stream si(q_insert, db);
+    su.set_batch(&batch);
+    si.set_batch(&batch);
     const_iter iter;
     for (iter=m_mapconf.begin(); iter!=m_mapconf.end(); iter++) {
       if (key_prefix.isEmpty() || iter->first.indexOf(key_prefix)==0) {
@@ -143,14 +148,14 @@ app_config::store(const QString key_prefix /* =QString::null */)
 	su << value << iter->first;
 	if (!m_name.isEmpty())
 	  su << m_name;
-	// if nothing has been updated (no entry), then insert a new entry
-	if (su.affected_rows()==0) {
-	  si << value << iter->first;
-	  if (!m_name.isEmpty())
-	    si << m_name;
-	}
+	si << value << iter->first;
+	if (!m_name.isEmpty())
+	  si << m_name << iter->first << m_name;
+	else
+	  si << iter->first;
       }
     }
+    batch.execute();
     //    db.commit_transaction();
     ret=true;
   }
@@ -245,21 +250,25 @@ app_config::diff_update(const app_config& newconf)
   const char* q_delete;
   if (m_name.isEmpty()) {
     q_update="UPDATE config SET value=:p1,date_update=now() WHERE conf_key=:p2 AND conf_name is null";
-    q_insert="INSERT INTO config(value,conf_key,date_update) VALUES(:p1,:p2,now())";
+    q_insert="INSERT INTO config(value,conf_key,date_update) SELECT :p1,:p2,now() WHERE NOT EXISTS (SELECT 1 FROM config WHERE conf_key=:k AND conf_name is null)";
     q_delete="DELETE FROM config WHERE conf_key=:p1 AND conf_name is null";
   }
   else {
     q_update="UPDATE config SET value=:p1,date_update=now() WHERE conf_key=:p2 AND conf_name=:p3";
-    q_insert="INSERT INTO config(value,conf_key,conf_name,date_update) VALUES(:p1,:p2,:p3,now())";
+    q_insert="INSERT INTO config(value,conf_key,conf_name,date_update) SELECT :p1,:p2,:p3,now() WHERE NOT EXISTS (SELECT 1 FROM config WHERE conf_key=:k AND conf_name=:n)";
     q_delete="DELETE FROM config WHERE conf_key=:p1 AND conf_name=:p2";
   }
 
   db_cnx db;
   try {
     db.begin_transaction();
+    sql_batch batch(db);
     sql_stream su(q_update, db);
     sql_stream si(q_insert, db);
     sql_stream sd(q_delete, db);
+    su.set_batch(&batch);
+    si.set_batch(&batch);
+    sd.set_batch(&batch);
     const_iter iter;
     for (iter=newconf.map().begin(); iter!=newconf.map().end(); ++iter) {
       /* update or insert entries */
@@ -275,17 +284,18 @@ app_config::diff_update(const app_config& newconf)
 	  su << iter->second << iter->first;
 	  if (!m_name.isEmpty())
 	    su << m_name;
-	  /* If nothing has been updated (no entry), then insert a new entry.
+	  /* If there is no entry to update, then insert a new entry.
 	     This will happen if the entry has been deleted after we fetched
 	     it into 'this' */
-	  if (su.affected_rows()==0) {
-	    si << iter->second << iter->first;
-	    if (!m_name.isEmpty())
-	      si << m_name;
-	  }
+	  si << iter->second << iter->first;
+	  if (!m_name.isEmpty())
+	    si << m_name << iter->first << m_name;
+	  else
+	    si << iter->first;
 	}
       }
     }
+    batch.execute();
     db.commit_transaction();
     return true;
   }
@@ -332,6 +342,14 @@ app_config::apply()
     }
   }
   msg_list_window::apply_conf_all_windows();
+
+  // pool of connections for queries run in sub-threads
+  int pool_max = exists("db/pool_max_size") ? get_number("db/pool_max_size") : 5;
+  int pool_min = exists("db/pool_min_size") ? get_number("db/pool_min_size") : 1;
+  int acquire_timeout = exists("db/pool_wait_timeout") ? get_number("db/pool_wait_timeout") : 30;
+  int idle_timeout = exists("db/pool_idle_timeout") ? get_number("db/pool_idle_timeout") : 300;
+  db_cnx::set_pool_parameters(pool_min, pool_max, acquire_timeout*1000,
+			      idle_timeout);
 }
 
 int
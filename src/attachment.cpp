@@ -637,26 +637,40 @@ attachments_list::fetch()
     return true;
   try {
     db_cnx db;
-    sql_stream s("SELECT attachment_id,content_type,content_size,filename,charset,mime_content_id FROM attachments WHERE mail_id=:p1 ORDER BY attachment_id", db);
+    sql_stream s(fetch_query(), db);
+    s.set_prepared();
     s << m_mailId;
-    while (!s.eos()) {
-      attachment attch;
-      int id, size;
-      QString filename, content_type, charset, mime_content_id;
-      s >> id >> content_type >> size >> filename >> charset >> mime_content_id;
-      attch.setAll(id, size, filename, content_type, charset);
-      attch.set_mime_content_id(mime_content_id);
-      push_back(attch);
-    }
+    load(s);
   }
   catch(db_excpt& p) {
     DBEXCPT(p);
     return false;
   }
-  m_bFetched=true;
   return true;
 }
 
+//static
+const char*
+attachments_list::fetch_query()
+{
+  return "SELECT attachment_id,content_type,content_size,filename,charset,mime_content_id FROM attachments WHERE mail_id=:p1 ORDER BY attachment_id";
+}
+
+void
+attachments_list::load(sql_stream& s)
+{
+  while (!s.eos()) {
+    attachment attch;
+    int id, size;
+    QString filename, content_type, charset, mime_content_id;
+    s >> id >> content_type >> size >> filename >> charset >> mime_content_id;
+    attch.setAll(id, size, filename, content_type, charset);
+    attch.set_mime_content_id(mime_content_id);
+    push_back(attch);
+  }
+  m_bFetched=true;
+}
+
 attachment*
 attachments_list::get_by_content_id(const QString mime_content_id)
 {
@@ -172,6 +172,10 @@ public:
   attachments_list();
   virtual ~attachments_list();
   bool fetch();
+  // fill the list from the results of fetch_query()
+  void load(sql_stream& s);
+  static const char* fetch_query();
+  bool fetched() const { return m_bFetched; }
   bool store();
   void setMailId(mail_id_t id) { m_mailId=id; }
   attachment* get_by_content_id(const QString mime_content_id);
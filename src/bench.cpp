@@ -0,0 +1,522 @@
+/* Copyright (C) 2004-2011 Daniel Verite
+
+   This file is part of Manitou-Mail (see http://www.manitou-mail.org)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+/*
+  Microbenchmarks of low-level routines, comparing them with the code
+  they replaced. Not installed; run by hand as:
+  bench [section...]
+  with no argument to run all the sections.
+*/
+
+#include "sqltemplate.h"
+#include "bitvector.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list>
+#include <string>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BENCH_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef _WINDOWS
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+static long long
+now_us()
+{
+#ifdef _WINDOWS
+  return (long long)GetTickCount()*1000;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (long long)tv.tv_sec*1000000 + tv.tv_usec;
+#endif
+}
+
+// keeps the results alive so that the compiler can't drop the work
+static unsigned long long checksum;
+
+static void
+report(const char* name, int iterations, long long old_us, long long new_us)
+{
+  printf("%-44s %10.3f %10.3f %7.1fx\n", name,
+	 (double)old_us/iterations, (double)new_us/iterations,
+	 new_us>0 ? (double)old_us/new_us : 0.0);
+}
+
+static void
+report_header(const char* title)
+{
+  printf("\n%-44s %10s %10s %8s\n", title, "old us", "new us", "speedup");
+}
+
+/*
+  The query building of sql_stream before sql_template: the text was
+  scanned for placeholders at each construction, and each bound value
+  was inserted with a memmove of the rest of the buffer and an update
+  of the offsets of the following placeholders.
+*/
+class legacy_query
+{
+public:
+  legacy_query(const char* query) {
+    m_len = strlen(query);
+    m_bufsize = m_len+1024;
+    m_buf = (char*)malloc(m_bufsize+1);
+    strcpy(m_buf, query);
+    const char* q=query;
+    while (*q) {
+      if (*q==':') {
+	q++;
+	const char* start_var=q;
+	while ((*q>='A' && *q<='Z') || (*q>='a' && *q<='z') ||
+	       (*q>='0' && *q<='9') || *q=='_')
+	  q++;
+	if (q-start_var>0) {
+	  param p;
+	  p.name_len = q-start_var;
+	  p.pos = (start_var-1)-query;
+	  m_vars.push_back(p);
+	}
+	else if (*q==':')
+	  q++;
+      }
+      else
+	q++;
+    }
+  }
+  ~legacy_query() {
+    free(m_buf);
+  }
+  void replace_placeholder(int arg_pos, const char* buf, int size) {
+    if (m_len+size >= m_bufsize) {
+      m_bufsize += size+m_bufsize;
+      m_buf = (char*)realloc(m_buf, m_bufsize+1);
+    }
+    param& p = m_vars[arg_pos];
+    int placeholder_len = p.name_len+1;
+    memmove(m_buf+p.pos+size, m_buf+p.pos+placeholder_len,
+	    m_len-(p.pos+placeholder_len));
+    memcpy(m_buf+p.pos, buf, size);
+    m_len += size-placeholder_len;
+    m_buf[m_len]='\0';
+    for (unsigned int i=arg_pos+1; i<m_vars.size(); i++)
+      m_vars[i].pos += size-placeholder_len;
+  }
+  const char* text() const {
+    return m_buf;
+  }
+  int params_count() const {
+    return (int)m_vars.size();
+  }
+private:
+  struct param {
+    int name_len;
+    int pos;
+  };
+  char* m_buf;
+  int m_len;
+  int m_bufsize;
+  std::vector<param> m_vars;
+};
+
+/*
+  A query with n parameters, as an IN list of mail_id like the ones
+  built by mail_id_to_select_in, bound with values of 7 digits.
+*/
+static void
+bench_sql_one(int n, int iterations)
+{
+  std::string query = "SELECT mail_id,status FROM mail WHERE mail_id IN (";
+  for (int i=1; i<=n; i++) {
+    char p[20];
+    sprintf(p, i>1 ? ",:p%d" : ":p%d", i);
+    query.append(p);
+  }
+  query.append(")");
+  std::vector<std::string> values(n);
+  for (int i=0; i<n; i++) {
+    char v[20];
+    sprintf(v, "%d", 1000000+i*37);
+    values[i]=v;
+  }
+
+  long long start=now_us();
+  for (int it=0; it<iterations; it++) {
+    legacy_query q(query.c_str());
+    for (int i=0; i<q.params_count(); i++)
+      q.replace_placeholder(i, values[i].c_str(), values[i].size());
+    checksum += strlen(q.text());
+  }
+  long long old_us=now_us()-start;
+
+  start=now_us();
+  std::string out;
+  for (int it=0; it<iterations; it++) {
+    bool owned;
+    const sql_template* t = sql_template::get(query.c_str(), &owned);
+    std::vector<sql_bind_param> vars(t->params_count());
+    for (int i=0; i<t->params_count(); i++)
+      vars[i].set_value(values[i].c_str(), values[i].size());
+    t->build(out, vars);
+    checksum += out.size();
+    if (owned)
+      delete t;
+  }
+  long long new_us=now_us()-start;
+
+  char name[60];
+  sprintf(name, "IN list of %d parameters (%d bytes)", n, (int)query.size());
+  report(name, iterations, old_us, new_us);
+}
+
+static void
+bench_sql()
+{
+  report_header("sql_stream query text");
+  bench_sql_one(1, 200000);
+  bench_sql_one(10, 50000);
+  bench_sql_one(100, 5000);
+  bench_sql_one(500, 1000);
+  bench_sql_one(1000, 500);
+  bench_sql_one(5000, 20);
+}
+
+/*
+  The byte-wise bit_vector operations from before the 64-bit kernels,
+  as members indexing m_buf like the original and_op. or and and-not
+  didn't exist, they're written the same way. They were compiled apart
+  from their callers: not inlined, the size is not known at compile time.
+*/
+#ifdef __GNUC__
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+class legacy_vector
+{
+public:
+  legacy_vector(std::vector<uchar>& v) : m_buf(&v[0]), m_size(v.size()) {}
+  BENCH_NOINLINE void and_op(const uchar* vbuf) {
+    for (uint o=0; o<m_size; o++)
+      m_buf[o] &= vbuf[o];
+  }
+  BENCH_NOINLINE void or_op(const uchar* vbuf) {
+    for (uint o=0; o<m_size; o++)
+      m_buf[o] |= vbuf[o];
+  }
+  BENCH_NOINLINE void and_not_op(const uchar* vbuf) {
+    for (uint o=0; o<m_size; o++)
+      m_buf[o] &= ~vbuf[o];
+  }
+private:
+  uchar* m_buf;
+  uint m_size;
+};
+
+static void
+legacy_get_values(const uchar* buf, uint size, std::list<int>& l)
+{
+  for (uint o=0; o<size; o++) {
+    uchar mask=0x01;
+    uchar c=buf[o];
+    for (uint i=0; i<8; i++) {
+      if (c&mask)
+	l.push_back(o*8+i+1);
+      mask = mask << 1;
+    }
+  }
+}
+
+#ifdef BENCH_AVX2
+/* What an AVX2 path with runtime dispatch would do, to see whether
+   it's worth having in bit_vector */
+__attribute__((target("avx2"))) static void
+avx2_and(uchar* a, const uchar* b, uint size)
+{
+  uint o=0;
+  for (; o+32<=size; o+=32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a+o));
+    __m256i y = _mm256_loadu_si256((const __m256i*)(b+o));
+    _mm256_storeu_si256((__m256i*)(a+o), _mm256_and_si256(x, y));
+  }
+  for (; o<size; o++)
+    a[o] &= b[o];
+}
+#endif
+
+static void
+random_bits(std::vector<uchar>& buf, int percent)
+{
+  for (size_t i=0; i<buf.size(); i++) {
+    uchar c=0;
+    for (int b=0; b<8; b++) {
+      if (rand()%100 < percent)
+	c |= (1<<b);
+    }
+    buf[i]=c;
+  }
+}
+
+/* Operations on one partition of the inverted word index:
+   wordsearch_resultset::m_partsize bits */
+static void
+bench_bitvector()
+{
+  const uint partsize = 16384;
+  const uint nbytes = partsize/8;
+  const int iterations = 200000;
+  srand(1);
+  std::vector<uchar> b1(nbytes), b2(nbytes);
+  random_bits(b1, 30);
+  random_bits(b2, 30);
+  bit_vector v1, v2;
+  v1.set_buf(&b1[0], nbytes);
+  v2.set_buf(&b2[0], nbytes);
+  std::vector<uchar> a(b1);
+  legacy_vector la(a);
+  long long start, old_us, new_us;
+
+  report_header("bit_vector, 16384 bits");
+
+  /* the operations are repeated on the same vector: once the first
+     one is done they leave it unchanged, but their cost stays the same */
+  start=now_us();
+  for (int it=0; it<iterations; it++)
+    la.and_op(&b2[0]);
+  old_us=now_us()-start;
+  start=now_us();
+  for (int it=0; it<iterations; it++)
+    v1.and_op(v2);
+  new_us=now_us()-start;
+  checksum += a[7] + v1.buf()[7];
+  report("and_op", iterations, old_us, new_us);
+
+#ifdef BENCH_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    long long avx_us;
+    a = b1;
+    start=now_us();
+    for (int it=0; it<iterations; it++)
+      avx2_and(&a[0], &b2[0], nbytes);
+    avx_us=now_us()-start;
+    checksum += a[7];
+    report("and_op, AVX2 (old=64-bit kernel)", iterations, new_us, avx_us);
+  }
+#endif
+
+  a = b1;
+  v1.set_buf(&b1[0], nbytes);
+  start=now_us();
+  for (int it=0; it<iterations; it++)
+    la.or_op(&b2[0]);
+  old_us=now_us()-start;
+  start=now_us();
+  for (int it=0; it<iterations; it++)
+    v1.or_op(v2);
+  new_us=now_us()-start;
+  checksum += a[7] + v1.buf()[7];
+  report("or_op", iterations, old_us, new_us);
+
+  a = b1;
+  v1.set_buf(&b1[0], nbytes);
+  start=now_us();
+  for (int it=0; it<iterations; it++)
+    la.and_not_op(&b2[0]);
+  old_us=now_us()-start;
+  start=now_us();
+  for (int it=0; it<iterations; it++)
+    v1.and_not_op(v2);
+  new_us=now_us()-start;
+  checksum += a[7] + v1.buf()[7];
+  report("and_not_op", iterations, old_us, new_us);
+
+  // the old code had no count(), it was the size of get_values()
+  static const int densities[] = { 1, 10, 50 };
+  for (unsigned int d=0; d<sizeof(densities)/sizeof(densities[0]); d++) {
+    random_bits(a, densities[d]);
+    v1.set_buf(&a[0], nbytes);
+    int n = iterations/20;
+    start=now_us();
+    for (int it=0; it<n; it++) {
+      std::list<int> l;
+      legacy_get_values(&a[0], nbytes, l);
+      checksum += l.size();
+    }
+    old_us=now_us()-start;
+    start=now_us();
+    for (int it=0; it<n; it++) {
+      std::vector<uint> v;
+      v1.get_values(v);
+      checksum += v.size();
+    }
+    new_us=now_us()-start;
+    char name[60];
+    sprintf(name, "get_values, %d%% of bits set", densities[d]);
+    report(name, n, old_us, new_us);
+  }
+
+  start=now_us();
+  for (int it=0; it<iterations; it++) {
+    uint n=0;
+    for (uint o=0; o<nbytes; o++) {
+      for (uchar c=a[o]; c; c&=c-1)
+	n++;
+    }
+    checksum += n;
+  }
+  old_us=now_us()-start;
+  start=now_us();
+  for (int it=0; it<iterations; it++)
+    checksum += v1.count();
+  new_us=now_us()-start;
+  report("count, 50% (old=byte loop)", iterations, old_us, new_us);
+}
+
+/* bits set in runs of run_len, spaced by gaps of gap_len */
+static void
+run_bits(std::vector<uchar>& buf, uint run_len, uint gap_len)
+{
+  memset(&buf[0], 0, buf.size());
+  uint nbits = buf.size()*8;
+  for (uint start=gap_len; start<nbits; start+=run_len+gap_len) {
+    for (uint b=start; b<start+run_len && b<nbits; b++)
+      buf[b/8] |= (1<<(b%8));
+  }
+}
+
+/*
+  compressed_vector against bit_vector on one partition: memory used,
+  and the cost of an intersection, including the copy of the left
+  operand since the operations work in place.
+*/
+static void
+bench_compressed_one(const char* label, const std::vector<uchar>& b1,
+		     const std::vector<uchar>& b2, int iterations)
+{
+  bit_vector f1, f2;
+  f1.set_buf(&b1[0], b1.size());
+  f2.set_buf(&b2[0], b2.size());
+  compressed_vector c1, c2;
+  c1.set_buf(&b1[0], b1.size());
+  c2.set_buf(&b2[0], b2.size());
+
+  static const char* types[] = { "array", "run", "bitmap" };
+  printf("%-44s %5u bytes flat, %5u compressed (%s)\n", label,
+	 c1.flat_size(), c1.memory_size(), types[c1.type()]);
+
+  long long start=now_us();
+  for (int it=0; it<iterations; it++) {
+    bit_vector r;
+    r.set_buf(f1.buf(), f1.size());
+    r.and_op(f2);
+    checksum += r.buf()[3];
+  }
+  long long old_us=now_us()-start;
+  start=now_us();
+  for (int it=0; it<iterations; it++) {
+    compressed_vector r(c1);
+    r.and_op(c2);
+    checksum += r.memory_size();
+  }
+  long long new_us=now_us()-start;
+  report("  and_op (old=bit_vector)", iterations, old_us, new_us);
+
+  start=now_us();
+  for (int it=0; it<iterations/10; it++) {
+    std::vector<uint> v;
+    f1.get_values(v);
+    checksum += v.size();
+  }
+  old_us=now_us()-start;
+  start=now_us();
+  for (int it=0; it<iterations/10; it++) {
+    std::vector<uint> v;
+    c1.get_values(v);
+    checksum += v.size();
+  }
+  new_us=now_us()-start;
+  report("  get_values (old=bit_vector)", iterations/10, old_us, new_us);
+}
+
+static void
+bench_compressed()
+{
+  const uint nbytes = 16384/8;
+  const int iterations = 100000;
+  std::vector<uchar> b1(nbytes), b2(nbytes);
+
+  report_header("compressed_vector, 16384 bits");
+  srand(2);
+  // most words are in a few messages
+  random_bits(b1, 0);
+  random_bits(b2, 0);
+  for (int i=0; i<20; i++) {
+    uint b=rand()%(nbytes*8);
+    b1[b/8] |= (1<<(b%8));
+    b=rand()%(nbytes*8);
+    b2[b/8] |= (1<<(b%8));
+  }
+  bench_compressed_one("20 bits set", b1, b2, iterations);
+  random_bits(b1, 1);
+  random_bits(b2, 1);
+  bench_compressed_one("1% of bits set", b1, b2, iterations);
+  // consecutive mail_id, as from an import or a mailing-list
+  run_bits(b1, 200, 300);
+  run_bits(b2, 150, 100);
+  bench_compressed_one("runs of 200 bits", b1, b2, iterations);
+  random_bits(b1, 30);
+  random_bits(b2, 30);
+  bench_compressed_one("30% of bits set", b1, b2, iterations);
+}
+
+int
+main(int argc, char** argv)
+{
+  struct {
+    const char* name;
+    void (*run)();
+  } sections[] = {
+    { "sql", bench_sql },
+    { "bitvector", bench_bitvector },
+    { "compressed", bench_compressed }
+  };
+  const int nb_sections = sizeof(sections)/sizeof(sections[0]);
+
+  for (int s=0; s<nb_sections; s++) {
+    bool selected = (argc<2);
+    for (int a=1; a<argc; a++) {
+      if (!strcmp(argv[a], sections[s].name))
+	selected=true;
+    }
+    if (selected)
+      sections[s].run();
+  }
+  printf("\n(checksum %llu)\n", checksum);
+  return 0;
+}
@@ -19,6 +19,71 @@
 
 #include "bitvector.h"
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iterator>
+
+// unaligned access to the 64-bit word at p, bit 0 being bit 0 of p[0]
+static inline quint64
+load64(const uchar* p)
+{
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+  return ((quint64)p[0]) | ((quint64)p[1]<<8) | ((quint64)p[2]<<16) |
+    ((quint64)p[3]<<24) | ((quint64)p[4]<<32) | ((quint64)p[5]<<40) |
+    ((quint64)p[6]<<48) | ((quint64)p[7]<<56);
+#else
+  quint64 w;
+  memcpy(&w, p, sizeof(w));
+  return w;
+#endif
+}
+
+static inline void
+store64(uchar* p, quint64 w)
+{
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+  for (int i=0; i<8; i++) {
+    p[i] = (uchar)(w>>(8*i));
+  }
+#else
+  memcpy(p, &w, sizeof(w));
+#endif
+}
+
+static inline uint
+popcount64(quint64 w)
+{
+  /* without the popcnt instruction (-mpopcnt), the builtin is a call
+     to a table-driven function of libgcc, slower than the code below */
+#if defined(__GNUC__) && defined(__POPCNT__)
+  return __builtin_popcountll(w);
+#else
+  w = w - ((w>>1) & Q_UINT64_C(0x5555555555555555));
+  w = (w & Q_UINT64_C(0x3333333333333333)) + ((w>>2) & Q_UINT64_C(0x3333333333333333));
+  w = (w + (w>>4)) & Q_UINT64_C(0x0f0f0f0f0f0f0f0f);
+  return (uint)((w * Q_UINT64_C(0x0101010101010101)) >> 56);
+#endif
+}
+
+// index of the lowest bit set. w must not be 0
+static inline uint
+ctz64(quint64 w)
+{
+#ifdef __GNUC__
+  return __builtin_ctzll(w);
+#else
+  uint n=0;
+  while (!(w & 0xff)) {
+    w>>=8;
+    n+=8;
+  }
+  while (!(w & 1)) {
+    w>>=1;
+    n++;
+  }
+  return n;
+#endif
+}
 
 bit_vector::bit_vector() : m_buf(NULL), m_size(0)
 {
@@ -42,20 +107,40 @@ bit_vector::size() const
 }
 
 void
-bit_vector::get_values(std::list<int>& l) const
-{
-  for (uint o=0; o<m_size; o++) {
-    uchar mask=0x01;
-    uchar c=m_buf[o];
-    for (uint i=0; i<8; i++) {
-      if (c&mask) {
-	l.push_back(o*8+i+1);
-      }
-      mask = mask << 1;
+bit_vector::get_values(std::vector<uint>& v, uint offset/*=0*/) const
+{
+  v.reserve(v.size()+count());
+  uint o=0;
+  for (; o+8<=m_size; o+=8) {
+    quint64 w = load64(m_buf+o);
+    while (w) {
+      v.push_back(offset+o*8+ctz64(w)+1);
+      w &= w-1;			// clear the lowest bit set
+    }
+  }
+  for (; o<m_size; o++) {
+    uint c=m_buf[o];
+    while (c) {
+      v.push_back(offset+o*8+ctz64(c)+1);
+      c &= c-1;
     }
   }
 }
 
+uint
+bit_vector::count() const
+{
+  uint n=0;
+  uint o=0;
+  for (; o+8<=m_size; o+=8) {
+    n += popcount64(load64(m_buf+o));
+  }
+  for (; o<m_size; o++) {
+    n += popcount64(m_buf[o]);
+  }
+  return n;
+}
+
 void bit_vector::set_buf(const uchar* buf, uint size, uint nz_offset/*=0*/)
 {
   if (m_buf)
@@ -79,7 +164,17 @@ bit_vector::and_op(const bit_vector& v)
   const uchar* vbuf = v.buf();
   if (v.size() < sz)
     sz = v.size();
-  for (uint o=0; o<sz; o++) {
+  uint o=0;
+  // two independent words per iteration, half of the loop overhead
+  // (twice as fast on a 16384 bits partition, see bench.cpp)
+  for (; o+16<=sz; o+=16) {
+    store64(m_buf+o, load64(m_buf+o) & load64(vbuf+o));
+    store64(m_buf+o+8, load64(m_buf+o+8) & load64(vbuf+o+8));
+  }
+  for (; o+8<=sz; o+=8) {
+    store64(m_buf+o, load64(m_buf+o) & load64(vbuf+o));
+  }
+  for (; o<sz; o++) {
     m_buf[o] &= vbuf[o];
   }
   // shorten our size if v is smaller than us
@@ -87,6 +182,55 @@ bit_vector::and_op(const bit_vector& v)
     m_size=sz;
 }
 
+void
+bit_vector::or_op(const bit_vector& v)
+{
+  uint sz = m_size;
+  const uchar* vbuf = v.buf();
+  if (v.size() > m_size) {
+    // grow to v's size, the bytes beyond our size being copied from v
+    uchar* p = (uchar*)realloc(m_buf, v.size());
+    if (!p)
+      throw "No memory";
+    m_buf = p;
+    memcpy(m_buf+m_size, vbuf+m_size, v.size()-m_size);
+    m_size = v.size();
+  }
+  else
+    sz = v.size();
+  uint o=0;
+  for (; o+16<=sz; o+=16) {
+    store64(m_buf+o, load64(m_buf+o) | load64(vbuf+o));
+    store64(m_buf+o+8, load64(m_buf+o+8) | load64(vbuf+o+8));
+  }
+  for (; o+8<=sz; o+=8) {
+    store64(m_buf+o, load64(m_buf+o) | load64(vbuf+o));
+  }
+  for (; o<sz; o++) {
+    m_buf[o] |= vbuf[o];
+  }
+}
+
+void
+bit_vector::and_not_op(const bit_vector& v)
+{
+  uint sz = m_size;
+  const uchar* vbuf = v.buf();
+  if (v.size() < sz)
+    sz = v.size();
+  uint o=0;
+  for (; o+16<=sz; o+=16) {
+    store64(m_buf+o, load64(m_buf+o) & ~load64(vbuf+o));
+    store64(m_buf+o+8, load64(m_buf+o+8) & ~load64(vbuf+o+8));
+  }
+  for (; o+8<=sz; o+=8) {
+    store64(m_buf+o, load64(m_buf+o) & ~load64(vbuf+o));
+  }
+  for (; o<sz; o++) {
+    m_buf[o] &= ~vbuf[o];
+  }
+}
+
 void
 bit_vector::clear()
 {
@@ -96,3 +240,369 @@ bit_vector::clear()
       m_buf=NULL;
   }
 }
+
+compressed_vector::compressed_vector() : m_type(array_container), m_nbits(0)
+{
+}
+
+void
+compressed_vector::clear()
+{
+  m_type=array_container;
+  m_nbits=0;
+  m_values.clear();
+  m_words.clear();
+}
+
+void
+compressed_vector::set_buf(const uchar* buf, uint size, uint nz_offset/*=0*/)
+{
+  uint nbits = (size+nz_offset)*8;
+  if (nbits>max_bits)
+    throw "compressed_vector: too many bits";
+  m_nbits = nbits;
+  // the leading zero bytes are skipped, not expanded
+  std::vector<quint64> w((nbits+63)/64, 0);
+  uint o=0;
+  // byte per byte up to a word boundary, then word per word
+  for (; o<size && (nz_offset+o)%8!=0; o++) {
+    uint bit = (nz_offset+o)*8;
+    w[bit/64] |= ((quint64)buf[o]) << (bit%64);
+  }
+  for (; o+8<=size; o+=8) {
+    w[(nz_offset+o)/8] = load64(buf+o);
+  }
+  for (; o<size; o++) {
+    uint bit = (nz_offset+o)*8;
+    w[bit/64] |= ((quint64)buf[o]) << (bit%64);
+  }
+  from_words(w);
+}
+
+// set the bits first to last in w
+static void
+set_range(std::vector<quint64>& w, uint first, uint last)
+{
+  uint fw=first/64, lw=last/64;
+  quint64 fmask = ~Q_UINT64_C(0) << (first%64);
+  quint64 lmask = ~Q_UINT64_C(0) >> (63-last%64);
+  if (fw==lw) {
+    w[fw] |= fmask & lmask;
+    return;
+  }
+  w[fw] |= fmask;
+  for (uint i=fw+1; i<lw; i++)
+    w[i] = ~Q_UINT64_C(0);
+  w[lw] |= lmask;
+}
+
+// expand to a bitmap of m_nbits bits
+void
+compressed_vector::to_words(std::vector<quint64>& w) const
+{
+  if (m_type==bitmap_container) {
+    w = m_words;
+    return;
+  }
+  w.assign((m_nbits+63)/64, 0);
+  if (m_type==array_container) {
+    for (uint i=0; i<m_values.size(); i++)
+      w[m_values[i]/64] |= Q_UINT64_C(1) << (m_values[i]%64);
+  }
+  else {
+    for (uint i=0; i<m_values.size(); i+=2)
+      set_range(w, m_values[i], m_values[i+1]);
+  }
+}
+
+/* Choose the smallest representation for the bits set in w, and
+   store them accordingly. w is taken over by a bitmap container,
+   its contents are unspecified on return */
+void
+compressed_vector::from_words(std::vector<quint64>& w)
+{
+  uint card=0, nruns=0;
+  quint64 prev_top=0;		// last bit of the previous word
+  for (uint i=0; i<w.size(); i++) {
+    if (!w[i]) {
+      prev_top=0;
+      continue;
+    }
+    card += popcount64(w[i]);
+    // a run starts at each bit set whose predecessor is clear
+    quint64 starts = w[i] & ~((w[i]<<1) | prev_top);
+    nruns += popcount64(starts);
+    prev_top = w[i]>>63;
+  }
+  uint array_size = card*2;
+  uint run_size = nruns*4;
+  uint bitmap_size = w.size()*8;
+
+  m_values.clear();
+  m_words.clear();
+  if (bitmap_size < array_size && bitmap_size < run_size) {
+    m_type = bitmap_container;
+    m_words.swap(w);
+  }
+  else if (run_size < array_size) {
+    m_type = run_container;
+    m_values.reserve(nruns*2);
+    prev_top=0;
+    for (uint i=0; i<w.size(); i++) {
+      // the bits that start a run, and those that end one
+      quint64 next_bottom = (i+1<w.size()) ? (w[i+1]&1) : 0;
+      quint64 starts = w[i] & ~((w[i]<<1) | prev_top);
+      quint64 ends = w[i] & ~((w[i]>>1) | (next_bottom<<63));
+      prev_top = w[i]>>63;
+      // in the order of the bits, the start first for a run of one bit
+      while (starts || ends) {
+	uint s = starts ? ctz64(starts) : 64;
+	uint e = ends ? ctz64(ends) : 64;
+	if (s<=e) {
+	  m_values.push_back(i*64+s);
+	  starts &= starts-1;
+	}
+	else {
+	  m_values.push_back(i*64+e);
+	  ends &= ends-1;
+	}
+      }
+    }
+  }
+  else {
+    m_type = array_container;
+    m_values.reserve(card);
+    for (uint i=0; i<w.size(); i++) {
+      quint64 x=w[i];
+      while (x) {
+	m_values.push_back(i*64+ctz64(x));
+	x &= x-1;
+      }
+    }
+  }
+}
+
+// expand to w, moving our bitmap there instead of copying it
+void
+compressed_vector::take_words(std::vector<quint64>& w)
+{
+  if (m_type==bitmap_container)
+    w.swap(m_words);
+  else
+    to_words(w);
+}
+
+/* our bitmap, or its expansion into w when we're not a bitmap
+   container */
+const std::vector<quint64>&
+compressed_vector::words(std::vector<quint64>& w) const
+{
+  if (m_type==bitmap_container)
+    return m_words;
+  to_words(w);
+  return w;
+}
+
+void
+compressed_vector::optimize()
+{
+  std::vector<quint64> w;
+  take_words(w);
+  from_words(w);
+}
+
+bool
+compressed_vector::contains(uint bit) const
+{
+  if (bit>=m_nbits)
+    return false;
+  if (m_type==bitmap_container)
+    return (m_words[bit/64]>>(bit%64)) & 1;
+  if (m_type==array_container)
+    return std::binary_search(m_values.begin(), m_values.end(), (quint16)bit);
+  // the last run starting at or before bit
+  uint lo=0, hi=m_values.size()/2;
+  while (lo<hi) {
+    uint mid=(lo+hi)/2;
+    if (m_values[mid*2] <= bit)
+      lo=mid+1;
+    else
+      hi=mid;
+  }
+  return lo>0 && bit <= m_values[(lo-1)*2+1];
+}
+
+uint
+compressed_vector::count() const
+{
+  uint n=0;
+  if (m_type==array_container)
+    n = m_values.size();
+  else if (m_type==run_container) {
+    for (uint i=0; i<m_values.size(); i+=2)
+      n += m_values[i+1]-m_values[i]+1;
+  }
+  else {
+    for (uint i=0; i<m_words.size(); i++)
+      n += popcount64(m_words[i]);
+  }
+  return n;
+}
+
+void
+compressed_vector::get_values(std::vector<uint>& v, uint offset/*=0*/) const
+{
+  v.reserve(v.size()+count());
+  if (m_type==array_container) {
+    for (uint i=0; i<m_values.size(); i++)
+      v.push_back(offset+m_values[i]+1);
+  }
+  else if (m_type==run_container) {
+    for (uint i=0; i<m_values.size(); i+=2) {
+      for (uint b=m_values[i]; b<=m_values[i+1]; b++)
+	v.push_back(offset+b+1);
+    }
+  }
+  else {
+    for (uint i=0; i<m_words.size(); i++) {
+      quint64 x=m_words[i];
+      while (x) {
+	v.push_back(offset+i*64+ctz64(x)+1);
+	x &= x-1;
+      }
+    }
+  }
+}
+
+void
+compressed_vector::and_op(const compressed_vector& v)
+{
+  /* with v being *this, take_words() below would empty the bitmap
+     read from v */
+  if (&v==this)
+    return;
+  if (m_type==array_container && v.m_type==array_container) {
+    std::vector<quint16> res;
+    res.reserve(qMin(m_values.size(), v.m_values.size()));
+    std::set_intersection(m_values.begin(), m_values.end(),
+			  v.m_values.begin(), v.m_values.end(),
+			  std::back_inserter(res));
+    m_values.swap(res);
+    return;
+  }
+  if (m_type==array_container || v.m_type==array_container) {
+    // the result is a subset of the array
+    std::vector<quint16> res;
+    const compressed_vector& a = (m_type==array_container) ? *this : v;
+    const compressed_vector& other = (m_type==array_container) ? v : *this;
+    res.reserve(a.m_values.size());
+    for (uint i=0; i<a.m_values.size(); i++) {
+      if (other.contains(a.m_values[i]))
+	res.push_back(a.m_values[i]);
+    }
+    m_values.swap(res);
+    m_words.clear();
+    m_type = array_container;
+    return;
+  }
+  if (m_type==run_container && v.m_type==run_container) {
+    // intersection of the intervals
+    std::vector<quint16> res;
+    uint i=0, j=0;
+    while (i<m_values.size() && j<v.m_values.size()) {
+      quint16 first = qMax(m_values[i], v.m_values[j]);
+      quint16 last = qMin(m_values[i+1], v.m_values[j+1]);
+      if (first<=last) {
+	res.push_back(first);
+	res.push_back(last);
+      }
+      if (m_values[i+1] < v.m_values[j+1])
+	i+=2;
+      else
+	j+=2;
+    }
+    m_values.swap(res);
+    /* the resulting runs are apart from each other like the
+       original ones: keep them if it's still the smallest form */
+    uint run_size = m_values.size()*2;
+    if (run_size >= count()*2 || run_size > (m_nbits+63)/64*8)
+      optimize();
+    return;
+  }
+  // at least one bitmap
+  std::vector<quint64> w, vw;
+  take_words(w);
+  const std::vector<quint64>& vwords = v.words(vw);
+  for (uint i=0; i<w.size(); i++)
+    w[i] &= (i<vwords.size()) ? vwords[i] : 0;
+  from_words(w);
+}
+
+void
+compressed_vector::and_not_op(const compressed_vector& v)
+{
+  if (&v==this) {
+    m_type = array_container;
+    m_values.clear();
+    m_words.clear();
+    return;
+  }
+  if (m_type==array_container) {
+    std::vector<quint16> res;
+    res.reserve(m_values.size());
+    for (uint i=0; i<m_values.size(); i++) {
+      if (!v.contains(m_values[i]))
+	res.push_back(m_values[i]);
+    }
+    m_values.swap(res);
+    return;
+  }
+  std::vector<quint64> w;
+  take_words(w);
+  if (v.m_type==array_container) {
+    for (uint i=0; i<v.m_values.size(); i++) {
+      if (v.m_values[i] < m_nbits)
+	w[v.m_values[i]/64] &= ~(Q_UINT64_C(1) << (v.m_values[i]%64));
+    }
+  }
+  else {
+    std::vector<quint64> vw;
+    const std::vector<quint64>& vwords = v.words(vw);
+    for (uint i=0; i<w.size() && i<vwords.size(); i++)
+      w[i] &= ~vwords[i];
+  }
+  from_words(w);
+}
+
+void
+compressed_vector::or_op(const compressed_vector& v)
+{
+  if (&v==this)
+    return;
+  if (m_type==array_container && v.m_type==array_container) {
+    std::vector<quint16> res;
+    res.reserve(m_values.size()+v.m_values.size());
+    std::set_union(m_values.begin(), m_values.end(),
+		   v.m_values.begin(), v.m_values.end(),
+		   std::back_inserter(res));
+    m_values.swap(res);
+    m_nbits = qMax(m_nbits, v.m_nbits);
+    optimize();
+    return;
+  }
+  std::vector<quint64> w, vw;
+  take_words(w);
+  m_nbits = qMax(m_nbits, v.m_nbits);
+  w.resize((m_nbits+63)/64, 0);
+  const std::vector<quint64>& vwords = v.words(vw);
+  for (uint i=0; i<vwords.size(); i++)
+    w[i] |= vwords[i];
+  from_words(w);
+}
+
+uint
+compressed_vector::memory_size() const
+{
+  return sizeof(*this) + m_values.capacity()*sizeof(quint16) +
+    m_words.capacity()*sizeof(quint64);
+}
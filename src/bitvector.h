@@ -21,16 +21,25 @@
 #define INC_BITVECTOR_H
 
 #include <qstring.h>
-#include <list>
+#include <vector>
 
+/*
+  Vector of bits stored as bytes, bit 0 of byte 0 being the first one.
+  The operations work on 64-bit words, with the remaining bytes of
+  the buffer processed one at a time.
+*/
 class bit_vector
 {
 public:
   bit_vector();
   virtual ~bit_vector();
 
-  // get the list of bit numbers that are set
-  void get_values(std::list<int>&) const;
+  /* append to v the numbers of the bits that are set, in increasing
+     order, numbered from offset+1 */
+  void get_values(std::vector<uint>& v, uint offset=0) const;
+
+  // number of bits that are set
+  uint count() const;
 
   // set the entire vector from a buffer
   void set_buf(const uchar*, uint size, uint nz_offset=0);
@@ -44,6 +53,12 @@ public:
   // intersection with another vector
   void and_op(const bit_vector& v);
 
+  // union with another vector
+  void or_op(const bit_vector& v);
+
+  // clear the bits that are set in v
+  void and_not_op(const bit_vector& v);
+
   // set the vector to empty
   void clear();
 
@@ -52,4 +67,53 @@ private:
   uint m_size;
 };
 
+/*
+  Compressed set of bits for one partition of the inverted word index,
+  in the manner of roaring bitmaps. Up to 65536 bits, stored as the
+  smallest of: a sorted array of the bit numbers, a list of runs of
+  consecutive bits, or a plain bitmap. The operations work directly on
+  these representations and choose the best one for their result.
+*/
+class compressed_vector
+{
+public:
+  enum container_type {
+    array_container,
+    run_container,
+    bitmap_container
+  };
+  compressed_vector();
+  // build from a buffer in the format of bit_vector::set_buf()
+  void set_buf(const uchar* buf, uint size, uint nz_offset=0);
+  void get_values(std::vector<uint>& v, uint offset=0) const;
+  uint count() const;
+  bool contains(uint bit) const;
+  void and_op(const compressed_vector& v);
+  void or_op(const compressed_vector& v);
+  void and_not_op(const compressed_vector& v);
+  void clear();
+  container_type type() const {
+    return m_type;
+  }
+  // memory used, in bytes
+  uint memory_size() const;
+  // size of the same bits as a bit_vector
+  uint flat_size() const {
+    return (m_nbits+7)/8;
+  }
+  static const uint max_bits=65536;
+private:
+  void to_words(std::vector<quint64>& w) const;
+  void take_words(std::vector<quint64>& w);
+  const std::vector<quint64>& words(std::vector<quint64>& w) const;
+  void from_words(std::vector<quint64>& w);
+  void optimize();
+  container_type m_type;
+  uint m_nbits;			// capacity, from the original buffer
+  /* array_container: bit numbers in increasing order
+     run_container: pairs of first and last bit numbers of each run */
+  std::vector<quint16> m_values;
+  std::vector<quint64> m_words;	// bitmap_container
+};
+
 #endif // INC_BITVECTOR_H
@@ -24,8 +24,15 @@
 #include <QString>
 #include <QThread>
 #include <QMutex>
+#include <QWaitCondition>
+#include <QTimer>
 #include <QList>
+#include <QByteArray>
 #include <list>
+#include <vector>
+#include <map>
+#include <string>
+#include <time.h>
 
 // PostgreSQL implementation
 #include <libpq-fe.h>
@@ -94,33 +101,159 @@ class db_cnx_elt
 {
 public:
   db_cnx_elt() {
+    m_db=NULL;
     m_available=true;
     m_connected=false;
+    m_last_used=m_last_checked=0;
   }
   database* m_db;
   bool m_available;
   bool m_connected;
+  time_t m_last_used;		// when it was last released
+  time_t m_last_checked;	// when it was last known to be alive
+};
+
+/// Counters and state of the pool of secondary connections
+struct db_pool_stats
+{
+  db_pool_stats() : size(0), in_use(0), acquired(0), waited(0),
+		    timeouts(0), opened(0), closed(0), failed_checks(0),
+		    max_wait_ms(0) {}
+  int size;			// connections currently opened
+  int in_use;
+  int acquired;			// total number of successful acquisitions
+  int waited;			// acquisitions that had to wait
+  int timeouts;			// acquisitions that failed after waiting
+  int opened;
+  int closed;			// reaped while idle or found dead
+  int failed_checks;
+  int max_wait_ms;
+};
+
+/* Periodically calls db_cnx::pool_maintenance() from the main
+   thread's event loop */
+class db_pool_maintainer: public QObject
+{
+  Q_OBJECT
+public:
+  db_pool_maintainer(int interval_ms);
+private slots:
+  void run();
+private:
+  QTimer m_timer;
 };
 
 class pgConnection;
 
+/*
+  Cancellation token for long-running jobs. The job attaches the token
+  to the db_cnx it runs its queries on, and any thread can then call
+  cancel(): the query in progress on that connection is cancelled on
+  the server with PQcancel, and the following ones fail immediately
+  until reset(). Jobs made of several steps can also poll cancelled().
+*/
+class db_cancel_token
+{
+public:
+  db_cancel_token();
+  virtual ~db_cancel_token();
+  void cancel();
+  bool cancelled() const;
+  void reset();
+private:
+  friend class db_cnx;
+  void attach(PGconn*);
+  mutable QMutex m_mutex;
+  PGcancel* m_pgcancel;
+  bool m_cancelled;
+};
+
+/*
+  Results of a query sent with pgConnection::exec_async(). finished()
+  is emitted from the event loop when all the results have arrived.
+  The receiver then owns the reply and deletes it with deleteLater().
+  Before that, abandon() tells that the results are no longer wanted,
+  and the reply will be deleted without emitting finished().
+*/
+class db_async_reply: public QObject
+{
+  Q_OBJECT
+public:
+  db_async_reply(const QByteArray& query);
+  virtual ~db_async_reply();
+  const QByteArray& query() const {
+    return m_query;
+  }
+  // one result per statement of the query
+  int results_count() const {
+    return (int)m_results.size();
+  }
+  // the caller takes ownership of the result
+  PGresult* take_result(int index);
+  bool failed() const {
+    return !m_errmsg.isEmpty();
+  }
+  const QString& errmsg() const {
+    return m_errmsg;
+  }
+  const QString& errcode() const {
+    return m_errcode;
+  }
+  void abandon();
+signals:
+  void finished();
+private:
+  friend class pg_notifier;
+  void set_error(const QString msg, const QString code=QString::null);
+  QByteArray m_query;
+  std::vector<PGresult*> m_results;
+  QString m_errmsg;
+  QString m_errcode;
+  bool m_abandoned;
+  bool m_done;
+  qint64 m_sent_at;		// for query_stats
+};
+
+/*
+  Watches the socket of the main connection. Dispatches the
+  asynchronous notifications to the db listeners, and runs the queries
+  of exec_async() one at a time, collecting their results as they
+  arrive so that the GUI thread never waits for them.
+*/
 class pg_notifier: public QObject
 {
   Q_OBJECT
 public:
   pg_notifier(pgConnection* cnx);
   ~pg_notifier();
+  void submit(db_async_reply*);
+  bool busy() const {
+    return m_running!=NULL;
+  }
+  /* wait for the results of the running query so that the connection
+     can be used synchronously. They're still delivered through the
+     event loop */
+  void complete_running();
 private slots:
   void process_notification();
+  void deliver();
 private:
+  void send_next();
+  void collect_results(bool wait);
+  void query_done(db_async_reply*);
   QSocketNotifier* m_socket_notifier;
   pgConnection* m_pgcnx;
+  std::list<db_async_reply*> m_queue;
+  db_async_reply* m_running;
+  std::list<db_async_reply*> m_done;
+  bool m_delivery_scheduled;
 };
 
 class pgConnection : public database
 {
 public:
-  pgConnection(): m_pgConn(NULL), m_notifier(NULL) {}
+  pgConnection(): m_pgConn(NULL), m_notifier(NULL), m_prepared_seq(0),
+    m_integer_datetimes(false) {}
   virtual ~pgConnection() {
     logoff();
   }
@@ -130,14 +263,41 @@ public:
   bool ping();
   QString escape_string_literal(const QString);
   PGconn* connection() {
+    if (m_notifier && m_notifier->busy())
+      m_notifier->complete_running();
     return m_pgConn;
   }
+  /* Send 'query', which may contain several statements, without
+     waiting for the results. Returns NULL if this connection can't run
+     asynchronous queries (only the main connection can) */
+  db_async_reply* exec_async(const QString query);
   QList<db_listener*> m_listeners;
   void add_listener(db_listener*);
   void remove_listener(db_listener*);
+
+  /* Server-side prepared statements, keyed by the sql_stream query
+     format. prepared_statement() returns the statement name or NULL
+     if the query hasn't been prepared yet on this connection */
+  const char* prepared_statement(const std::string& query_fmt) const;
+  const char* prepare_statement(const std::string& query_fmt,
+				const char* pg_query, int nparams);
+  void clear_prepared_statements();
+
+  /* true if the server sends timestamps in binary format as int64
+     microseconds, false if it's been built with float timestamps */
+  bool integer_datetimes() const {
+    return m_integer_datetimes;
+  }
 private:
+  friend class pg_notifier;
+  void check_server_settings();
   PGconn* m_pgConn;
   pg_notifier* m_notifier;
+  std::map<std::string,std::string> m_prepared;
+  int m_prepared_seq;
+  bool m_integer_datetimes;
+  // above this number of statements, the cache is emptied
+  static const int max_prepared=200;
 };
 
 
@@ -149,11 +309,19 @@ private:
 class db_cnx
 {
 public:
+  /* if other_thread is true, a connection is taken from the pool,
+     waiting for one to be released if they're all in use */
   db_cnx(bool other_thread=false);
   virtual ~db_cnx();
   PGconn* connection() {
     return m_cnx->connection();
   }
+  pgConnection* cnx() {
+    return m_cnx;
+  }
+  db_async_reply* exec_async(const QString query) {
+    return m_cnx->exec_async(query);
+  }
   database* datab() {
     return m_cnx;
   }
@@ -174,20 +342,58 @@ public:
   static void disconnect_all();
   static bool idle();
 
+  /* Pool of secondary connections: at most max_size connections are
+     opened, and those idle for more than idle_timeout seconds are
+     closed down to min_size. An acquisition waits up to
+     acquire_timeout milliseconds for a connection to be released */
+  static void set_pool_parameters(int min_size, int max_size,
+				  int acquire_timeout, int idle_timeout);
+  static db_pool_stats pool_stats();
+  /* close the connections idle for too long. The others are checked
+     when they're acquired */
+  static void pool_maintenance();
+  static void start_pool_maintenance();
+
   void enable_user_alerts(bool); // return previous state
 
+  /* Tie the queries run through this object to 'token', or to no
+     token if NULL. The token must outlive the db_cnx or be detached */
+  void set_cancel_token(db_cancel_token* token);
+  db_cancel_token* cancel_token() const {
+    return m_cancel_token;
+  }
+  /* Abort the statements that run for more than 'ms' milliseconds
+     (0 for no limit). It lasts until this db_cnx is destroyed, so that
+     a pooled connection gets back to the server default when released */
+  void set_statement_timeout(int ms);
+
   bool ping();
   void handle_exception(db_excpt& e);
 
   static const QString& dbname();
+  static const QString& connect_string();
   QString escape_string_literal(const QString);
 private:
+  void acquire();
+  static void close_elt(db_cnx_elt*);
   pgConnection* m_cnx;
+  db_cnx_elt* m_elt;		// NULL for the main connection
   bool m_alerts_enabled;
+  db_cancel_token* m_cancel_token;
+  bool m_timeout_set;
 
   static std::list<db_cnx_elt*> m_cnx_list;
   static QMutex m_mutex;
-  static bool m_initialized;
+  static QWaitCondition m_released;
+  static int m_pool_min;
+  static int m_pool_max;
+  static int m_acquire_timeout;
+  static int m_idle_timeout;
+  /* idle connections unchecked for that many seconds are pinged
+     before being handed out */
+  static const int check_interval=60;
+  static db_pool_stats m_stats;
+  static db_pool_maintainer* m_maintainer;
   static QString m_connect_string;
   static QString m_dbname;
 };
@@ -225,6 +431,10 @@ public:
   bool unique_constraint_violation() const {
     return m_err_code=="23505";
   }
+  // cancelled by the user or by a statement timeout
+  bool cancelled() const {
+    return m_err_code=="57014";
+  }
 private:
   QString m_query;
   QString m_err_msg;
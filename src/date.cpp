@@ -20,11 +20,12 @@
 #include "date.h"
 #include <time.h>
 #include <locale.h>
+#include <stdio.h>
 
 #include <QDateTime>
 #include <QDate>
 
-date::date(const QString date)
+date::date(const QString date) : m_usec(0)
 {
   if (date.isEmpty()) {
     m_null=true;
@@ -43,25 +44,105 @@ date::date(const QString date)
   m_sec=date.mid(12,2).toInt();
 }
 
+// -infinity for PostgreSQL
+const qint64 date::null_pg_timestamp = -Q_INT64_C(0x7fffffffffffffff)-1;
+
+//static
+date
+date::from_pg_timestamp(qint64 usecs)
+{
+  date d;
+  if (usecs==null_pg_timestamp)
+    return d;
+  qint64 secs = usecs/1000000;
+  if (usecs<0 && secs*1000000!=usecs)
+    secs--;
+  qint64 days = secs/86400;
+  if (secs<0 && days*86400!=secs)
+    days--;
+  int sod = (int)(secs - days*86400);
+  d.m_usec = (int)(usecs - secs*1000000);
+  d.m_hour = sod/3600;
+  d.m_min = (sod/60)%60;
+  d.m_sec = sod%60;
+
+  /* convert days since 2000-01-01 to a civil date (proleptic
+     gregorian calendar), counting from 0000-03-01 so that
+     the leap day is at the end of the year */
+  qint64 z = days + 10957 + 719468;
+  qint64 era = (z>=0 ? z : z-146096) / 146097;
+  int doe = (int)(z - era*146097);
+  int yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+  int doy = doe - (365*yoe + yoe/4 - yoe/100);
+  int mp = (5*doy+2)/153;
+  d.m_day = doy - (153*mp+2)/5 + 1;
+  d.m_month = mp<10 ? mp+3 : mp-9;
+  d.m_year = (int)(yoe + era*400) + (d.m_month<=2);
+
+  char buf[30];
+  sprintf(buf, "%04d%02d%02d%02d%02d%02d", d.m_year, d.m_month, d.m_day,
+	  d.m_hour, d.m_min, d.m_sec);
+  d.m_sYYYYMMDDHHMMSS = QString::fromLatin1(buf, 14);
+  sprintf(buf, "%02d/%02d/%04d", d.m_day, d.m_month, d.m_year);
+  d.m_sDate = QString::fromLatin1(buf);
+  d.m_null = false;
+  return d;
+}
+
+qint64
+date::pg_timestamp() const
+{
+  if (m_null)
+    return null_pg_timestamp;
+  // days since 0000-03-01, as in from_pg_timestamp()
+  int y = m_year - (m_month<=2);
+  qint64 era = (y>=0 ? y : y-399) / 400;
+  int yoe = (int)(y - era*400);
+  int doy = (153*(m_month>2 ? m_month-3 : m_month+9) + 2)/5 + m_day-1;
+  int doe = yoe*365 + yoe/4 - yoe/100 + doy;
+  qint64 days = era*146097 + doe - 719468 - 10957;
+  return (days*86400 + m_hour*3600 + m_min*60 + m_sec)*Q_INT64_C(1000000)
+    + m_usec;
+}
+
 bool
 date::operator<(const date& other) const
 {
-  return m_sYYYYMMDDHHMMSS.compare(other.FullOutput()) < 0;
+  int c = m_sYYYYMMDDHHMMSS.compare(other.FullOutput());
+  return c<0 || (c==0 && m_usec<other.m_usec);
+}
+
+/* ISO 8601 basic format, parsed the same way whatever the DateStyle,
+   and cast to timestamp without any time zone conversion */
+QString
+date::sql_timestamp() const
+{
+  char buf[40];
+  sprintf(buf, "'%04d%02d%02d %02d%02d%02d.%06d'::timestamp", m_year, m_month,
+	  m_day, m_hour, m_min, m_sec, m_usec);
+  return QString::fromLatin1(buf);
 }
 
 QString
 date::OutputHM(int date_format) const
 {
-  QString s;
   if (m_null)
     return QString("");
+  return format_hm(m_year, m_month, m_day, m_hour, m_min, m_sec, date_format);
+}
 
+//static
+QString
+date::format_hm(int year, int month, int day, int hour, int min, int sec,
+		int date_format)
+{
+  QString s;
   if (date_format==1)		// european
-    s.sprintf("%02d/%02d/%04d %02d:%02d", m_day, m_month, m_year, m_hour, m_min);
+    s.sprintf("%02d/%02d/%04d %02d:%02d", day, month, year, hour, min);
   else if (date_format==2)				// US
-    s.sprintf("%04d/%02d/%02d %02d:%02d", m_year, m_month, m_day, m_hour, m_min);
+    s.sprintf("%04d/%02d/%02d %02d:%02d", year, month, day, hour, min);
   else { // local
-    QDateTime dt = QDateTime::fromString(m_sYYYYMMDDHHMMSS, "yyyyMMddHHmmss");
+    QDateTime dt(QDate(year, month, day), QTime(hour, min, sec));
     s = dt.toString(Qt::DefaultLocaleShortDate);
   }
   return s;
@@ -99,22 +180,3 @@ date::output_8() const
   QDate d = QDate::fromString(m_sYYYYMMDDHHMMSS.left(8), "yyyyMMdd");
   return d.toString(Qt::DefaultLocaleShortDate);
 }
-
-// QStandardItem => date_item
-date_item::date_item(date d, int format) // TODO: use an enum for format, or better, deduce it from the locale
-{
-  setText(d.OutputHM(format));
-  QVariant vdate;
-  vdate.setValue(d);
-  setData(vdate, date_role);
-}
-
-bool
-date_item::operator< (const QStandardItem & other) const
-{
-  QVariant vd = data(date_role);
-  QVariant vd2 = other.data(date_role);
-  date d=vd.value<date>();
-  date d2=vd2.value<date>();
-  return d<d2;
-}
@@ -22,19 +22,34 @@
 
 #include <QString>
 #include <QVariant>
-#include <QStandardItem>
 
 class date
 {
 public:
-  date(): m_null(true) {}
+  date(): m_null(true), m_usec(0) {}
   date(const QString date);
   virtual ~date() {}
+  /* build from a PostgreSQL binary timestamp (without time zone):
+     microseconds since 2000-01-01 00:00:00 */
+  static date from_pg_timestamp(qint64 usecs);
+  /* the reverse of from_pg_timestamp(), with null_pg_timestamp for a
+     null date and back */
+  qint64 pg_timestamp() const;
+  static const qint64 null_pg_timestamp;
   QString Output() const { return m_sDate; }
   QString OutputHM(int) const;
+  // OutputHM() of a date given by its fields
+  static QString format_hm(int year, int month, int day, int hour, int min,
+			   int sec, int date_format);
   QString output_24() const;
   QString output_8() const;
   QString FullOutput() const { return m_sYYYYMMDDHHMMSS; }
+  // fractional part of the seconds, in microseconds
+  int usec() const { return m_usec; }
+  void set_usec(int usec) { m_usec=usec; }
+  /* SQL literal of type timestamp with the full precision. There's
+     no colon in it, so that it can go into a sql_stream query */
+  QString sql_timestamp() const;
   bool is_null() const {
     return m_null;
   }
@@ -46,17 +61,10 @@ private:
   int m_hour;
   int m_min;
   int m_sec;
+  int m_usec;
   bool m_null;
 };
 
-class date_item : public QStandardItem
-{
-public:
-  date_item(date d, int format);
-  static const int date_role = Qt::UserRole+3;
-  bool operator< (const QStandardItem& other) const;
-};
-
 Q_DECLARE_METATYPE(date)
 
 #endif // INC_DATE_H
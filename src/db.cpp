@@ -33,12 +33,14 @@
 #include <QRegExp>
 #include <QStringList>
 #include <QByteArray>
+#include <QTime>
 
 #include "database.h"
 #include "sqlstream.h"
 #include "sqlquery.h"
 #include "addresses.h"
 #include "db_listener.h"
+#include "query_stats.h"
 
 #include <QMessageBox>
 #include <QTextCodec>
@@ -93,6 +95,7 @@ ConnectDb(const char* cnx_string, QString* errstr)
   try {
     pgDb.logon(cnx_string);
     db_cnx::set_connect_string(cnx_string);
+    db_cnx::start_pool_maintenance();
     db_cnx db;
     sql_stream s("SELECT current_database()", db);
     if (!s.eos()) {
@@ -115,11 +118,13 @@ void // static
 db_cnx::disconnect_all()
 {
   // close secondary connections
+  QMutexLocker locker(&m_mutex);
   std::list<db_cnx_elt*>::iterator it=m_cnx_list.begin();
   for (; it!=m_cnx_list.end(); it++) {
     if ((*it)->m_connected) {
       (*it)->m_db->logoff();
       (*it)->m_connected=false;
+      m_stats.closed++;
     }
   }
 }
@@ -164,7 +169,7 @@ pgConnection::add_listener(db_listener* listener)
   m_listeners.append(listener);
   QString s = "LISTEN " + listener->notification_name();
   QByteArray ba = s.toUtf8();
-  PQexec(m_pgConn, ba.constData());
+  PQexec(connection(), ba.constData());
 }
 
 void
@@ -174,15 +179,21 @@ pgConnection::remove_listener(db_listener* listener)
   if (i>=0) {
     QString s = "UNLISTEN " + listener->notification_name();
     QByteArray ba = s.toUtf8();
-    PQexec(m_pgConn, ba.constData());
+    PQexec(connection(), ba.constData());
     m_listeners.removeAt(i);
   }
 }
 
 // static data members
-bool db_cnx::m_initialized;
 std::list<db_cnx_elt*> db_cnx::m_cnx_list;
 QMutex db_cnx::m_mutex;
+QWaitCondition db_cnx::m_released;
+int db_cnx::m_pool_min=1;
+int db_cnx::m_pool_max=5;
+int db_cnx::m_acquire_timeout=30000;
+int db_cnx::m_idle_timeout=300;
+db_pool_stats db_cnx::m_stats;
+db_pool_maintainer* db_cnx::m_maintainer;
 QString db_cnx::m_connect_string;
 QString db_cnx::m_dbname;
 
@@ -207,6 +218,13 @@ db_cnx::dbname()
   return m_dbname;
 }
 
+// static
+const QString&
+db_cnx::connect_string()
+{
+  return m_connect_string;
+}
+
 
 /* idle(): Return false if at least one non-primary connection is in
    use, meaning that we're probably running a query in a sub-thread.
@@ -216,7 +234,7 @@ db_cnx::dbname()
 bool
 db_cnx::idle()
 {
-  // TODO: do we need to use m_mutex here?
+  QMutexLocker locker(&m_mutex);
   std::list<db_cnx_elt*>::iterator it=m_cnx_list.begin();
   for (; it!=m_cnx_list.end(); it++) {
     if (!(*it)->m_available)
@@ -225,76 +243,309 @@ db_cnx::idle()
   return true;
 }
 
+// static
+void
+db_cnx::set_pool_parameters(int min_size, int max_size,
+			    int acquire_timeout, int idle_timeout)
+{
+  QMutexLocker locker(&m_mutex);
+  m_pool_max = max_size>0 ? max_size : 1;
+  m_pool_min = (min_size>=0 && min_size<=m_pool_max) ? min_size : m_pool_max;
+  m_acquire_timeout = acquire_timeout;
+  m_idle_timeout = idle_timeout;
+  m_released.wakeAll();	// waiters may now be allowed to open a connection
+}
 
-db_cnx::~db_cnx()
+// static
+db_pool_stats
+db_cnx::pool_stats()
 {
-  if (m_cnx) {
-    std::list<db_cnx_elt*>::iterator it=m_cnx_list.begin();
-    for (; it!=m_cnx_list.end(); it++) {
-      if ((*it)->m_db == m_cnx) {
-	(*it)->m_available=true;
-      }
+  QMutexLocker locker(&m_mutex);
+  db_pool_stats st=m_stats;
+  st.size=0;
+  st.in_use=0;
+  std::list<db_cnx_elt*>::iterator it=m_cnx_list.begin();
+  for (; it!=m_cnx_list.end(); it++) {
+    if ((*it)->m_connected)
+      st.size++;
+    if (!(*it)->m_available)
+      st.in_use++;
+  }
+  return st;
+}
+
+// static
+void
+db_cnx::start_pool_maintenance()
+{
+  if (!m_maintainer)
+    m_maintainer = new db_pool_maintainer(check_interval*1000/2);
+}
+
+// static. Must be called with m_mutex locked
+void
+db_cnx::close_elt(db_cnx_elt* elt)
+{
+  if (elt->m_db) {
+    delete elt->m_db;		// logs off
+    elt->m_db=NULL;
+  }
+  if (elt->m_connected) {
+    elt->m_connected=false;
+    m_stats.closed++;
+  }
+}
+
+/*
+  Close the connections that have been idle for too long, keeping at
+  least m_pool_min of them. This runs in the GUI thread, so nothing
+  here waits for the server: the liveness of the connections that
+  are kept is checked by acquire() when they're next used.
+*/
+// static
+void
+db_cnx::pool_maintenance()
+{
+  if (m_idle_timeout<=0)
+    return;
+  time_t now=time(NULL);
+  QMutexLocker locker(&m_mutex);
+  int nb_connected=0;
+  std::list<db_cnx_elt*>::iterator it;
+  for (it=m_cnx_list.begin(); it!=m_cnx_list.end(); ++it) {
+    if ((*it)->m_connected)
+      nb_connected++;
+  }
+  it=m_cnx_list.begin();
+  while (it!=m_cnx_list.end() && nb_connected>m_pool_min) {
+    db_cnx_elt* elt=*it;
+    if (elt->m_available && elt->m_connected &&
+	now-elt->m_last_used >= m_idle_timeout)
+    {
+      DBG_PRINTF(3, "Closing an idle database connection");
+      close_elt(elt);
+      delete elt;
+      it=m_cnx_list.erase(it);
+      nb_connected--;
     }
+    else
+      ++it;
+  }
+}
+
+db_pool_maintainer::db_pool_maintainer(int interval_ms)
+{
+  connect(&m_timer, SIGNAL(timeout()), this, SLOT(run()));
+  m_timer.start(interval_ms);
+}
+
+void
+db_pool_maintainer::run()
+{
+  db_cnx::pool_maintenance();
+}
+
+db_cnx::~db_cnx()
+{
+  if (m_cancel_token)
+    m_cancel_token->attach(NULL);
+  if (m_timeout_set) {
+    // may fail inside an aborted transaction, which is harmless
+    PGresult* res = PQexec(connection(), "RESET statement_timeout");
+    if (res)
+      PQclear(res);
+  }
+  if (m_elt) {
+    QMutexLocker locker(&m_mutex);
+    m_elt->m_available=true;
+    m_elt->m_last_used=time(NULL);
+    m_released.wakeOne();
   }
 }
 
-db_cnx::db_cnx(bool other_thread)
+db_cnx::db_cnx(bool other_thread) : m_cnx(NULL), m_elt(NULL),
+  m_cancel_token(NULL), m_timeout_set(false)
 {
+  m_alerts_enabled=true;
   if (!other_thread) {
     // just use the main connection for the main thread
     m_cnx=&pgDb;
     return;
   }
+  acquire();
+}
+
+/*
+  Take a connection from the pool: an idle one if possible, otherwise
+  open a new one if the maximum size isn't reached, otherwise wait
+  for a connection to be released. Opening a connection and checking
+  one that has been idle for a while are done outside of the lock.
+*/
+void
+db_cnx::acquire()
+{
+  QTime wait_start;
+  wait_start.start();
+  bool waited=false;
+  db_cnx_elt* elt=NULL;
 
-  const int max_cnx=5;
   m_mutex.lock();
-  if (!m_initialized) {
-    for (int i=0; i<max_cnx; i++) {
-      db_cnx_elt* p = new db_cnx_elt;
-      m_cnx_list.push_back(p);
+  while (!elt) {
+    std::list<db_cnx_elt*>::iterator it;
+    for (it=m_cnx_list.begin(); it!=m_cnx_list.end(); ++it) {
+      if ((*it)->m_available && (*it)->m_connected) {
+	elt=*it;
+	break;
+      }
+    }
+    if (!elt) {
+      // a slot whose connection has been closed, or a new one
+      for (it=m_cnx_list.begin(); it!=m_cnx_list.end(); ++it) {
+	if ((*it)->m_available) {
+	  elt=*it;
+	  break;
+	}
+      }
+      if (!elt && (int)m_cnx_list.size() < m_pool_max) {
+	elt = new db_cnx_elt;
+	m_cnx_list.push_back(elt);
+      }
+    }
+    if (!elt) {
+      int remaining = m_acquire_timeout - wait_start.elapsed();
+      if (remaining<=0 || !m_released.wait(&m_mutex, remaining)) {
+	m_stats.timeouts++;
+	int max_cnx=m_pool_max;
+	m_mutex.unlock();
+	DBG_PRINTF(2, "No database connection found");
+	throw db_excpt(NULL, QObject::tr("The %1 database connections are already in use.").arg(max_cnx));
+      }
+      waited=true;
     }
-    m_initialized=true;
   }
+  elt->m_available=false;
+  m_mutex.unlock();
 
-  std::list<db_cnx_elt*>::iterator it = m_cnx_list.begin();
-  for (; it!=m_cnx_list.end(); it++) {
-    if ((*it)->m_available) {
-      pgConnection* p;
-      if (!(*it)->m_connected) {
-	p = new pgConnection;
-	DBG_PRINTF(3, "Opening a new database connection");
-	(*it)->m_db = p;
-	p->logon(m_connect_string.toLocal8Bit().constData());
-	(*it)->m_connected=true;
+  time_t now=time(NULL);
+  try {
+    if (!elt->m_connected) {
+      DBG_PRINTF(3, "Opening a new database connection");
+      if (elt->m_db)
+	delete elt->m_db;
+      pgConnection* p = new pgConnection;
+      elt->m_db = p;
+      p->logon(m_connect_string.toLocal8Bit().constData());
+      elt->m_connected=true;
+      elt->m_last_checked=now;
+      QMutexLocker locker(&m_mutex);
+      m_stats.opened++;
+    }
+    else if (now-elt->m_last_checked >= check_interval) {
+      pgConnection* p = static_cast<pgConnection*>(elt->m_db);
+      if (!p->ping() && !p->reconnect()) {
+	QMutexLocker locker(&m_mutex);
+	m_stats.failed_checks++;
+	throw db_excpt("connect", PQerrorMessage(p->connection()));
       }
-      (*it)->m_available=false;
-      m_cnx = dynamic_cast<pgConnection*>((*it)->m_db); // FIXME??
-      break;
+      elt->m_last_checked=now;
     }
   }
-  m_mutex.unlock();
+  catch(db_excpt& e) {
+    QMutexLocker locker(&m_mutex);
+    close_elt(elt);
+    m_cnx_list.remove(elt);
+    delete elt;
+    m_released.wakeOne();
+    throw e;
+  }
 
-  m_alerts_enabled=true;
+  m_cnx = static_cast<pgConnection*>(elt->m_db);
+  m_elt = elt;
 
-#if 0
-  {
-    // DEBUG
-    QString state;
-    int i=0;
-    std::list<db_cnx_elt*>::iterator it2 = m_cnx_list.begin();
-    for (; it2!=m_cnx_list.end(); ++it2,++i) {
-      state.append(QString("\nconnection %1 connected:%2 available:%3").arg(i).arg((*it2)->m_connected).arg((*it2)->m_available));
-    }
-    DBG_PRINTF(3, "Connections: %s", state.toLocal8Bit().constData());
+  QMutexLocker locker(&m_mutex);
+  m_stats.acquired++;
+  if (waited) {
+    m_stats.waited++;
+    if (wait_start.elapsed() > m_stats.max_wait_ms)
+      m_stats.max_wait_ms = wait_start.elapsed();
   }
-#endif
+}
+
+void
+db_cnx::set_cancel_token(db_cancel_token* token)
+{
+  if (m_cancel_token)
+    m_cancel_token->attach(NULL);
+  m_cancel_token=token;
+  if (token)
+    token->attach(connection());
+}
+
+void
+db_cnx::set_statement_timeout(int ms)
+{
+  char query[50];
+  sprintf(query, "SET statement_timeout=%d", ms);
+  PGresult* res = PQexec(connection(), query);
+  if (!res)
+    throw db_excpt(query, PQerrorMessage(connection()));
+  if (PQresultStatus(res)!=PGRES_COMMAND_OK) {
+    db_excpt e(query, PQresultErrorMessage(res),
+	       QString(PQresultErrorField(res, PG_DIAG_SQLSTATE)));
+    PQclear(res);
+    throw e;
+  }
+  PQclear(res);
+  m_timeout_set=true;
+}
 
-  if (it==m_cnx_list.end()) {
-    DBG_PRINTF(2, "No database connection found");
-    throw db_excpt(NULL, QObject::tr("The %1 database connections are already in use.").arg(max_cnx));
+db_cancel_token::db_cancel_token() : m_pgcancel(NULL), m_cancelled(false)
+{
+}
+
+db_cancel_token::~db_cancel_token()
+{
+  if (m_pgcancel)
+    PQfreeCancel(m_pgcancel);
+}
+
+// Called by db_cnx with the connection to cancel, or NULL to detach
+void
+db_cancel_token::attach(PGconn* c)
+{
+  QMutexLocker locker(&m_mutex);
+  if (m_pgcancel)
+    PQfreeCancel(m_pgcancel);
+  m_pgcancel = c ? PQgetCancel(c) : NULL;
+}
+
+void
+db_cancel_token::cancel()
+{
+  QMutexLocker locker(&m_mutex);
+  m_cancelled=true;
+  if (m_pgcancel) {
+    char errbuf[256];
+    /* PQcancel is safe to call from another thread than the one
+       running the query, unlike PQrequestCancel */
+    if (!PQcancel(m_pgcancel, errbuf, sizeof(errbuf)))
+      DBG_PRINTF(2, "PQcancel failed: %s", errbuf);
   }
 }
 
+bool
+db_cancel_token::cancelled() const
+{
+  QMutexLocker locker(&m_mutex);
+  return m_cancelled;
+}
+
+void
+db_cancel_token::reset()
+{
+  QMutexLocker locker(&m_mutex);
+  m_cancelled=false;
+}
 
 int
 pgConnection::logon(const char* conninfo)
@@ -327,6 +578,7 @@ pgConnection::logon(const char* conninfo)
       PQclear(res);
   }
   PQexec(m_pgConn, "SET standard_conforming_strings=on");
+  check_server_settings();
 
   if (this==&pgDb)
     m_notifier = new pg_notifier(this);
@@ -338,22 +590,31 @@ void
 pgConnection::logoff()
 {
   if (m_pgConn) {
-    if (m_notifier)
+    if (m_notifier) {
       delete m_notifier;
-    
+      m_notifier=NULL;
+    }
+
     PQfinish(m_pgConn);
     m_pgConn=NULL;
   }
+  m_prepared.clear();
 }
 
 bool
 pgConnection::reconnect()
 {
   DBG_PRINTF(3, "pgConnection::reconnect()");
+  if (m_notifier && m_notifier->busy())
+    m_notifier->complete_running();
+  // a new backend doesn't know our prepared statements
+  m_prepared.clear();
   if (m_pgConn) {
     PQreset(m_pgConn);
     if (PQstatus(m_pgConn)!=CONNECTION_OK)
       return false;
+    // the server may have been upgraded meanwhile
+    check_server_settings();
   }
   for (int i=0; i<m_listeners.size(); i++) {
     /* Reinitialize listeners. It is necessary if the db backend
@@ -365,6 +626,17 @@ pgConnection::reconnect()
   return true;
 }
 
+/* Read the settings that libpq received when connecting, that
+   decide how results are to be decoded */
+void
+pgConnection::check_server_settings()
+{
+  const char* v = PQparameterStatus(m_pgConn, "integer_datetimes");
+  m_integer_datetimes = (v && !strcmp(v, "on"));
+  if (!m_integer_datetimes)
+    DBG_PRINTF(3, "No integer timestamps: binary results are disabled");
+}
+
 bool
 pgConnection::ping()
 {
@@ -377,7 +649,7 @@ pgConnection::ping()
     return true;
   }
 
-  PGresult* res = PQexec(m_pgConn, "SELECT 1");
+  PGresult* res = PQexec(connection(), "SELECT 1");
   if (res) {
     bool ret = (PQresultStatus(res)==PGRES_TUPLES_OK);
     PQclear(res);
@@ -387,6 +659,60 @@ pgConnection::ping()
     return false;
 }
 
+const char*
+pgConnection::prepared_statement(const std::string& query_fmt) const
+{
+  std::map<std::string,std::string>::const_iterator it = m_prepared.find(query_fmt);
+  if (it!=m_prepared.end())
+    return it->second.c_str();
+  else
+    return NULL;
+}
+
+/*
+  Prepare 'pg_query' (with $1..$N parameters) on the server and remember
+  it under 'query_fmt'. Returns the name of the new statement or
+  throws a db_excpt if the server refused to prepare it.
+*/
+const char*
+pgConnection::prepare_statement(const std::string& query_fmt,
+				const char* pg_query,
+				int nparams)
+{
+  if ((int)m_prepared.size() >= max_prepared)
+    clear_prepared_statements();
+
+  char name[30];
+  sprintf(name, "mstmt_%d", ++m_prepared_seq);
+  DBG_PRINTF(5, "prepare %s: %s", name, pg_query);
+  PGresult* res = PQprepare(m_pgConn, name, pg_query, nparams, NULL);
+  if (!res)
+    throw db_excpt(pg_query, PQerrorMessage(m_pgConn));
+  if (PQresultStatus(res)!=PGRES_COMMAND_OK) {
+    db_excpt e(pg_query, PQresultErrorMessage(res),
+	       QString(PQresultErrorField(res, PG_DIAG_SQLSTATE)));
+    PQclear(res);
+    throw e;
+  }
+  PQclear(res);
+  std::string& n = m_prepared[query_fmt];
+  n = name;
+  return n.c_str();
+}
+
+void
+pgConnection::clear_prepared_statements()
+{
+  if (m_pgConn && !m_prepared.empty()) {
+    /* Statement names are never reused, so if DEALLOCATE fails
+       (e.g. inside an aborted transaction) the leftovers are harmless */
+    PGresult* res = PQexec(m_pgConn, "DEALLOCATE ALL");
+    if (res)
+      PQclear(res);
+  }
+  m_prepared.clear();
+}
+
 QString
 pgConnection::escape_string_literal(const QString src)
 {
@@ -554,10 +880,11 @@ db_cnx::escape_string_literal(const QString str)
   return m_cnx->escape_string_literal(str);
 }
 
-pg_notifier::pg_notifier(pgConnection* cnx)
+pg_notifier::pg_notifier(pgConnection* cnx) :
+  m_socket_notifier(NULL), m_running(NULL), m_delivery_scheduled(false)
 {
   m_pgcnx = cnx;
-  PGconn* c = cnx->connection();
+  PGconn* c = cnx->m_pgConn;
   int socket = PQsocket(c);
   if (socket != -1) {
     DBG_PRINTF(3, "Instantiate a new QSocketNotifier on fd=%d", socket);
@@ -573,25 +900,207 @@ pg_notifier::~pg_notifier()
 {
   if (m_socket_notifier)
     delete m_socket_notifier;
+  // the connection is going away: fail the pending queries
+  if (m_running) {
+    m_queue.push_front(m_running);
+    m_running=NULL;
+  }
+  while (!m_queue.empty()) {
+    db_async_reply* r=m_queue.front();
+    m_queue.pop_front();
+    r->set_error(tr("The database connection has been closed"));
+    m_done.push_back(r);
+  }
+  deliver();
+}
+
+void
+pg_notifier::submit(db_async_reply* r)
+{
+  m_queue.push_back(r);
+  if (!m_running)
+    send_next();
+}
+
+void
+pg_notifier::send_next()
+{
+  PGconn* c = m_pgcnx->m_pgConn;
+  while (!m_running && !m_queue.empty()) {
+    db_async_reply* r=m_queue.front();
+    m_queue.pop_front();
+    if (r->m_abandoned) {
+      delete r;
+      continue;
+    }
+    DBG_PRINTF(5, "execute async: %s", r->query().constData());
+    r->m_sent_at=query_stats::clock_us();
+    if (PQsendQuery(c, r->query().constData())) {
+      m_running=r;
+      PQflush(c);
+    }
+    else {
+      r->set_error(PQerrorMessage(c));
+      query_done(r);
+    }
+  }
+}
+
+/*
+  Read the results of the running query. If 'wait' is false, only
+  the results that are entirely in libpq's buffer are taken.
+*/
+void
+pg_notifier::collect_results(bool wait)
+{
+  PGconn* c = m_pgcnx->m_pgConn;
+  while (m_running) {
+    if (!wait && PQisBusy(c))
+      break;
+    PGresult* res=PQgetResult(c);
+    if (!res) {
+      db_async_reply* r=m_running;
+      m_running=NULL;
+      if (query_stats::enabled()) {
+	int rows=0;
+	qint64 bytes=0;
+	for (unsigned int i=0; i<r->m_results.size(); i++) {
+	  rows += PQntuples(r->m_results[i]);
+	  bytes += query_stats::result_bytes(r->m_results[i]);
+	}
+	query_stats::record(r->query().constData(),
+			    query_stats::clock_us()-r->m_sent_at, rows, bytes);
+      }
+      query_done(r);
+      break;
+    }
+    ExecStatusType st=PQresultStatus(res);
+    if (st!=PGRES_TUPLES_OK && st!=PGRES_COMMAND_OK) {
+      if (!m_running->failed())
+	m_running->set_error(PQresultErrorMessage(res),
+			     PQresultErrorField(res, PG_DIAG_SQLSTATE));
+      PQclear(res);
+    }
+    else
+      m_running->m_results.push_back(res);
+  }
+}
+
+void
+pg_notifier::query_done(db_async_reply* r)
+{
+  if (r->m_abandoned) {
+    delete r;
+    return;
+  }
+  m_done.push_back(r);
+  if (!m_delivery_scheduled) {
+    m_delivery_scheduled=true;
+    QTimer::singleShot(0, this, SLOT(deliver()));
+  }
+}
+
+void
+pg_notifier::complete_running()
+{
+  DBG_PRINTF(5, "waiting for the async query to complete");
+  collect_results(true);
+}
+
+// slot. Emit finished() for the completed queries
+void
+pg_notifier::deliver()
+{
+  m_delivery_scheduled=false;
+  while (!m_done.empty()) {
+    db_async_reply* r=m_done.front();
+    m_done.pop_front();
+    if (r->m_abandoned)
+      delete r;
+    else {
+      r->m_done=true;
+      emit r->finished();
+    }
+  }
+  // the queue may have been held by a synchronous query
+  send_next();
+}
+
+db_async_reply::db_async_reply(const QByteArray& query) :
+  m_query(query), m_abandoned(false), m_done(false), m_sent_at(0)
+{
+}
+
+db_async_reply::~db_async_reply()
+{
+  for (unsigned int i=0; i<m_results.size(); i++) {
+    if (m_results[i])
+      PQclear(m_results[i]);
+  }
+}
+
+PGresult*
+db_async_reply::take_result(int index)
+{
+  if (index<0 || index>=(int)m_results.size())
+    return NULL;
+  PGresult* res=m_results[index];
+  m_results[index]=NULL;
+  return res;
+}
+
+void
+db_async_reply::set_error(const QString msg, const QString code)
+{
+  m_errmsg=msg;
+  m_errcode=code;
+}
+
+void
+db_async_reply::abandon()
+{
+  if (m_done)
+    deleteLater();
+  else
+    m_abandoned=true;	// the notifier will delete it
+}
+
+db_async_reply*
+pgConnection::exec_async(const QString query)
+{
+  if (!m_notifier || !m_pgConn)
+    return NULL;
+  QByteArray q;
+  if (encoding()=="UTF8")
+    q=query.toUtf8();
+  else
+    q=query.toLocal8Bit();
+  db_async_reply* r = new db_async_reply(q);
+  m_notifier->submit(r);
+  return r;
 }
 
 void
 pg_notifier::process_notification()
 {
-  PGconn* c = m_pgcnx->connection();
+  PGconn* c = m_pgcnx->m_pgConn;
   DBG_PRINTF(3, "process_notification() on socket %d", PQsocket(c));
   int r=PQconsumeInput(c);
   if (r==0) {
     DBG_PRINTF(3, "PQconsumeInput returns 0");
+    if (m_running)
+      collect_results(true); // gets the error
   }
   else {
+    if (m_running)
+      collect_results(false);
     PGnotify* n;
     while ((n=PQnotifies(c))!=NULL) {
       DBG_PRINTF(3, "received db notify for %s", n->relname);
       for (int i=0; i<m_pgcnx->m_listeners.count(); i++) {
 	db_listener* l = m_pgcnx->m_listeners.at(i);
 	if (n->relname == l->notification_name()) {
-	  l->process_notification();
+	  l->process_notification(QString::fromUtf8(n->extra));
 	}
       }
       PQfreemem(n);
@@ -45,8 +45,9 @@ db_listener::~db_listener()
 
 // slot
 void
-db_listener::process_notification()
+db_listener::process_notification(const QString& payload)
 {
   DBG_PRINTF(4, "process notification this=%p", this);
   emit notified();
+  emit notified(payload);
 }
@@ -45,9 +45,11 @@ public:
     return m_notif_name;
   }
 public slots:
-  void process_notification();
+  void process_notification(const QString& payload=QString());
 signals:
   void notified();
+  // with the payload of the NOTIFY, which may be empty
+  void notified(const QString& payload);
 private:
   QString m_notif_name;
   database* m_db;
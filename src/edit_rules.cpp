@@ -736,6 +736,7 @@ filter_edit::test_expr()
   f->set_date_order(-1);
   f->m_include_trash = true;
   m_fthread = new fetch_thread();
+  connect(m_fthread, SIGNAL(fetch_done(int)), this, SLOT(fetch_finished(int)));
   m_nb_filter_test_match = 0;
   int r = f->asynchronous_fetch(m_fthread);
   DBG_PRINTF(3, "asynchronous_fetch return: %d", r);
@@ -760,18 +761,16 @@ filter_edit::test_expr()
 
     m_test_window_results->show_progressbar();
     m_filter_run_stopped = false;
-    m_ftimer = new QTimer(this);
-    connect(m_ftimer, SIGNAL(timeout()), this, SLOT(timer_done()));
     m_waiting_for_results = true;
-    m_ftimer->start(100);		// check results every 1/10s
   }
 }
 
 void
-filter_edit::timer_done()
+filter_edit::fetch_finished(int generation)
 {
-  if (m_waiting_for_results && m_fthread->isFinished()) {
+  if (m_waiting_for_results && generation==m_fthread->m_generation) {
     m_waiting_for_results=false;
+    m_fthread->wait();
 
     m_test_msgs_filter->postprocess_fetch(*m_fthread);
 
@@ -791,7 +790,6 @@ filter_edit::timer_done()
 	else {
 	  if (!res.errstr.isEmpty()) {
 	    // Stop the test on any evaluation error
-	    m_ftimer->stop();
 	    m_test_window_results->hide_progressbar();
 	    QMessageBox::critical(this, tr("Filter error"), tr("Error near character %1:\n%2").arg(res.evp+1).arg(res.errstr));
 	    if (m_test_window_results->nb_results()==0)
@@ -819,7 +817,6 @@ filter_edit::timer_done()
 	finished=true;
     }
     if (finished) {
-      delete m_ftimer;
       m_fthread->release();
       delete m_fthread;
       delete m_test_msgs_filter;
@@ -160,7 +160,7 @@ private slots:
   void show_eval_message();
   void end_test_requested();
   void display_expression_validity();
-  void timer_done();
+  void fetch_finished(int generation);
   void close_results_window();
   void filter_out_exprs(const QString&);
   void enable_up_down_buttons(bool);
@@ -195,7 +195,6 @@ private:
   bool m_confirm_close;
   fetch_thread* m_fthread;
   msgs_filter* m_test_msgs_filter;
-  QTimer* m_ftimer;
   QTimer* m_eval_timer;
   bool m_waiting_for_results;
   bool m_filter_run_stopped;
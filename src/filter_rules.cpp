@@ -220,13 +220,34 @@ expr_list::update_db()
   db_cnx db;
   try {
     db.begin_transaction();
+    /* Get the ids of the new expressions in one query, and queue
+       the changes to send them together */
+    std::list<unsigned int> new_ids;
+    int nb_new=0;
+    for (std::list<filter_expr>::iterator itn=begin(); itn!=end(); ++itn) {
+      if (!itn->m_expr_id && !itn->m_delete)
+	nb_new++;
+    }
+    if (nb_new>0) {
+      sql_stream s_seq("SELECT nextval('seq_filter_expr_id') FROM generate_series(1,:n)", db);
+      s_seq << nb_new;
+      while (!s_seq.eof()) {
+	unsigned int id;
+	s_seq >> id;
+	new_ids.push_back(id);
+      }
+    }
+    sql_batch batch(db);
     sql_stream s_upd("UPDATE filter_expr SET name=:name,expression=:expr, user_lastmod=:user, last_update=now(),direction=':d',apply_order=:a WHERE expr_id=:id", db);
     sql_stream s_del_expr("DELETE FROM filter_expr WHERE expr_id=:id", db);
     sql_stream s_ins("INSERT INTO filter_expr(expr_id,name,expression,direction,apply_order) VALUES (:id,:name,:expr,':dir',:a)", db);
-    // TODO: use a sequence
-    sql_stream s_seq("SELECT nextval('seq_filter_expr_id')", db, false);
     sql_stream s_del_act("DELETE FROM filter_action WHERE expr_id=:p1", db);
     sql_stream s_add_act("INSERT INTO filter_action(expr_id,action_arg,action_type,action_order) VALUES(:p1,:p2,:p3,:p4)", db);
+    s_upd.set_batch(&batch);
+    s_del_expr.set_batch(&batch);
+    s_ins.set_batch(&batch);
+    s_del_act.set_batch(&batch);
+    s_add_act.set_batch(&batch);
 
     std::list<filter_expr>::iterator itd = begin();
     for (; itd != end(); ++itd) {
@@ -241,8 +262,8 @@ expr_list::update_db()
       unsigned int db_expr_id=it->m_expr_id;
       if (!db_expr_id) {
 	if (!it->m_delete) {
-	  s_seq.execute();
-	  s_seq >> db_expr_id;
+	  db_expr_id=new_ids.front();
+	  new_ids.pop_front();
 	  s_ins << db_expr_id;
 	  if (it->m_expr_name.isEmpty())
 	    s_ins << sql_null();
@@ -271,6 +292,7 @@ expr_list::update_db()
 	}
       }
     } // for each expr
+    batch.execute();
     db.commit_transaction();
   }
   catch(db_excpt& p) {
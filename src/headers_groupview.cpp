@@ -26,6 +26,8 @@
 #include <QHBoxLayout>
 #include <QVBoxLayout>
 #include <QCloseEvent>
+#include <QProgressDialog>
+#include <QApplication>
 
 #include "db.h"
 #include "main.h"
@@ -82,10 +84,21 @@ headers_groupview::init(const std::list<unsigned int>& id_list)
   int headers_count=0;
   db_cnx db;
   sql_stream s("SELECT lines FROM header WHERE mail_id=:p1", db);
+  s.set_prepared();
   std::list<unsigned int>::const_iterator iter=id_list.begin();
   QString h;
   m_mv_t::iterator v_it;
+  // one query per message: let the user interrupt a long analysis
+  QProgressDialog progress(tr("Analyzing headers..."), tr("Abort"),
+			   0, id_list.size(), this);
+  progress.setMinimumDuration(1000);
   for (; iter!=id_list.end(); ++iter) {
+    if ((headers_count%50)==0) {
+      progress.setValue(headers_count);
+      QApplication::processEvents();
+      if (progress.wasCanceled())
+	break;
+    }
     s << *iter;
     if (!s.eos()) {
       s >> h;
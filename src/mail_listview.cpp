@@ -21,26 +21,39 @@
 #include "msg_list_window.h"
 #include "selectmail.h"
 #include "icons.h"
+#include "string_pool.h"
 
 #include <QKeyEvent>
 #include <QHeaderView>
 #include <QMenu>
 #include <QMessageBox>
+#include <QScrollBar>
 
-flag_item::flag_item(const QIcon& icon) : QStandardItem(icon, "")
-{
-}
+#include <algorithm>
 
-flag_item::flag_item() : QStandardItem("")
+mail_item_model::mail_item_model(QObject* parent) : QAbstractItemModel(parent)
 {
+  m_date_format=0;
+  m_display_sender_names=false;
+  m_bold_font.setBold(true);
 }
 
-mail_item_model::mail_item_model(QObject* parent) : QStandardItemModel(parent)
+mail_item_model::~mail_item_model()
 {
+  release_strings();
 }
 
-mail_item_model::~mail_item_model()
+void
+mail_item_model::release_strings()
 {
+  for (uint n=0; n<m_ids.size(); n++) {
+    if (m_msgs[n]) {
+      string_pool::release(m_subjects[n]);
+      string_pool::release(m_senders[n]);
+      if (m_recipients[n]!=no_string)
+	string_pool::release(m_recipients[n]);
+    }
+  }
 }
 
 const char*
@@ -67,53 +80,218 @@ mail_item_model::column_name(int index)
 void
 mail_item_model::init()
 {
-  QStringList headers;
-  for (int i=0; i<ncols; i++) {
-    headers << tr(m_column_names[i]);
-  }
-  setHorizontalHeaderLabels(headers);
-  setHorizontalHeaderItem((int)column_attch, new QStandardItem(UI_ICON(FT_ICON16_ATTACH), ""));
-  setHorizontalHeaderItem((int)column_note, new QStandardItem(UI_ICON(FT_ICON16_EDIT_NOTE_GREY), ""));
   m_display_sender_names = get_config().get_string("sender_displayed_as") == "name";
-
 }
 
 void
 mail_item_model::clear()
 {
-  QStandardItemModel::clear();
-  items_map.clear();
+#if QT_VERSION>=0x040600
+  beginResetModel();
+#endif
+  release_strings();
+  m_ids.clear();
+  m_msgs.clear();
+  m_status.clear();
+  m_priority.clear();
+  m_flags.clear();
+  m_dates.clear();
+  m_subjects.clear();
+  m_senders.clear();
+  m_recipients.clear();
+  m_parents.clear();
+  m_rows.clear();
+  m_children.clear();
+  m_nodes.clear();
+  m_orphans.clear();
+#if QT_VERSION>=0x040600
+  endResetModel();
+#else
+  reset();
+#endif
 }
 
-QStandardItem*
-mail_item_model::item_from_id(mail_id_t mail_id) const
+QModelIndex
+mail_item_model::node_index(int node, int column/*=0*/) const
+{
+  return createIndex(m_rows[node], column, (quint32)node);
+}
+
+const QVector<int>*
+mail_item_model::children(int node) const
+{
+  QHash<int, QVector<int> >::const_iterator it = m_children.find(node);
+  return (it==m_children.end()) ? NULL : &it.value();
+}
+
+QModelIndex
+mail_item_model::index(int row, int column, const QModelIndex& parent) const
+{
+  if (column<0 || column>=ncols || row<0)
+    return QModelIndex();
+  const QVector<int>* c = children(parent.isValid() ? (int)parent.internalId() : -1);
+  if (!c || row>=c->size())
+    return QModelIndex();
+  return createIndex(row, column, (quint32)c->at(row));
+}
+
+QModelIndex
+mail_item_model::parent(const QModelIndex& index) const
+{
+  if (!index.isValid())
+    return QModelIndex();
+  int p = m_parents[index.internalId()];
+  if (p<0)
+    return QModelIndex();
+  return node_index(p);
+}
+
+int
+mail_item_model::rowCount(const QModelIndex& parent) const
 {
-  QMap<mail_id_t, QStandardItem*>::const_iterator it = items_map.find(mail_id);
-  if (it!=items_map.end()) {
-    return it.value();
+  if (parent.column()>0)
+    return 0;
+  const QVector<int>* c = children(parent.isValid() ? (int)parent.internalId() : -1);
+  return c ? c->size() : 0;
+}
+
+int
+mail_item_model::columnCount(const QModelIndex& parent _UNUSED_) const
+{
+  return ncols;
+}
+
+bool
+mail_item_model::hasChildren(const QModelIndex& parent) const
+{
+  return rowCount(parent)>0;
+}
+
+QVariant
+mail_item_model::headerData(int section, Qt::Orientation orientation, int role) const
+{
+  if (orientation!=Qt::Horizontal || section<0 || section>=ncols)
+    return QVariant();
+  if (role==Qt::DisplayRole) {
+    if (section==column_attch || section==column_note)
+      return QString("");
+    return tr(m_column_names[section]);
+  }
+  else if (role==Qt::DecorationRole) {
+    static QIcon* iattach;
+    static QIcon* inote;
+    if (section==column_attch) {
+      if (!iattach)
+	iattach = new UI_ICON(FT_ICON16_ATTACH);
+      return *iattach;
+    }
+    else if (section==column_note) {
+      if (!inote)
+	inote = new UI_ICON(FT_ICON16_EDIT_NOTE_GREY);
+      return *inote;
+    }
   }
-  return NULL;
+  return QVariant();
 }
 
-QStandardItem*
-mail_item_model::first_top_level_item() const
+QVariant
+mail_item_model::data(const QModelIndex& index, int role) const
 {
-  QMap<mail_id_t, QStandardItem*>::const_iterator it = items_map.constBegin();
-  if (it==items_map.constEnd())
-    return NULL;		// no item
-  const QStandardItem* item = it.value();
-  // traverse up to the top level
-  while (item->parent()) {
-    item=item->parent();
+  if (!index.isValid())
+    return QVariant();
+  int node = index.internalId();
+  if (!m_msgs[node])
+    return QVariant();
+
+  switch(role) {
+  case Qt::DisplayRole:
+    switch(index.column()) {
+    case column_subject:
+      return string_pool::get(m_subjects[node]);
+    case column_sender:
+      return string_pool::get(m_senders[node]);
+    case column_pri:
+      if (m_priority[node]!=0)
+	return QString("%1").arg(m_priority[node]);
+      break;
+    case column_date:
+      return format_date_key(m_dates[node], m_date_format);
+    case column_recipient:
+      return string_pool::get(recipients_id(node));
+    }
+    break;
+
+  case Qt::FontRole:
+    if ((m_status[node] & mail_msg::statusRead)==0) {
+      switch(index.column()) {
+      case column_subject:
+      case column_sender:
+      case column_pri:
+      case column_date:
+      case column_recipient:
+	return m_bold_font;
+      }
+    }
+    break;
+
+  case Qt::DecorationRole:
+    switch(index.column()) {
+    case column_status:
+      return *icon_status(m_status[node]);
+    case column_attch:
+      if (m_flags[node] & flag_attachments) {
+	static QIcon* iattach;
+	if (!iattach)
+	  iattach = new STATUS_ICON(FT_ICON16_ATTACH);
+	return *iattach;
+      }
+      break;
+    case column_note:
+      if (m_flags[node] & flag_note) {
+	static QIcon* inote;
+	if (!inote)
+	  inote = new STATUS_ICON(FT_ICON16_EDIT_NOTE);
+	return *inote;
+      }
+      break;
+    }
+    break;
+
+  case mail_msg_role:
+    {
+      QVariant v;
+      v.setValue(m_msgs[node]);
+      return v;
+    }
   }
-  const QModelIndex index = item->index().sibling(0,0);
-  if (index.isValid())
-    return this->itemFromIndex(index);
-  else
+  return QVariant();
+}
+
+mail_msg*
+mail_item_model::msg_from_index(const QModelIndex& index) const
+{
+  if (!index.isValid())
     return NULL;
+  return m_msgs[index.internalId()];
+}
+
+QModelIndex
+mail_item_model::index_from_id(mail_id_t mail_id) const
+{
+  QHash<mail_id_t, int>::const_iterator it = m_nodes.find(mail_id);
+  if (it!=m_nodes.end())
+    return node_index(it.value());
+  return QModelIndex();
+}
+
+QModelIndex
+mail_item_model::first_top_level_index() const
+{
+  return index(0, 0);
 }
 
 // returns an icon showing the message status
+//static
 QIcon*
 mail_item_model::icon_status(uint status)
 {
@@ -169,88 +347,21 @@ mail_item_model::icon_status(uint status)
   }
 }
 
-QStandardItem*
-mail_item_model::insert_msg(mail_msg* msg, QStandardItem* parent/*=NULL*/)
+/* string_pool id of the text of the recipients column, computed when
+   it's first needed since the column is hidden by default */
+uint
+mail_item_model::recipients_id(int node) const
 {
-  bool bold = ((msg->status() & mail_msg::statusRead)==0);
-  //  QStandardItem *parentItem = this->invisibleRootItem();
-  QStandardItem* isubject = new QStandardItem(msg->Subject());
-  if (bold) {
-    QFont f=isubject->font();
-    f.setBold(true);
-    isubject->setFont(f);
-  }
-  // store mail_msg* into the data of the first item (mail's subject at column 0)
-  QVariant v;
-  v.setValue(msg);
-  isubject->setData(v, mail_item_model::mail_msg_role);
-
-  QStandardItem* ifrom = new QStandardItem();
-  if (!m_display_sender_names || msg->sender_name().isEmpty())
-    ifrom->setText(msg->From());
-  else
-    ifrom->setText(msg->sender_name());
-  
-  if (bold) {
-    QFont f=ifrom->font();
-    f.setBold(true);
-    ifrom->setFont(f);
-  }
-
-  QList<QStandardItem*> items;
-  items.append(isubject);
-  items.append(ifrom);
-  QIcon* icon = icon_status(msg->status());
-  if (icon)
-    items.append(new QStandardItem(*icon,"")); // status
-  else
-    items.append(new QStandardItem()); // empty (shouldn't happen)
-
-   // priority (number)
-  QStandardItem* ipri = new QStandardItem();
-  if (msg->priority()!=0)
-    ipri->setText(QString("%1").arg(msg->priority()));
-  if (bold) {
-    QFont f=ipri->font();
-    f.setBold(true);
-    ipri->setFont(f);
-  }
-  items.append(ipri);
-
-  // Attachment
-  flag_item* a_item;
-  if (msg->has_attachments()) {
-    a_item = new flag_item(STATUS_ICON(FT_ICON16_ATTACH));
-    a_item->setData(QVariant(true));
-  }
-  else {
-    a_item = new flag_item();
-    a_item->setData(QVariant(false));
-  }
-  items.append(a_item);
-
-  // Note
-  flag_item* n_item;
-  if (msg->has_note()) {
-    n_item = new flag_item(STATUS_ICON(FT_ICON16_EDIT_NOTE));
-    n_item->setData(QVariant(true));
-  }
-  else {
-    n_item = new flag_item();
-    n_item->setData(QVariant(false));
-  }
-  items.append(n_item);
-
-  // Date
-  date_item* idate = new date_item(msg->msg_date(), m_date_format);
-  if (bold) {
-    QFont f=idate->font();
-    f.setBold(true);
-    idate->setFont(f);
-  }
-  items.append(idate);
+  if (m_recipients[node]==no_string)
+    m_recipients[node] = string_pool::acquire(recipients_text(m_msgs[node]));
+  return m_recipients[node];
+}
 
-  QStandardItem* irecipient = new QStandardItem();
+// names of the recipients, or their email addresses when they have no name
+//static
+QString
+mail_item_model::recipients_text(const mail_msg* msg)
+{
   std::list<QString> emails;
   std::list<QString> names;
   QString recipients;
@@ -265,185 +376,516 @@ mail_item_model::insert_msg(mail_msg* msg, QStandardItem* parent/*=NULL*/)
     else
       recipients.append(*iter2);
   }
-  
-  irecipient->setText(recipients);
-  if (bold) {
-    QFont f=irecipient->font();
-    f.setBold(true);
-    irecipient->setFont(f);
-  }
-  items.append(irecipient);
+  return recipients;
+}
+
+//static
+qint64
+mail_item_model::date_key(const date& d)
+{
+  return d.is_null() ? 0 : d.FullOutput().toLongLong();
+}
+
+// the reverse of date_key(), formatted as date::OutputHM()
+//static
+QString
+mail_item_model::format_date_key(qint64 key, int date_format)
+{
+  if (key==0)
+    return QString("");
+  int sec = (int)(key%100);
+  int min = (int)(key/100%100);
+  int hour = (int)(key/10000%100);
+  int day = (int)(key/1000000%100);
+  int month = (int)(key/100000000%100);
+  int year = (int)(key/Q_INT64_C(10000000000));
+  return date::format_hm(year, month, day, hour, min, sec, date_format);
+}
 
-  if (parent)
-    parent->appendRow(items);
+void
+mail_item_model::set_values(int node, const mail_msg* msg)
+{
+  m_status[node] = msg->status();
+  m_priority[node] = msg->priority();
+  m_flags[node] = (msg->has_attachments() ? flag_attachments : 0) |
+    (msg->has_note() ? flag_note : 0);
+}
+
+int
+mail_item_model::new_node(mail_msg* msg)
+{
+  int node = m_ids.size();
+  m_ids.push_back(msg->get_id());
+  m_msgs.push_back(msg);
+  m_status.push_back(0);
+  m_priority.push_back(0);
+  m_flags.push_back(0);
+  set_values(node, msg);
+  m_dates.push_back(date_key(msg->msg_date()));
+  m_subjects.push_back(string_pool::acquire(msg->Subject()));
+  if (!m_display_sender_names || msg->sender_name().isEmpty())
+    m_senders.push_back(string_pool::acquire(msg->From()));
   else
-    appendRow(items);
+    m_senders.push_back(string_pool::acquire(msg->sender_name()));
+  m_recipients.push_back(no_string);
+  m_parents.push_back(-1);
+  m_rows.push_back(0);
+  m_nodes.insert(msg->get_id(), node);
+  return node;
+}
 
-  
-  items_map.insert(msg->get_id(), isubject);
-  //  DBG_PRINTF(8, "inserted mail_id=%d in model=%p", msg->get_id(), this);
-  return isubject;
+void
+mail_item_model::attach_node(int node, int parent, int row)
+{
+  QVector<int>& c = m_children[parent];
+  c.insert(row, node);
+  m_parents[node] = parent;
+  for (int i=row; i<c.size(); i++)
+    m_rows[c.at(i)] = i;
+}
+
+void
+mail_item_model::detach_node(int node)
+{
+  int parent = m_parents[node];
+  QVector<int>& c = m_children[parent];
+  int row = m_rows[node];
+  c.remove(row);
+  for (int i=row; i<c.size(); i++)
+    m_rows[c.at(i)] = i;
+  if (c.isEmpty())
+    m_children.remove(parent);
+  m_parents[node] = -1;
+}
+
+QModelIndex
+mail_item_model::insert_msg(mail_msg* msg, const QModelIndex& parent/*=QModelIndex()*/)
+{
+  int pnode = parent.isValid() ? (int)parent.internalId() : -1;
+  int row = rowCount(parent);
+  beginInsertRows(parent.sibling(parent.row(), 0), row, row);
+  int node = new_node(msg);
+  attach_node(node, pnode, row);
+  endInsertRows();
+  return node_index(node);
+}
+
+void
+mail_item_model::insert_msgs(const std::list<mail_msg*>& list)
+{
+  if (list.empty())
+    return;
+  int first = rowCount();
+  beginInsertRows(QModelIndex(), first, first+list.size()-1);
+  QVector<int>& c = m_children[-1];
+  c.reserve(first+list.size());
+  std::list<mail_msg*>::const_iterator it;
+  for (it=list.begin(); it!=list.end(); ++it) {
+    int node = new_node(*it);
+    m_rows[node] = c.size();
+    c.append(node);
+  }
+  endInsertRows();
 }
 
 /* 
   Update the contents the message pointed to by 'msg', if it's in the
   model, otherwise ignore the request.  Currently the contents are the
-  status (icon) and the priority. Other changes such as in the subject
-  or the date could be visually reflected by this function if the UI
-  permitted those changes.
+  status (icon and bold font), the priority and the note. Other
+  changes such as in the subject or the date could be visually
+  reflected by this function if the UI permitted those changes.
 */
 void
 mail_item_model::update_msg(const mail_msg* msg)
 {
   DBG_PRINTF(4, "update_msg of %d", msg->get_id());
-  QStandardItem* item=item_from_id(msg->get_id());
-  if (!item)
+  QHash<mail_id_t, int>::const_iterator it = m_nodes.find(msg->get_id());
+  if (it==m_nodes.end())
     return;
-  QModelIndex index=item->index();
-  QStandardItem* isubject = itemFromIndex(index);
-  bool bold=isubject->font().bold();
-  DBG_PRINTF(5, "mail_id=%d, status=%d, bold=%d", msg->get_id(), msg->status(),
-	     bold);
-  if ((msg->status()!=0 && bold) || (msg->status()==0 && !bold)) {
-    // reverse bold attribute
-    QFont f=isubject->font();
-    f.setBold(!bold);
-    isubject->setFont(f);
-    itemFromIndex(index.sibling(index.row(), column_sender))->setFont(f);
-    itemFromIndex(index.sibling(index.row(), column_date))->setFont(f);
-    itemFromIndex(index.sibling(index.row(), column_pri))->setFont(f);
-    itemFromIndex(index.sibling(index.row(), column_recipient))->setFont(f);
-  }
-
-  // status icon
-  QIcon* icon = icon_status(msg->status());
-  QStandardItem* istatus = itemFromIndex(index.sibling(index.row(), column_status));
-  if (istatus) {
-    if (icon)
-      istatus->setIcon(*icon);
+  int node = it.value();
+  set_values(node, msg);
+  emit dataChanged(node_index(node, 0), node_index(node, ncols-1));
+}
+
+/*
+  Insert the messages of 'list' that are not yet in the model, under
+  their parent when it's in the model or in 'list', otherwise at the
+  top level. Messages of the model that were waiting for one of them
+  as their parent are moved under it. The whole batch is built
+  without recursion before being signalled to the views, with one
+  insertion of rows at the top level and one by parent already in the
+  model. Return the index of the parents that got new children, to be
+  expanded by the view.
+*/
+QModelIndexList
+mail_item_model::insert_tree(const std::list<mail_msg*>& list)
+{
+  QModelIndexList expand;
+  int first_new = m_ids.size();
+  std::list<mail_msg*>::const_iterator it;
+  for (it=list.begin(); it!=list.end(); ++it) {
+    if (!m_nodes.contains((*it)->get_id()))
+      new_node(*it);
+  }
+  int end_new = m_ids.size();
+  if (first_new==end_new)
+    return expand;
+
+  /* link each new node to its parent. The new nodes are not visible
+     yet, so their lists of children can be filled directly */
+  QVector<int> top;
+  QHash<int, QVector<int> > under_existing;
+  for (int n=first_new; n<end_new; n++) {
+    mail_id_t parent_id = m_msgs[n]->inReplyTo();
+    QHash<mail_id_t, int>::const_iterator ip;
+    if (parent_id!=0 && (ip=m_nodes.find(parent_id))!=m_nodes.end()) {
+      if (ip.value()>=first_new) {
+	m_parents[n] = ip.value();
+	m_children[ip.value()].append(n);
+      }
+      else
+	under_existing[ip.value()].append(n);
+    }
     else
-      istatus->setIcon(QIcon());
+      top.append(n);
+  }
+
+  /* nodes that can't be reached from the top or from the existing
+     nodes belong to a cycle of in_reply_to: it's broken by moving
+     them to the top level */
+  std::vector<bool> reached(end_new-first_new, false);
+  QVector<int> stack = top;
+  QHash<int, QVector<int> >::const_iterator ie;
+  for (ie=under_existing.constBegin(); ie!=under_existing.constEnd(); ++ie)
+    stack += ie.value();
+  int n=first_new;
+  for (;;) {
+    while (!stack.isEmpty()) {
+      int m = stack.back();
+      stack.pop_back();
+      reached[m-first_new] = true;
+      const QVector<int>* c = children(m);
+      if (c)
+	stack += *c;
+    }
+    while (n<end_new && reached[n-first_new])
+      n++;
+    if (n==end_new)
+      break;
+    QVector<int>& pc = m_children[m_parents[n]];
+    pc.remove(pc.indexOf(n));
+    if (pc.isEmpty())
+      m_children.remove(m_parents[n]);
+    m_parents[n] = -1;
+    top.append(n);
+    stack.append(n);
+  }
+  for (n=first_new; n<end_new; n++) {
+    const QVector<int>* c = children(n);
+    if (c) {
+      for (int i=0; i<c->size(); i++)
+	m_rows[c->at(i)] = i;
+    }
   }
 
-  // priority
-  QStandardItem* ipri = itemFromIndex(index.sibling(index.row(), column_pri));
-  if (ipri) {
-    if (msg->priority()!=0)
-      ipri->setText(QString("%1").arg(msg->priority()));
-    else
-      ipri->setText("");
+  /* adopt the top-level nodes that are replies to the new nodes,
+     unless the new node descends from the orphan, which would close
+     a cycle of in_reply_to across batches. The new nodes that go
+     under existing nodes don't have their parent set yet */
+  QHash<int,int> existing_parent;
+  for (ie=under_existing.constBegin(); ie!=under_existing.constEnd(); ++ie) {
+    for (int i=0; i<ie.value().size(); i++)
+      existing_parent.insert(ie.value().at(i), ie.key());
+  }
+  for (n=first_new; n<end_new; n++) {
+    QList<int> orphans = m_orphans.values(m_ids[n]);
+    for (int i=0; i<orphans.size(); i++) {
+      int o = orphans.at(i);
+      if (o>=first_new || !m_msgs[o] || m_parents[o]!=-1)
+	continue;
+      int a = n;
+      while (a!=-1 && a!=o)
+	a = (m_parents[a]==-1) ? existing_parent.value(a, -1) : m_parents[a];
+      if (a==o) {
+	DBG_PRINTF(5, "mail_id=%d not adopted to avoid a cycle", m_ids[o]);
+	continue;
+      }
+      beginRemoveRows(QModelIndex(), m_rows[o], m_rows[o]);
+      detach_node(o);
+      endRemoveRows();
+      attach_node(o, n, children(n) ? children(n)->size() : 0);
+    }
+    m_orphans.remove(m_ids[n]);
   }
 
-  // note
-  QStandardItem* inote = itemFromIndex(index.sibling(index.row(), column_note));
-  if (inote) {
-    inote->setData(msg->has_note());
-    if (msg->has_note())
-      inote->setIcon(STATUS_ICON(FT_ICON16_EDIT_NOTE));
-    else
-      inote->setIcon(QIcon());
+  for (int i=0; i<top.size(); i++) {
+    mail_id_t parent_id = m_msgs[top.at(i)]->inReplyTo();
+    if (parent_id!=0 && !m_nodes.contains(parent_id))
+      m_orphans.insert(parent_id, top.at(i));
+  }
+
+  // make the new rows visible
+  int row = rowCount();
+  if (!top.isEmpty()) {
+    beginInsertRows(QModelIndex(), row, row+top.size()-1);
+    QVector<int>& tc = m_children[-1];
+    for (int i=0; i<top.size(); i++) {
+      m_parents[top.at(i)] = -1;
+      m_rows[top.at(i)] = tc.size();
+      tc.append(top.at(i));
+    }
+    endInsertRows();
+  }
+
+  QHash<int, QVector<int> >::const_iterator iu;
+  for (iu=under_existing.constBegin(); iu!=under_existing.constEnd(); ++iu) {
+    int parent = iu.key();
+    const QVector<int>& nodes = iu.value();
+    QModelIndex parent_index = node_index(parent);
+    row = rowCount(parent_index);
+    beginInsertRows(parent_index, row, row+nodes.size()-1);
+    QVector<int>& pc = m_children[parent];
+    for (int i=0; i<nodes.size(); i++) {
+      m_parents[nodes.at(i)] = parent;
+      m_rows[nodes.at(i)] = pc.size();
+      pc.append(nodes.at(i));
+    }
+    endInsertRows();
+    expand.append(parent_index);
   }
 
+  for (n=first_new; n<end_new; n++) {
+    if (children(n))
+      expand.append(node_index(n));
+  }
+  return expand;
 }
 
+/* Remove the message from the model. Its children take its place
+   under its parent */
 void
 mail_item_model::remove_msg(mail_msg* msg)
 {
   DBG_PRINTF(8, "remove_msg(mail_id=%d)", msg->get_id());
-  QMap<mail_id_t, QStandardItem*>::iterator it = items_map.find(msg->get_id());
-  if (it!=items_map.end()) {
-    QStandardItem* item = it.value();
-    QStandardItem* parent_item = item->parent();
-    while (item->child(0,0)!=NULL) {
-      // reparent childs of the item to remove
-      QList<QStandardItem*> ql = item->takeRow(0);
-      if (parent_item) {
-	DBG_PRINTF(9, "reparenting child to immediate parent row=%d", item->index().row());
-	parent_item->insertRow(item->index().row(), ql);
-      }
-      else {
-	DBG_PRINTF(9, "reparenting child to root");
-	insertRow(item->index().row(), ql);
-      }
-    }
-    // 
-    DBG_PRINTF(9, "removing mail_id=%d from model at index.row=%d index.column=%d", msg->get_id(), item->index().row(), item->index().column());
-    QModelIndex index = item->index();
-    removeRow(index.row(), index.parent());
-    items_map.erase(it);
+  QHash<mail_id_t, int>::iterator it = m_nodes.find(msg->get_id());
+  if (it==m_nodes.end()) {
+    DBG_PRINTF(1, "ERR: mail_id=%d not found in the model", msg->get_id());
+    return;
   }
-  else {
-    DBG_PRINTF(1, "ERR: mail_id=%d not found in items_map", msg->get_id());
+  int node = it.value();
+  int parent = m_parents[node];
+  QModelIndex parent_index = (parent<0) ? QModelIndex() : node_index(parent);
+  int row = m_rows[node];
+
+  QVector<int> orphans;
+  const QVector<int>* c = children(node);
+  if (c) {
+    orphans = *c;
+    beginRemoveRows(node_index(node), 0, orphans.size()-1);
+    m_children.remove(node);
+    endRemoveRows();
+  }
+
+  beginRemoveRows(parent_index, row, row);
+  detach_node(node);
+  m_orphans.remove(msg->inReplyTo(), node);
+  m_msgs[node] = NULL;
+  m_nodes.erase(it);
+  string_pool::release(m_subjects[node]);
+  string_pool::release(m_senders[node]);
+  if (m_recipients[node]!=no_string)
+    string_pool::release(m_recipients[node]);
+  endRemoveRows();
+
+  if (!orphans.isEmpty()) {
+    beginInsertRows(parent_index, row, row+orphans.size()-1);
+    for (int i=0; i<orphans.size(); i++)
+      attach_node(orphans.at(i), parent, row+i);
+    endInsertRows();
   }
 }
 
-#if 0
-/* The code below does work, but is way too slow for large lists, and
-   is kept here only for reference. Both takeRow() and appendRow()
-   seem to need too much time, especially when there are child
-   items. The alternative method we use to flatten the tree is
-   to recreate it from scratch as a list, see msg_list_window::toggle_threaded() */
-void
-mail_item_model::flatten()
-{
-  QMap<mail_id_t, QStandardItem*>::iterator it;
-  for (it=items_map.begin(); it!=items_map.end(); ++it) {
-    QStandardItem* item = it.value();
-    if (item->parent()) {
-      QModelIndex index=this->indexFromItem(item);
-      QList<QStandardItem*> ql=item->parent()->takeRow(index.row());
-      this->appendRow(ql);
-    }
-  }
-}
-#endif
-
-QStandardItem*
+/* Move the message with its children under 'parent_id'. Returns the
+   index of the new parent, or an invalid index if nothing was moved */
+QModelIndex
 mail_item_model::reparent_msg(mail_msg* msg, mail_id_t parent_id)
 {
   DBG_PRINTF(7, "reparent_msg");
-  QMap<mail_id_t, QStandardItem*>::iterator itp = items_map.find(parent_id);
-  if (itp==items_map.end())
-    return NULL;
-  QMap<mail_id_t, QStandardItem*>::iterator itc = items_map.find(msg->get_id());
-  if (itc!=items_map.end()) {
-    QModelIndex index_child=this->indexFromItem(itc.value());
-    QStandardItem* old_parent=itc.value()->parent();
-    QStandardItem* new_parent=itp.value();
-    if (old_parent==new_parent)
-      return NULL;
-    QList<QStandardItem*> ql;
-    if (!old_parent) {
-      ql=takeRow(index_child.row());
+  QHash<mail_id_t, int>::const_iterator itp = m_nodes.find(parent_id);
+  if (itp==m_nodes.end())
+    return QModelIndex();
+  QHash<mail_id_t, int>::const_iterator itc = m_nodes.find(msg->get_id());
+  if (itc==m_nodes.end()) {
+    DBG_PRINTF(1, "ERR: mail_id=%d not found in the model", msg->get_id());
+    return QModelIndex();
+  }
+  int node = itc.value();
+  int new_parent = itp.value();
+  int old_parent = m_parents[node];
+  if (old_parent==new_parent)
+    return QModelIndex();
+
+  beginRemoveRows(old_parent<0 ? QModelIndex() : node_index(old_parent),
+		  m_rows[node], m_rows[node]);
+  detach_node(node);
+  m_orphans.remove(msg->inReplyTo(), node);
+  endRemoveRows();
+
+  QModelIndex parent_index = node_index(new_parent);
+  int row = rowCount(parent_index);
+  beginInsertRows(parent_index, row, row);
+  attach_node(node, new_parent, row);
+  endInsertRows();
+  DBG_PRINTF(9, "reparented %d as child of %d", msg->get_id(), parent_id);
+  return parent_index;
+}
+
+mail_msg*
+mail_item_model::find(mail_id_t mail_id)
+{
+  QHash<mail_id_t, int>::const_iterator it = m_nodes.find(mail_id);
+  if (it!=m_nodes.end())
+    return m_msgs[it.value()];
+  return NULL;
+}
+
+namespace {
+  /* Sort key of a node: the value of the column, then the mail_id
+     for the dates, or the previous position to keep the sort
+     stable */
+  struct sort_entry {
+    qint64 key;
+    quint32 key2;
+    int node;
+  };
+  struct sort_entry_less {
+    sort_entry_less(bool descending, bool descending_key2) :
+      m_descending(descending), m_descending_key2(descending_key2) {}
+    bool operator()(const sort_entry& a, const sort_entry& b) const {
+      if (a.key!=b.key)
+	return m_descending ? a.key>b.key : a.key<b.key;
+      return m_descending_key2 ? a.key2>b.key2 : a.key2<b.key2;
     }
-    else {
-      DBG_PRINTF(9,"old_parent for mail_id=%d", msg->get_id());
-      ql=old_parent->takeRow(index_child.row());
+    bool m_descending;
+    bool m_descending_key2;
+  };
+
+  struct string_less {
+    string_less(const QVector<QString>& strings) : m_strings(strings) {}
+    bool operator()(uint a, uint b) const {
+      return QString::localeAwareCompare(m_strings.at(a), m_strings.at(b)) < 0;
+    }
+    const QVector<QString>& m_strings;
+  };
+}
+
+/*
+  Compute the sort keys of a text column: the rank of each distinct
+  string in the locale's collation order. The strings being interned,
+  there are much fewer of them than rows, and the rows are then
+  sorted by integers.
+*/
+void
+mail_item_model::collation_keys(const std::vector<uint>& ids, std::vector<qint64>& keys) const
+{
+  QHash<uint,uint> distinct;	// string_pool id => index in strings
+  QVector<QString> strings;
+  for (uint n=0; n<ids.size(); n++) {
+    if (m_msgs[n] && !distinct.contains(ids[n])) {
+      distinct.insert(ids[n], strings.size());
+      strings.append(string_pool::get(ids[n]));
     }
-    new_parent->appendRow(ql);
-    DBG_PRINTF(9, "reparented %d as child of %d", msg->get_id(), parent_id);
-    return new_parent;
   }
-  else {
-    DBG_PRINTF(1, "ERR: mail_id=%d not found in items_map", msg->get_id());
+  std::vector<uint> order(strings.size());
+  for (uint i=0; i<order.size(); i++)
+    order[i]=i;
+  std::sort(order.begin(), order.end(), string_less(strings));
+  std::vector<qint64> rank(strings.size());
+  for (uint i=0; i<order.size(); i++) {
+    // equal strings for the collation get the same rank
+    if (i>0 && QString::localeAwareCompare(strings.at(order[i-1]), strings.at(order[i]))==0)
+      rank[order[i]] = rank[order[i-1]];
+    else
+      rank[order[i]] = i;
+  }
+  keys.resize(ids.size());
+  for (uint n=0; n<ids.size(); n++) {
+    if (m_msgs[n])
+      keys[n] = rank[distinct.value(ids[n])];
   }
-  return NULL;
 }
 
-mail_msg*
-mail_item_model::find(mail_id_t mail_id)
+void
+mail_item_model::sort(int column, Qt::SortOrder order)
 {
-  QMap<mail_id_t, QStandardItem*>::iterator it = items_map.find(mail_id);
-  if (it!=items_map.end()) {
-    QStandardItem* item=it.value();
-    QVariant v=item->data(mail_item_model::mail_msg_role);
-    mail_msg* msg=v.value<mail_msg*>();
-    if (msg->get_id()!=mail_id) {
-      DBG_PRINTF(1, "ERR: items_map doesn't match the model for mail_id=%d", mail_id);
+  if (column<0 || column>=ncols)
+    return;
+  DBG_PRINTF(8, "sort column %d", column);
+  emit layoutAboutToBeChanged();
+  QModelIndexList old_list = persistentIndexList();
+
+  // the integer keys of this column
+  std::vector<qint64> keys;
+  switch(column) {
+  case column_subject:
+    collation_keys(m_subjects, keys);
+    break;
+  case column_sender:
+    collation_keys(m_senders, keys);
+    break;
+  case column_recipient:
+    for (uint n=0; n<m_ids.size(); n++) {
+      if (m_msgs[n])
+	recipients_id(n);
+    }
+    collation_keys(m_recipients, keys);
+    break;
+  case column_date:
+    keys = m_dates;
+    break;
+  default:
+    keys.resize(m_ids.size());
+    for (uint n=0; n<m_ids.size(); n++) {
+      if (column==column_status)
+	keys[n] = m_status[n];
+      else if (column==column_pri)
+	keys[n] = m_priority[n];
+      else if (column==column_attch)
+	keys[n] = (m_flags[n] & flag_attachments) ? 1 : 0;
+      else if (column==column_note)
+	keys[n] = (m_flags[n] & flag_note) ? 1 : 0;
+    }
+    break;
+  }
+
+  bool descending = (order==Qt::DescendingOrder);
+  // same dates are ordered by mail_id, like the results of queries
+  sort_entry_less less(descending, column==column_date && descending);
+  std::vector<sort_entry> entries;
+  QHash<int, QVector<int> >::iterator it;
+  for (it=m_children.begin(); it!=m_children.end(); ++it) {
+    QVector<int>& c = it.value();
+    entries.resize(c.size());
+    for (int i=0; i<c.size(); i++) {
+      int node = c.at(i);
+      entries[i].key = keys[node];
+      entries[i].key2 = (column==column_date) ? m_ids[node] : i;
+      entries[i].node = node;
+    }
+    std::sort(entries.begin(), entries.end(), less);
+    for (int i=0; i<c.size(); i++) {
+      c[i] = entries[i].node;
+      m_rows[c.at(i)] = i;
     }
-    return msg;
   }
-  return NULL;
+
+  QModelIndexList new_list;
+  for (int i=0; i<old_list.size(); i++) {
+    const QModelIndex& idx = old_list.at(i);
+    new_list.append(node_index(idx.internalId(), idx.column()));
+  }
+  changePersistentIndexList(old_list, new_list);
+  emit layoutChanged();
 }
 
 mail_listview::mail_listview(QWidget* parent): QTreeView(parent)
@@ -467,12 +909,23 @@ mail_listview::mail_listview(QWidget* parent): QTreeView(parent)
 	  this, SLOT(popup_ctxt_menu_headers(const QPoint&)));
 
   setEditTriggers(QAbstractItemView::NoEditTriggers);
+
+  connect(verticalScrollBar(), SIGNAL(valueChanged(int)),
+	  this, SLOT(check_near_end(int)));
 }
 
 mail_listview::~mail_listview()
 {
 }
 
+void
+mail_listview::check_near_end(int value)
+{
+  QScrollBar* sb = verticalScrollBar();
+  if (sb->maximum()>0 && value >= sb->maximum()-sb->pageStep())
+    emit near_end();
+}
+
 QMenu*
 mail_listview::make_header_menu(QWidget* parent)
 {
@@ -536,12 +989,7 @@ mail_listview::popup_ctxt_menu(const QPoint& pos)
   QModelIndex index = indexAt(pos);
   if (!index.isValid())
     return;
-  mail_item_model* model = dynamic_cast<mail_item_model*>(this->model());
-  // get to the first column
-  index=index.sibling(index.row(), 0);
-  QStandardItem* item = model->itemFromIndex(index);
-  QVariant v=item->data(mail_item_model::mail_msg_role);
-  mail_msg* msg = v.value<mail_msg*>();
+  mail_msg* msg = model()->msg_from_index(index);
 
   if (!msg) {
     DBG_PRINTF(1, "no msg found");
@@ -693,27 +1141,7 @@ mail_listview::force_msg_status(uint id, uint status, int priority)
 mail_msg*
 mail_listview::first_msg() const
 {
-#if 0
-  // The code below doesn't work because the rootIndex() is always invalid.
-  // Apparently QTreeView doesn't take care of it for us
-  QModelIndex root_index = this->rootIndex();
-  if (!root_index.isValid())
-    return NULL;
-  QStandardItem* item = model()->itemFromIndex(root_index);
-  if (!item)
-    return NULL;
-  QStandardItem* first_child = item->child(0,0);
-  if (!first_child)
-    return NULL;
-#else
-  // take any item from the model, and go up to the root
-  QStandardItem* first_child = model()->first_top_level_item();
-  if (!first_child)
-    return NULL;
-#endif
-  QVariant v=first_child->data(mail_item_model::mail_msg_role);
-  mail_msg* msg=v.value<mail_msg*>();
-  return msg;
+  return model()->msg_from_index(model()->first_top_level_index());
 }
 
 /*
@@ -722,90 +1150,89 @@ mail_listview::first_msg() const
 mail_msg*
 mail_listview::nearest_msg(const mail_msg* msg, int direction) const
 {
-  QStandardItem* item = this->nearest(msg, direction);
-  if (!item)
-    return NULL;
-  QVariant v=item->data(mail_item_model::mail_msg_role);
-  mail_msg* msg1=v.value<mail_msg*>();
-  return msg1;
+  return model()->msg_from_index(nearest(msg, direction));
 }
 
 /*
   direction: 1=below only, 2=above only, 3=below then above
 */
-QStandardItem*
+QModelIndex
 mail_listview::nearest(const mail_msg* msg, int direction) const
 {
-  mail_item_model* model = this->model();
-  QStandardItem* item = model->item_from_id(msg->get_id());
-  if (item!=NULL) {
+  QModelIndex index = model()->index_from_id(msg->get_id());
+  if (index.isValid()) {
     if (direction==1 || direction==3) {
-      QModelIndex index_below=indexBelow(item->index());
+      QModelIndex index_below=indexBelow(index);
       if (index_below.isValid()) {
-	return model->itemFromIndex(index_below);
+	return index_below.sibling(index_below.row(), 0);
       }
     }
     if (direction==2 || direction==3) {
-      QModelIndex index_above=indexAbove(item->index());
+      QModelIndex index_above=indexAbove(index);
       if (index_above.isValid()) {
-	return model->itemFromIndex(index_above);
+	return index_above.sibling(index_above.row(), 0);
       }
     }
   }
-  return NULL;
+  return QModelIndex();
 }
 
 void
 mail_listview::select_msg(const mail_msg* msg)
 {
-  QStandardItem* item=model()->item_from_id(msg->get_id());
-  if (item) {
-    setCurrentIndex(item->index());
+  QModelIndex index=model()->index_from_id(msg->get_id());
+  if (index.isValid()) {
+    setCurrentIndex(index);
   }
 }
 
 void
 mail_listview::select_below(const mail_msg* msg)
 {
-  QStandardItem* item=nearest(msg, 1);
-  if (item) {
-    setCurrentIndex(item->index());
+  QModelIndex index=nearest(msg, 1);
+  if (index.isValid()) {
+    setCurrentIndex(index);
   }
 }
 
 void
 mail_listview::select_above(const mail_msg* msg)
 {
-  QStandardItem* item=nearest(msg, 2);
-  if (item) {
-    setCurrentIndex(item->index());
+  QModelIndex index=nearest(msg, 2);
+  if (index.isValid()) {
+    setCurrentIndex(index);
   }
 }
 
 void
 mail_listview::select_nearest(const mail_msg* msg)
 {
-  QStandardItem* item=nearest(msg, 3);
-  if (item) {
-    setCurrentIndex(item->index());
+  QModelIndex index=nearest(msg, 3);
+  if (index.isValid()) {
+    setCurrentIndex(index);
   }
 }
 
-/* Recursively traverse all the child items and record every expanded item */
+/* Traverse all the child items and record the mail_id of every
+   expanded item. Iterative since threads can be very deep */
 void
-mail_listview::collect_expansion_states(QStandardItem* item,
-					QSet<QStandardItem*>& expanded_set)
-{
-  QStandardItem* citem;
-  int row=0;
-  while ((citem=item->child(row,0))!=NULL) {
-    if (isExpanded(citem->index())) {
-      expanded_set.insert(citem);
-    }
-    if (citem->hasChildren()) {
-      collect_expansion_states(citem, expanded_set);
+mail_listview::collect_expansion_states(const QModelIndex& index,
+					QSet<mail_id_t>& expanded_set)
+{
+  mail_item_model* model = this->model();
+  QList<QModelIndex> stack;
+  stack.append(index);
+  while (!stack.isEmpty()) {
+    QModelIndex pindex = stack.takeLast();
+    int nrows = model->rowCount(pindex);
+    for (int row=0; row<nrows; row++) {
+      QModelIndex cindex = model->index(row, 0, pindex);
+      if (model->hasChildren(cindex)) {
+	if (isExpanded(cindex))
+	  expanded_set.insert(model->msg_from_index(cindex)->get_id());
+	stack.append(cindex);
+      }
     }
-    row++;
   }
 }
 
@@ -815,53 +1242,42 @@ mail_listview::remove_msg(mail_msg* msg, bool select_next)
   DBG_PRINTF(8, "mail_listview::remove_msg(mail_id=%d, select_next=%d)", msg->get_id(), select_next);
 
   mail_item_model* model = this->model();
-  QStandardItem* item = model->item_from_id(msg->get_id());
+  QModelIndex item_index = model->index_from_id(msg->get_id());
 
-  QStandardItem* nearest = NULL;
-  QSet<QStandardItem*> expanded_set;
+  mail_msg* nearest = NULL;
+  QSet<mail_id_t> expanded_set;
 
-  if (select_next) {
-    QModelIndex index_below = indexBelow(item->index());
-    if (index_below.isValid()) {
-      nearest = model->itemFromIndex(index_below);
-      DBG_PRINTF(5, "nearest got from index_below");
-    }
-    else {
-      QModelIndex index_above = indexAbove(item->index());
-      if (index_above.isValid()) {
-	nearest = model->itemFromIndex(index_above);
-	DBG_PRINTF(5, "nearest got from index_above");
-      }
-    }
+  if (select_next && item_index.isValid()) {
+    nearest = nearest_msg(msg, 3);
     if (nearest) {
       /* record the expansion states of all child items to set them
 	 back after the parent's removal */
-      collect_expansion_states(item, expanded_set);
+      collect_expansion_states(item_index, expanded_set);
     }
   }
   model->remove_msg(msg);
   if (select_next && nearest) {
-    QModelIndex index = nearest->index();
+    QModelIndex index = model->index_from_id(nearest->get_id());
     DBG_PRINTF(5,"making current index row=%d col=%d parent is valid=%d", 
 	       index.row(), index.column(), index.parent().isValid()?1:0);
-    foreach (QStandardItem *child, expanded_set) {
-      setExpanded(child->index(), true);
+    foreach (mail_id_t child_id, expanded_set) {
+      setExpanded(model->index_from_id(child_id), true);
     }
-    setCurrentIndex(nearest->index());
+    setCurrentIndex(index);
   }
 }
 
 void
 mail_listview::reparent_msg(mail_msg* msg, mail_id_t parent_id)
 {
-  mail_item_model* model = dynamic_cast<mail_item_model*>(this->model());
+  mail_item_model* model = this->model();
 #if QT_VERSION<0x040303
-  QStandardItem* parent=model->reparent_msg(msg, parent_id);
+  QModelIndex parent=model->reparent_msg(msg, parent_id);
   /* Each row is expanded individually because of a probable bug in
      Qt<4.3.3. The bug makes the treeview appear to be empty on screen
      after the expandAll() call */
-  if (parent) {
-    expand(model->indexFromItem(parent));
+  if (parent.isValid()) {
+    expand(parent);
   }
 #else
   model->reparent_msg(msg, parent_id);
@@ -871,8 +1287,7 @@ mail_listview::reparent_msg(mail_msg* msg, mail_id_t parent_id)
 mail_msg*
 mail_listview::find(mail_id_t mail_id)
 {
-  mail_item_model* model = dynamic_cast<mail_item_model*>(this->model());
-  return model->find(mail_id);
+  return model()->find(mail_id);
 }
 
 void
@@ -884,16 +1299,14 @@ mail_listview::get_selected_indexes(QModelIndexList& list)
 void
 mail_listview::clear()
 {
-  mail_item_model* model = dynamic_cast<mail_item_model*>(this->model());
-  model->clear();
-  init_columns(); // because clearing the model removes the column headers
+  model()->clear();
+  init_columns();
 }
 
 bool
 mail_listview::empty() const
 {
-  mail_item_model* model = dynamic_cast<mail_item_model*>(this->model());
-  return (model->first_top_level_item()==NULL);
+  return model()->rowCount()==0;
 }
   
 
@@ -915,15 +1328,13 @@ mail_listview::selectionChanged(const QItemSelection& selected,
 void
 mail_listview::get_selected(std::vector<mail_msg*>& vect)
 {
-  mail_item_model* model = dynamic_cast<mail_item_model*>(this->model());
+  mail_item_model* model = this->model();
   QModelIndexList li = selectedIndexes();
   for (int i=0; i<li.size(); i++) {
     const QModelIndex idx=li.at(i);
     if (idx.column()!=0)	// we only want one item per row
       continue;
-    QStandardItem* item = model->itemFromIndex(idx);
-    QVariant v=item->data(mail_item_model::mail_msg_role);
-    vect.push_back(v.value<mail_msg*>()); // add the mail_msg* to the vector
+    vect.push_back(model->msg_from_index(idx)); // add the mail_msg* to the vector
   }
 }
 
@@ -1014,65 +1425,25 @@ mail_listview::init_columns()
 void
 mail_listview::scroll_to_bottom()
 {
-  mail_item_model* model = dynamic_cast<mail_item_model*>(this->model());
+  mail_item_model* model = this->model();
   if (model->rowCount()==0)
     return;
-  QStandardItem* item = model->invisibleRootItem();
-  if (item) {
-    QStandardItem* i = item->child(model->rowCount()-1);
-    if (i) {
-      QModelIndex index=model->indexFromItem(i);
-      scrollTo(index);
-    }
-  }
+  scrollTo(model->index(model->rowCount()-1, 0));
 }
 
 /*
-  Insert an item with its parent. Recurse if the parent is not yet inserted
+  Insert the messages as threads, the new ones being added to the
+  threads already in the list (see mail_item_model::insert_tree).
+  Only the parents of the new messages are expanded, rather than the
+  whole tree.
 */
-QStandardItem*
-mail_listview::insert_sub_tree(std::map<mail_id_t,mail_msg*>& m, mail_msg *msg)
-{
-  QStandardItem* parent=NULL; // default to top-level item
-  mail_id_t parent_id=msg->inReplyTo();
-  if (parent_id!=0) {
-    std::map<mail_id_t,mail_msg*>::iterator parent_iter=m.find(parent_id);
-    if (parent_iter!=m.end()) {
-      // has a parent in the list
-      parent = model()->item_from_id(parent_id);
-      if (!parent) {
-	// recurse to insert msg's parent before msg
-	parent = insert_sub_tree(m, parent_iter->second);
-      }
-    }
-  }
-  return model()->insert_msg(msg, parent);
-}
-
 void
 mail_listview::make_tree(std::list<mail_msg*>& list)
 {
   DBG_PRINTF(8, "make_tree()");
-  std::list<mail_msg*>::iterator Iter=list.begin();
-  std::map<mail_id_t,mail_msg*> m;
-
-  /* build a map [ mail_id => pointer to the message ]. The map is used
-     below to quickly find if a parent belongs to the list or not */
-  while (Iter!=list.end()) {
-    m[(*Iter)->get_id()]=*(Iter++);
-  }
-
-  Iter=list.begin();
-  std::map<mail_id_t,mail_msg*>::iterator parent_iter;
-  //  QMap<mail_id_t, mail_msg*> parents; // child=>parent
-  while (Iter!=list.end()) {
-    mail_msg* msg = model()->find((*Iter)->get_id());
-    if (!msg) {			// msg not already in list
-      insert_sub_tree(m, *Iter);
-    }
-    ++Iter;
-  }
-  expandAll();
+  QModelIndexList parents = model()->insert_tree(list);
+  for (int i=0; i<parents.size(); i++)
+    setExpanded(parents.at(i), true);
 }
 
 void
@@ -1083,12 +1454,18 @@ mail_listview::insert_list(std::list<mail_msg*>& list)
   }
   else {
     mail_item_model* m = model();    
+    std::list<mail_msg*> batch;
+    // a selection joining mail_addresses may return a message twice
+    QSet<mail_id_t> batch_ids;
     msgs_filter::mlist_t::iterator it;
     for (it=list.begin(); it!=list.end(); ++it) {
-      mail_msg* existing_msg = m->find((*it)->get_id());
-      if (!existing_msg)
-	m->insert_msg(*it);
+      mail_id_t id = (*it)->get_id();
+      if (!batch_ids.contains(id) && !m->find(id)) {
+	batch_ids.insert(id);
+	batch.push_back(*it);
+      }
     }
+    m->insert_msgs(batch);
   }    
 }
 
@@ -22,13 +22,14 @@
 
 #include "main.h"
 #include <vector>
-#include <QMap>
+#include <QHash>
+#include <QVector>
 #include <QSet>
+#include <QFont>
 #include <QEvent>
 #include <QMouseEvent>
 #include <QTreeView>
-#include <QStandardItemModel>
-#include <QStandardItem>
+#include <QAbstractItemModel>
 
 #include "dbtypes.h"
 #include "db.h" // mail_msg
@@ -41,22 +42,48 @@ class QIcon;
 class QMenu;
 class QKeyEvent;
 
-class mail_item_model : public QStandardItemModel
+/*
+  Model of the messages list. Rather than an item object per cell,
+  the rows are stored as columns of values indexed by a node number:
+  node numbers are stable and are the internalId() of the model
+  indexes. The text, fonts and icons are produced by data() when the
+  view needs them. The subjects and senders are ids of string_pool.
+
+  The tree of threads is kept as the list of child nodes of each node
+  with children, the top level being the children of node -1.
+*/
+class mail_item_model : public QAbstractItemModel
 {
   Q_OBJECT
 public:
   mail_item_model(QObject* parent=0);
   virtual ~mail_item_model();
-  QStandardItem* item_from_id(mail_id_t) const;
+
+  // QAbstractItemModel interface
+  QModelIndex index(int row, int column, const QModelIndex& parent=QModelIndex()) const;
+  QModelIndex parent(const QModelIndex& index) const;
+  int rowCount(const QModelIndex& parent=QModelIndex()) const;
+  int columnCount(const QModelIndex& parent=QModelIndex()) const;
+  bool hasChildren(const QModelIndex& parent=QModelIndex()) const;
+  QVariant data(const QModelIndex& index, int role=Qt::DisplayRole) const;
+  QVariant headerData(int section, Qt::Orientation orientation,
+		      int role=Qt::DisplayRole) const;
+  void sort(int column, Qt::SortOrder order=Qt::AscendingOrder);
+
+  // index at column 0 of the row of mail_id, invalid if not in the model
+  QModelIndex index_from_id(mail_id_t) const;
+  mail_msg* msg_from_index(const QModelIndex&) const;
   void init();
-  QStandardItem* insert_msg(mail_msg* msg, QStandardItem* parent=NULL);
+  QModelIndex insert_msg(mail_msg* msg, const QModelIndex& parent=QModelIndex());
+  // append messages at the top level. They must not be in the model or twice in the list
+  void insert_msgs(const std::list<mail_msg*>& list);
+  QModelIndexList insert_tree(const std::list<mail_msg*>& list);
   void remove_msg(mail_msg* msg);
-  QStandardItem* reparent_msg(mail_msg* msg, mail_id_t parent_id);
+  QModelIndex reparent_msg(mail_msg* msg, mail_id_t parent_id);
   void update_msg(const mail_msg *msg);
   mail_msg* find(mail_id_t mail_id);
   static const int mail_msg_role = Qt::UserRole+2;
   // TODO: see if the date format could be kept in the view only
-  // currently we need it when instantiating the QStandardItemModels
   void set_date_format(int d) { m_date_format=d; }
   static const int ncols;
   static const char* m_column_names[];
@@ -72,32 +99,61 @@ public:
     column_recipient
   };
   void clear();
-  QStandardItem* first_top_level_item() const;
+  QModelIndex first_top_level_index() const;
 
 private:
   // returns an icon showing the mail status
-  QIcon* icon_status(uint status);
+  static QIcon* icon_status(uint status);
+  static QString recipients_text(const mail_msg*);
+  uint recipients_id(int node) const;
+  void collation_keys(const std::vector<uint>& ids, std::vector<qint64>& keys) const;
+  // date as YYYYMMDDHHMMSS, 0 for a null date, used as the sort key
+  static qint64 date_key(const date&);
+  static QString format_date_key(qint64 key, int date_format);
+
+  enum {
+    flag_attachments=1,
+    flag_note=2
+  };
 
-  // Association between the mail_id and the first QStandardItem of
-  // the corresponding row (the item at column 0, also containing the mail_msg*
-  // in QVariant form)
-  QMap<mail_id_t, QStandardItem*> items_map;
+  // append a node for 'msg' to the columns, not yet in the tree
+  int new_node(mail_msg* msg);
+  // release the strings of the nodes still in the model
+  void release_strings();
+  void set_values(int node, const mail_msg* msg);
+  QModelIndex node_index(int node, int column=0) const;
+  const QVector<int>* children(int node) const;
+  // detach 'node' from its parent, or attach it at 'row' of 'parent'
+  void detach_node(int node);
+  void attach_node(int node, int parent, int row);
+
+  // columns
+  std::vector<mail_id_t> m_ids;
+  std::vector<mail_msg*> m_msgs; // NULL for a removed message
+  std::vector<uint> m_status;
+  std::vector<int> m_priority;
+  std::vector<uchar> m_flags;
+  std::vector<qint64> m_dates;
+  std::vector<uint> m_subjects;	// string_pool id
+  std::vector<uint> m_senders;	// string_pool id
+  // string_pool id, or no_string until recipients_id() is called
+  mutable std::vector<uint> m_recipients;
+  static const uint no_string = 0xffffffff;
+
+  // tree
+  std::vector<int> m_parents;	// -1 at the top level
+  std::vector<int> m_rows;	// position among the siblings
+  QHash<int, QVector<int> > m_children;
+
+  QHash<mail_id_t, int> m_nodes; // mail_id => node
+  /* top-level nodes replying to a message that isn't in the model:
+     in_reply_to => node */
+  QMultiHash<mail_id_t, int> m_orphans;
 
   // same than mail_listview::m_date_format
   int m_date_format;
   bool m_display_sender_names;
-};
-
-class flag_item: public QStandardItem
-{
-public:
-  flag_item();
-  flag_item(const QIcon&);
-  bool operator< (const QStandardItem & other) const {
-    bool has_flag = data().toBool();
-    bool other_has_flag = other.data().toBool();
-    return !has_flag && other_has_flag;
-  }
+  QFont m_bold_font;
 };
 
 class mail_listview : public QTreeView
@@ -137,7 +193,7 @@ public:
   mail_msg* first_msg() const;
   mail_msg* nearest_msg(const mail_msg* msg, int direction) const;
 
-  QStandardItem* nearest(const mail_msg* msg, int direction) const;
+  QModelIndex nearest(const mail_msg* msg, int direction) const;
   void select_nearest(const mail_msg* msg);
   void select_below(const mail_msg* msg);
   void select_above(const mail_msg* msg);
@@ -155,9 +211,8 @@ protected:
 
 private:
   void make_tree(std::list<mail_msg*>& list);
-  void collect_expansion_states(QStandardItem* item,
-				QSet<QStandardItem*>& expanded_set);
-  QStandardItem* insert_sub_tree(std::map<mail_id_t,mail_msg*>& m, mail_msg *msg);
+  void collect_expansion_states(const QModelIndex& index,
+				QSet<mail_id_t>& expanded_set);
   int m_date_format;
   bool m_display_threads;
   bool m_sender_column_swapped;
@@ -176,10 +231,14 @@ public slots:
   void change_msg_status (mail_id_t id, uint mask_set, uint mask_unset);
   void force_msg_status (mail_id_t id, uint status, int priority);
   void refresh(mail_id_t id);
+private slots:
+  void check_near_end(int value);
 
 signals:
   void selection_changed();
   void scroll_page_down();
+  // the list has been scrolled to its last page
+  void near_end();
 };
 
 
@@ -29,6 +29,8 @@
 #include <time.h>
 #include <qtextcodec.h>
 #include <qregexp.h>
+#include <QMap>
+#include <vector>
 
 #ifndef __GNUG__
 // for _alloca()
@@ -112,48 +114,88 @@ mail_header::make()
 
 // store from,to,cc,bcc addresses into the database
 bool
-mail_header::store_addresses()
+mail_header::store_addresses(sql_batch* batch)
 {
   bool res=true;
   if (!m_from.isEmpty())
-    res &= store_addresses_list(m_from, (int)mail_address::addrFrom);
+    res &= store_addresses_list(m_from, (int)mail_address::addrFrom, batch);
   if (!m_to.isEmpty())
-    res &= store_addresses_list(m_to, (int)mail_address::addrTo);
+    res &= store_addresses_list(m_to, (int)mail_address::addrTo, batch);
   if (!m_cc.isEmpty())
-    res &= store_addresses_list(m_cc, (int)mail_address::addrCc);
+    res &= store_addresses_list(m_cc, (int)mail_address::addrCc, batch);
   if (!m_bcc.isEmpty())
-    res &= store_addresses_list(m_bcc, (int)mail_address::addrBcc);
+    res &= store_addresses_list(m_bcc, (int)mail_address::addrBcc, batch);
   if (!m_replyTo.isEmpty())
-    res &= store_addresses_list(m_replyTo, (int)mail_address::addrReplyTo);
+    res &= store_addresses_list(m_replyTo, (int)mail_address::addrReplyTo, batch);
   return res;
 }
 
 bool
-mail_header::store_addresses_list(const QString& addr_list, int addr_type)
+mail_header::store_addresses_list(const QString& addr_list, int addr_type,
+				  sql_batch* batch)
 {
   db_cnx db;
   sql_stream s("INSERT INTO mail_addresses(mail_id,addr_id,addr_type,addr_pos) VALUES(:p1,:p2,:p3,:p4)", db);
+  s.set_batch(batch);
   std::list<QString> emails;
   std::list<QString> names;
   mail_address::ExtractAddresses(addr_list.toLatin1().constData(), emails, names);
-  bool found;
+  if (emails.empty())
+    return true;
+
+  // look up the ids of all the addresses with one query
+  std::vector<unsigned int> ids(emails.size(), 0);
+  try {
+    QString q="SELECT v.pos,a.addr_id FROM addresses a JOIN (VALUES ";
+    for (unsigned int i=0; i<emails.size(); i++) {
+      if (i>0)
+	q.append(',');
+      q.append(QString("(lower(:e%1),%1)").arg(i));
+    }
+    q.append(") AS v(email,pos) ON a.email_addr=v.email");
+    sql_stream sl(q, db);
+    std::list<QString>::iterator ite;
+    for (ite=emails.begin(); ite!=emails.end(); ++ite) {
+      sl << *ite;
+    }
+    while (!sl.eof()) {
+      int pos;
+      unsigned int id;
+      sl >> pos >> id;
+      if (pos>=0 && pos<(int)ids.size())
+	ids[pos]=id;
+    }
+  }
+  catch(db_excpt& p) {
+    DBEXCPT(p);
+    return false;
+  }
+
+  QMap<QString,unsigned int> created;
   std::list<QString>::iterator it1 = emails.begin();
   std::list<QString>::iterator it2 = names.begin();
   for (int addr_pos = 0; it1 != emails.end(); addr_pos++) {
     mail_address a;
     QString s_addr=(*it1).toLower();
-    bool res=a.fetchByEmail(*(it1),&found);
-    if (!res)
-      return false;
-    if (!found) {
+    if (ids[addr_pos]) {
+      a.setId(ids[addr_pos]);
+      a.set(*it1);
+    }
+    else if (created.contains(s_addr)) {
+      // repeated in the list
+      a.setId(created.value(s_addr));
+      a.set(s_addr);
+    }
+    else {
       // create the address if it doesn't exist yet
       a.set(s_addr);
       a.set_name(*(it2));
       if (!a.store())
 	return false;
+      created.insert(s_addr, a.id());
     }
     if (addr_type == mail_address::addrTo) {
-      a.update_last_used("sent");
+      a.update_last_used("sent", batch);
     }
     s << m_mail_id << a.id() << (int)addr_type << addr_pos;
     it1++; it2++;
@@ -188,11 +230,16 @@ bool
 mail_header::store()
 {
   make();
-  store_addresses();
   db_cnx db;
+  /* the addresses that need to be created are inserted immediately,
+     and the rest is sent in one batch */
+  sql_batch batch(db);
+  store_addresses(&batch);
   sql_stream s("INSERT INTO header(mail_id,lines) VALUES (:p1, ':p2')",
 	      db);
+  s.set_batch(&batch);
   s << m_mail_id << m_lines;
+  batch.execute();
   return true;
 }
 
@@ -202,6 +249,7 @@ mail_header::fetch()
   db_cnx db;
   try {
     sql_stream s("SELECT lines FROM header WHERE mail_id=:p1", db);
+    s.set_prepared();
     s << m_mail_id;
     if (!s.eos()) {
       s >> m_lines;
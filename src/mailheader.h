@@ -22,6 +22,8 @@
 
 #include <qstring.h>
 
+class sql_batch;
+
 class mail_header
 {
 public:
@@ -37,7 +39,10 @@ public:
   bool store();
   /* create m_lines from header variables */
   void make();
-  bool store_addresses_list(const QString& addr_list,int addr_type);
+  /* if 'batch' is not null, the inserts and updates are queued into
+     it instead of being executed immediately */
+  bool store_addresses_list(const QString& addr_list,int addr_type,
+			    sql_batch* batch=NULL);
   QString recipients_list();
 
   QString m_from;		// full (address and optional name)
@@ -70,7 +75,7 @@ public:
   /* format the raw header 'src' into 'dest' (as an html string) */
   void format(QString& dest, const QString& src);
 private:
-  bool store_addresses();
+  bool store_addresses(sql_batch* batch);
 };
 
 #endif // INC_MAILHEADER_H
@@ -159,9 +159,8 @@ mailing_db::load_definition(mailing_options* options)
 }
 
 
-/* Store all the data for a mailing in a single operation.
+/* Store all the data for a mailing in a single operation, with COPY.
    The caller is assumed to have opened a transaction.
-   TODO: use COPY for improved speed
 */
 bool
 mailing_db::store_data(const QStringList& recipients, const QList<QStringList>& data_lines,
@@ -173,7 +172,7 @@ mailing_db::store_data(const QStringList& recipients, const QList<QStringList>&
     int step=recipients.size()/100;
     if (bar)
       bar->setRange(0, recipients.size());
-    sql_stream s("INSERT INTO mailing_data(mailing_id, recipient_email, csv_data) VALUES(:id,:s, :data)", db);
+    sql_copy_in s("mailing_data(mailing_id, recipient_email, csv_data)", db);
     QList<QStringList>::const_iterator itd = data_lines.constBegin();
     for (QStringList::const_iterator iter = recipients.constBegin();
 	 iter!=recipients.constEnd();
@@ -191,7 +190,9 @@ mailing_db::store_data(const QStringList& recipients, const QList<QStringList>&
 	}
 	else
 	  s << sql_null();
+	s.end_row();
       }
+    s.finish();
   }
   catch(db_excpt& p) {
     DBEXCPT(p);
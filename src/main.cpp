@@ -37,6 +37,7 @@
 #include "newmailwidget.h"
 #include "message_port.h"
 #include "msg_status_cache.h"
+#include "result_cache.h"
 #include "app_config.h"
 #include "log_window.h"
 
@@ -365,6 +366,7 @@ main(int argc, char **argv)
   users_repository::fetch();
   message_port::init();
   msg_status_cache::init_db();
+  result_cache::init_db();
 
   msg_list_window* w = new msg_list_window(&filter,0);
   w->show();
@@ -23,6 +23,8 @@
 #include "sqlquery.h"
 #include "users.h"
 #include "msg_status_cache.h"
+#include "result_cache.h"
+#include "string_pool.h"
 #include "identities.h"
 #include "app_config.h"
 #include "mail_displayer.h"
@@ -31,49 +33,104 @@
 #include <QObject>
 
 mail_msg::mail_msg() :
+  m_details(NULL),
   m_nMailId(0),
   m_thread_id(0),
   m_pri(0),
-  m_identity_id(0),
-  m_body_fetched(false),
-  m_body_html_fetched(false),
-  m_body_fetched_length(0),
-  m_body_length(0),
-  m_bHeaderFetched(false),
-  m_tags_fetched(false),
-  m_mailnote_in_db(false),
-  m_nInReplyTo(0),
-  m_rawsize(0)
+  m_timestamp(date::null_pg_timestamp),
+  m_nInReplyTo(0)
 {
 }
 
 mail_msg::mail_msg(mail_id_t id,const QString& from,
 		   const QString& subject, const date date):
+  m_details(NULL),
   m_nMailId(id),
   m_thread_id(0),
   m_pri(0),
-  m_identity_id(0),
-  m_body_fetched(false),
-  m_body_html_fetched(false),
-  m_body_fetched_length(0),
-  m_body_length(0),
-  m_bHeaderFetched(false),
-  m_tags_fetched(false),
-  m_mailnote_in_db(false),
-  m_nInReplyTo(0),
-  m_rawsize(0)
+  m_nInReplyTo(0)
 {
   m_sFrom=from;
   m_sSubject=subject;
-  m_cDate=date;
-  m_Attachments.setMailId(id);
-  m_header.setMailId(id);
+  m_timestamp=date.pg_timestamp();
+}
+
+void
+mail_result::share_strings()
+{
+  string_pool::share(m_from);
+  string_pool::share(m_subject);
+  string_pool::share(m_sender_name);
+  string_pool::share(m_recipients);
 }
 
 mail_msg::mail_msg(const mail_result& r):
+  m_details(NULL),
   m_nMailId(r.m_id),
   m_thread_id(r.m_thread_id),
   m_pri(r.m_pri),
+  m_nInReplyTo(r.m_in_replyto)
+{
+  m_sFrom = r.m_from;
+  m_sSubject = r.m_subject;
+  m_timestamp = r.m_date.pg_timestamp();
+
+  set_orig_status(r.m_status);
+  setStatus(r.m_status);
+  set_sender_name(r.m_sender_name);
+  set_flags(r.m_flags);
+}
+
+mail_msg::mail_msg(const mail_msg& m) :
+  m_details(NULL)
+{
+  *this = m;
+}
+
+mail_msg&
+mail_msg::operator=(const mail_msg& m)
+{
+  if (this==&m)
+    return *this;
+  mail_msg_details* d = m.m_details ? new mail_msg_details(*m.m_details) : NULL;
+  delete m_details;
+  m_details = d;
+  m_attached_local_files = m.m_attached_local_files;
+  m_nMailId = m.m_nMailId;
+  m_flags = m.m_flags;
+  m_sFrom = m.m_sFrom;
+  m_sSubject = m.m_sSubject;
+  m_recipients = m.m_recipients;
+  m_sender_name = m.m_sender_name;
+  m_thread_id = m.m_thread_id;
+  m_pri = m.m_pri;
+  m_timestamp = m.m_timestamp;
+  m_status = m.m_status;
+  m_db_status = m.m_db_status;
+  m_user_id_status = m.m_user_id_status;
+  m_nInReplyTo = m.m_nInReplyTo;
+  return *this;
+}
+
+mail_msg::~mail_msg()
+{
+  delete m_details;
+}
+
+mail_msg_details&
+mail_msg::details() const
+{
+  if (!m_details)
+    m_details = new mail_msg_details(m_nMailId);
+  return *m_details;
+}
+
+// static members
+mail_msg_details* mail_msg_details::m_first;
+mail_msg_details* mail_msg_details::m_last;
+qint64 mail_msg_details::m_cache_size;
+
+mail_msg_details::mail_msg_details(mail_id_t id) :
   m_identity_id(0),
   m_body_fetched(false),
   m_body_html_fetched(false),
@@ -81,85 +138,207 @@ mail_msg::mail_msg(const mail_result& r):
   m_body_length(0),
   m_bHeaderFetched(false),
   m_tags_fetched(false),
+  m_note_fetched(false),
   m_mailnote_in_db(false),
-  m_nInReplyTo(r.m_in_replyto),
-  m_rawsize(0)
+  m_rawsize(0),
+  m_prev(NULL),
+  m_next(NULL),
+  m_cached_size(0)
+{
+  m_Attachments.setMailId(id);
+  m_header.setMailId(id);
+}
 
+/* A copy isn't in the cache until it's touched itself. Its texts are
+   shared with the original until one of them is modified or dropped */
+mail_msg_details::mail_msg_details(const mail_msg_details& d) :
+  m_prev(NULL),
+  m_next(NULL),
+  m_cached_size(0)
 {
-  m_sFrom = r.m_from;
-  m_sSubject = r.m_subject;
-  m_cDate = date(r.m_date);
-  m_Attachments.setMailId(r.m_id);
-  m_header.setMailId(r.m_id);
+  *this = d;
+}
 
-  set_orig_status(r.m_status);
-  setStatus(r.m_status);
-  set_sender_name(r.m_sender_name);
-  set_flags(r.m_flags);
+mail_msg_details&
+mail_msg_details::operator=(const mail_msg_details& d)
+{
+  m_header = d.m_header;
+  m_sBody = d.m_sBody;
+  m_body_html = d.m_body_html;
+  m_sHeaders = d.m_sHeaders;
+  m_identity_id = d.m_identity_id;
+  m_body_fetched = d.m_body_fetched;
+  m_body_html_fetched = d.m_body_html_fetched;
+  m_body_fetched_length = d.m_body_fetched_length;
+  m_body_length = d.m_body_length;
+  m_bHeaderFetched = d.m_bHeaderFetched;
+  m_tags_fetched = d.m_tags_fetched;
+  m_note_fetched = d.m_note_fetched;
+  m_tags = d.m_tags;
+  m_Attachments = d.m_Attachments;
+  m_mail_note = d.m_mail_note;
+  m_mailnote_in_db = d.m_mailnote_in_db;
+  m_rawsize = d.m_rawsize;
+  m_forwarded_mail_vect = d.m_forwarded_mail_vect;
+  return *this;
+}
+
+mail_msg_details::~mail_msg_details()
+{
+  unlink();
+}
+
+//static
+qint64
+mail_msg_details::max_cache_size()
+{
+  static qint64 size = -1;
+  if (size<0) {
+    int mb = get_config().exists("fetch/message_cache_size") ?
+      get_config().get_number("fetch/message_cache_size") : 64;
+    size = (qint64)(mb>0 ? mb : 0)*1024*1024;
+  }
+  return size;
+}
+
+// size in bytes of the texts that can be fetched again from the database
+qint64
+mail_msg_details::texts_size() const
+{
+  qint64 size=0;
+  if (m_body_fetched)
+    size += m_sBody.size();
+  if (m_body_html_fetched)
+    size += m_body_html.size();
+  if (m_bHeaderFetched)
+    size += m_sHeaders.size();
+  return size*sizeof(QChar);
+}
+
+void
+mail_msg_details::unlink()
+{
+  if (m_prev)
+    m_prev->m_next = m_next;
+  else if (m_first==this)
+    m_first = m_next;
+  if (m_next)
+    m_next->m_prev = m_prev;
+  else if (m_last==this)
+    m_last = m_prev;
+  m_prev = m_next = NULL;
+  m_cache_size -= m_cached_size;
+  m_cached_size = 0;
+}
+
+void
+mail_msg_details::drop_texts()
+{
+  unlink();
+  if (m_body_fetched) {
+    m_sBody = QString();
+    m_body_fetched = false;
+    m_body_fetched_length = m_body_length = 0;
+  }
+  if (m_body_html_fetched) {
+    m_body_html = QString();
+    m_body_html_fetched = false;
+  }
+  if (m_bHeaderFetched) {
+    // the header lines share their data with m_sHeaders
+    m_sHeaders = QString();
+    m_header.m_lines = QString();
+    m_bHeaderFetched = false;
+  }
+}
+
+void
+mail_msg_details::touch()
+{
+  unlink();
+  m_cached_size = texts_size();
+  if (m_cached_size==0)
+    return;
+  m_next = m_first;
+  if (m_first)
+    m_first->m_prev = this;
+  m_first = this;
+  if (!m_last)
+    m_last = this;
+  m_cache_size += m_cached_size;
+
+  // drop the least recently used texts, except those just fetched
+  while (m_cache_size > max_cache_size() && m_last!=this) {
+    DBG_PRINTF(6, "message cache: dropping %lld bytes", m_last->m_cached_size);
+    m_last->drop_texts();
+  }
 }
 
 void
 mail_msg::set_identity_id(int id)
 {
-  m_identity_id = id;
+  details().m_identity_id = id;
 }
 
 bool
 mail_msg::fetch_body_text(bool partial)
 {
+  mail_msg_details& d = details();
   if (!GetId())
     return false;
 
-  // don't fetch from db when m_sBody already contains the requested contents
-  if (!m_body_fetched || (!partial && m_body_fetched_length<m_body_length))
+  // don't fetch from db when d.m_sBody already contains the requested contents
+  if (!d.m_body_fetched || (!partial && d.m_body_fetched_length<d.m_body_length))
   {
     db_cnx db;
     try {
-      const int maxsz=30000;
+      const int maxsz=partial_body_size;
       QString part;
       if (partial)
 	part = QString("substr(bodytext,1,%1)").arg(maxsz);
       else
 	part="bodytext";
       sql_stream s(QString("SELECT %1 FROM body WHERE mail_id=:p1").arg(part), db);
+      s.set_prepared();
       s << get_id();
       if (!s.eos()) {
-	s >> m_sBody;
-	m_body_fetched_length = m_sBody.length();
+	s >> d.m_sBody;
+	d.m_body_fetched_length = d.m_sBody.length();
 	if (partial) {
-	  if (m_body_fetched_length==maxsz) {
+	  if (d.m_body_fetched_length==maxsz) {
 	    sql_stream s1("SELECT length(bodytext) FROM body WHERE mail_id=:p1", db);
 	    s1 << get_id();
 	    if (!s1.eos()) {
-	      s1 >> m_body_length;
+	      s1 >> d.m_body_length;
 	    }
 	    else {
 	      // should not happen: the entry in the body table has
 	      // disappeared between the 2 statements. in this case,
 	      // let's consider that the text has been fetched entirely
-	      m_body_length = m_body_fetched_length;
+	      d.m_body_length = d.m_body_fetched_length;
 	    }
 	  }
 	  else {
-	    m_body_length = m_body_fetched_length;
+	    d.m_body_length = d.m_body_fetched_length;
 	  }
 	}
 	else {
-	  m_body_length = m_body_fetched_length;
+	  d.m_body_length = d.m_body_fetched_length;
 	}
       }
       else {
 	// no entry in body table
-	m_sBody.truncate(0);
-	m_body_fetched_length = m_body_length = 0;
+	d.m_sBody.truncate(0);
+	d.m_body_fetched_length = d.m_body_length = 0;
       }
-      m_body_fetched=true;
+      d.m_body_fetched=true;
     }
     catch (db_excpt p) {
       DBEXCPT(p);
-      m_sBody=QString("");
+      d.m_sBody=QString("");
       return false;
     }
+    d.touch();
   }
   return true;
 }
@@ -169,7 +348,7 @@ QString&
 mail_msg::get_body_text(bool partial)
 {
   fetch_body_text(partial);
-  return m_sBody;
+  return details().m_sBody;
 }
 
 bool
@@ -184,8 +363,8 @@ mail_msg::update_body(const QString& txt)
       sql_stream s1("INSERT INTO body(mail_id,bodytext) VALUES(:p1,:p2)", db);
       s1 << get_id() << txt;
     }
-    if (m_body_fetched)
-      m_sBody = txt;
+    if (details().m_body_fetched)
+      details().m_sBody = txt;
   }
   catch (db_excpt& p) {
     DBEXCPT(p);
@@ -278,23 +457,26 @@ mail_msg::set_quoted_body(const QString& squote, const QString& sprepend,
 const QString&
 mail_msg::get_headers()
 {
-  if (!m_bHeaderFetched && GetId()) {
+  mail_msg_details& d = details();
+  if (!d.m_bHeaderFetched && GetId()) {
     if (header().fetch()) {
-      m_sHeaders=header().m_lines;
-      m_bHeaderFetched=true;
+      d.m_sHeaders=header().m_lines;
+      d.m_bHeaderFetched=true;
+      d.touch();
     }
   }
-  return m_sHeaders;
+  return d.m_sHeaders;
 }
 
 bool
-mail_msg::store_tags()
+mail_msg::store_tags(sql_batch* batch)
 {
   std::list<uint>::const_iterator iter;
   db_cnx db;
   try {
     sql_stream s1("INSERT INTO mail_tags(mail_id,tag,agent) VALUES (:p1,:p2,:p3)", db);
-    for (iter=m_tags.begin(); iter!=m_tags.end(); iter++) {
+    s1.set_batch(batch);
+    for (iter=details().m_tags.begin(); iter!=details().m_tags.end(); iter++) {
       s1 << GetId() << *iter << user::current_user_id();
     }
   }
@@ -310,7 +492,7 @@ bool
 mail_msg::hasTag(int tag_id) const
 {
   std::list<uint>::const_iterator iter;
-  for (iter = m_tags.begin(); iter != m_tags.end(); iter++) {
+  for (iter = details().m_tags.begin(); iter != details().m_tags.end(); iter++) {
     if (*iter == (uint)tag_id)
       return true;
   }
@@ -368,7 +550,7 @@ mail_msg::lookup_dest_identity()
     for (iter1 = emails_list.begin(); iter1!=emails_list.end(); ++iter1) {
       identities::const_iterator iit = m_ids.find(*iter1);
       if (iit != m_ids.end()) {
-	m_identity_id = iit->second.m_identity_id;
+	details().m_identity_id = iit->second.m_identity_id;
 	result = *iter1;
 	break;
       }
@@ -387,20 +569,21 @@ mail_msg::lookup_dest_identity()
 int
 mail_msg::identity_id()
 {
-  if (m_identity_id)
-    return m_identity_id;
+  mail_msg_details& d = details();
+  if (d.m_identity_id)
+    return d.m_identity_id;
   db_cnx db;
   try {
     sql_stream s("SELECT identity_id FROM mail WHERE mail_id=:p1", db);
     s << get_id();
     if (!s.eos()) {
-      s >> m_identity_id;
+      s >> d.m_identity_id;
     }
   }
   catch(db_excpt& p) {
     DBEXCPT(p);
   }
-  return m_identity_id;
+  return d.m_identity_id;
 }
 
 // Add or remove a tag in the database and in memory
@@ -430,9 +613,10 @@ mail_msg::set_tag (uint id, bool set /*=true*/)
     }
   }
   if (set)
-    m_tags.push_back(id);
+    details().m_tags.push_back(id);
   else
-    m_tags.remove(id);
+    details().m_tags.remove(id);
+  result_cache::mail_changed(GetId());
   return true;
 }
 
@@ -459,6 +643,9 @@ mail_msg::toggle_tags_set(std::set<mail_msg*>& mset, uint tag_id, bool on)
       s2 << tag_id;
       result=s2.affected_rows();
     }
+    std::set<mail_msg*>::const_iterator it;
+    for (it=mset.begin(); it!=mset.end(); ++it)
+      result_cache::mail_changed((*it)->get_id());
   }
   catch(db_excpt& p) {
     DBEXCPT(p);
@@ -469,17 +656,20 @@ mail_msg::toggle_tags_set(std::set<mail_msg*>& mset, uint tag_id, bool on)
 bool
 mail_msg::fetchNote()
 {
+  mail_msg_details& d = details();
   bool result=true;
   db_cnx db;
   try {
     sql_stream s("SELECT note FROM notes WHERE mail_id=:id", db);
+    s.set_prepared();
     s << GetId();
     if (!s.eof()) {
-      s >> m_mail_note;
-      m_mailnote_in_db=true;
+      s >> d.m_mail_note;
+      d.m_mailnote_in_db=true;
     }
     else
-      m_mail_note=QString::null;
+      d.m_mail_note=QString::null;
+    d.m_note_fetched=true;
   }
   catch(db_excpt& p) {
     DBEXCPT(p);
@@ -581,12 +771,13 @@ mail_msg::mdelete()
 bool
 mail_msg::store_note()
 {
+  mail_msg_details& d = details();
   bool result=true;
   const char *query=NULL;
   try {
     db_cnx db;
-    if (m_mailnote_in_db) {
-      if (m_mail_note.isEmpty()) {
+    if (d.m_mailnote_in_db) {
+      if (d.m_mail_note.isEmpty()) {
 	sql_stream s("DELETE FROM notes WHERE mail_id=:p1", db);
 	s << GetId();
 	m_flags &= ~flag_has_note;
@@ -601,7 +792,7 @@ mail_msg::store_note()
     }
     if (query) {
       sql_stream s(query, db);
-      s << m_mail_note << GetId();
+      s << d.m_mail_note << GetId();
     }
   }
   catch(db_excpt& p) {
@@ -615,30 +806,32 @@ const std::list<uint>&
 mail_msg::get_cached_tags() const
 {
   // FIXME: see what we could do if m_tags_fetched is false
-  return m_tags;
+  return details().m_tags;
 }
 
 std::list<uint>&
 mail_msg::get_tags()
 {
-  if (m_tags_fetched) {
-    return m_tags;
+  mail_msg_details& d = details();
+  if (d.m_tags_fetched) {
+    return d.m_tags;
   }
   db_cnx db;
   try {
     sql_stream s ("SELECT tag FROM mail_tags WHERE mail_id=:p1", db);
+    s.set_prepared();
     s << GetId();
     while (!s.eof()) {
       uint tid;
       s >> tid;
-      m_tags.push_back(tid);
+      d.m_tags.push_back(tid);
     }
   }
   catch (db_excpt& p) {
     DBEXCPT(p);
   }
-  m_tags_fetched=true;
-  return m_tags;
+  d.m_tags_fetched=true;
+  return d.m_tags;
 }
 
 // update the message status in the database
@@ -651,6 +844,7 @@ mail_msg::update_status(bool force/*=false*/)
     try {
       const char* query = "UPDATE mail SET status=:p1,mod_user_id=:o WHERE mail_id=:p2";
       sql_stream s(query, db);
+      s.set_prepared();
       s << m_status << user::current_user_id() << getId();
       m_db_status = m_status;
       msg_status_cache::update(get_id(), m_status);
@@ -774,6 +968,7 @@ mail_msg::fetch_status ()
   db_cnx db;
   try {
     sql_stream s ("SELECT status,mod_user_id FROM mail WHERE mail_id=:p2", db);
+    s.set_prepared();
     s << get_id();
     if (!s.eos()) {
       s >> m_db_status >> m_user_id_status;
@@ -792,6 +987,7 @@ mail_msg::refresh()
   db_cnx db;
   try {
     sql_stream s ("SELECT status,mod_user_id,thread_id,flags FROM mail WHERE mail_id=:p2", db);
+    s.set_prepared();
     s << get_id();
     if (!s.eos()) {
       s >> m_db_status >> m_user_id_status >> m_thread_id >> m_flags;
@@ -804,25 +1000,118 @@ mail_msg::refresh()
   }
 }
 
+db_async_reply*
+mail_msg::fetch_display_data_async()
+{
+  if (!get_id())
+    return NULL;
+  QString id=QString::number(get_id());
+  QString q=QString("SELECT status,mod_user_id,thread_id,flags FROM mail WHERE mail_id=%1;"
+		    "SELECT substr(bodytext,1,%2),length(bodytext),bodyhtml FROM body WHERE mail_id=%1;"
+		    "SELECT lines FROM header WHERE mail_id=%1;"
+		    "SELECT note FROM notes WHERE mail_id=%1;"
+		    "SELECT tag FROM mail_tags WHERE mail_id=%1")
+    .arg(id).arg(partial_body_size);
+  if (has_attachments() && !details().m_Attachments.fetched()) {
+    q.append(";");
+    q.append(QString(attachments_list::fetch_query()).replace(":p1", id));
+  }
+  db_cnx db;
+  return db.exec_async(q);
+}
+
+bool
+mail_msg::load_display_data(db_async_reply* r)
+{
+  mail_msg_details& d = details();
+  if (r->failed() || r->results_count()<5) {
+    DBG_PRINTF(2, "async fetch of mail_id=%d failed: %s", get_id(),
+	       r->errmsg().toLocal8Bit().constData());
+    return false;
+  }
+  db_cnx db;
+  try {
+    sql_stream s_status(r->take_result(0), db);
+    if (!s_status.eos()) {
+      s_status >> m_db_status >> m_user_id_status >> m_thread_id >> m_flags;
+      m_status = m_db_status;
+      msg_status_cache::update(get_id(), m_status);
+    }
+
+    sql_stream s_body(r->take_result(1), db);
+    if (!s_body.eos()) {
+      s_body >> d.m_sBody >> d.m_body_length >> d.m_body_html;
+      d.m_body_fetched_length = d.m_sBody.length();
+    }
+    else {
+      // no entry in body table
+      d.m_sBody.truncate(0);
+      d.m_body_html.truncate(0);
+      d.m_body_fetched_length = d.m_body_length = 0;
+    }
+    d.m_body_fetched=true;
+    d.m_body_html_fetched=true;
+
+    sql_stream s_header(r->take_result(2), db);
+    if (!s_header.eos())
+      s_header >> d.m_header.m_lines;
+    else
+      d.m_header.m_lines="";
+    d.m_sHeaders=d.m_header.m_lines;
+    d.m_bHeaderFetched=true;
+
+    sql_stream s_note(r->take_result(3), db);
+    if (!s_note.eof()) {
+      s_note >> d.m_mail_note;
+      d.m_mailnote_in_db=true;
+    }
+    else
+      d.m_mail_note=QString::null;
+    d.m_note_fetched=true;
+
+    sql_stream s_tags(r->take_result(4), db);
+    d.m_tags.clear();
+    while (!s_tags.eof()) {
+      uint tid;
+      s_tags >> tid;
+      d.m_tags.push_back(tid);
+    }
+    d.m_tags_fetched=true;
+
+    if (r->results_count()>5) {
+      sql_stream s_attch(r->take_result(5), db);
+      d.m_Attachments.load(s_attch);
+    }
+  }
+  catch(db_excpt& p) {
+    DBEXCPT(p);
+    return false;
+  }
+  d.touch();
+  return true;
+}
+
 void
 mail_msg::build_message_id()
 {
   QUuid uid = QUuid::createUuid();
   QString str=uid.toString();
   str.replace(QChar('{'), "").replace(QChar('}'), "");
-  m_header.setMessageId(str+"@mm");
+  details().m_header.setMessageId(str+"@mm");
 }
 
 // Store the new message into the database
 bool
 mail_msg::store()
 {
+  mail_msg_details& d = details();
   bool result=false;
-  PGresult* res;
   db_cnx db;
-  PGconn* c=db.connection();
   try {
     db.begin_transaction();
+    /* the writes that don't depend on each other's results are sent
+       together */
+    sql_batch batch(db);
     if (!m_nMailId) {
       sql_stream s("SELECT nextval('seq_mail_id')", db);
       s >> m_nMailId;
@@ -830,17 +1119,17 @@ mail_msg::store()
     }
     sql_write_fields fields(db);
     fields.add("mail_id", (int)GetId());
-    fields.add("sender", m_header.m_sender);
-    fields.add("sender_fullname", m_header.m_sender_fullname);
-    fields.add("recipients", m_header.recipients_list());
-    fields.add_if_not_empty("subject", m_header.m_subject, 1000);
-    fields.add_if_not_empty("message_id", m_header.m_messageId, 100);
+    fields.add("sender", d.m_header.m_sender);
+    fields.add("sender_fullname", d.m_header.m_sender_fullname);
+    fields.add("recipients", d.m_header.recipients_list());
+    fields.add_if_not_empty("subject", d.m_header.m_subject, 1000);
+    fields.add_if_not_empty("message_id", d.m_header.m_messageId, 100);
     fields.add_no_quote("msg_date", "now()");
     fields.add("mod_user_id", user::current_user_id());
     //    fields.add_no_quote("msg_day", "extract(days from now()-to_date('01/01/1970','DD/MM/YYYY'))");
     fields.add_no_quote("sender_date", "now()");
     fields.add_if_not_zero("in_reply_to", m_nInReplyTo);
-    fields.add("flags", m_Attachments.size()>0?1:0);
+    fields.add("flags", d.m_Attachments.size()>0?1:0);
     if (m_nInReplyTo) {
       /* if it's a reply, then get the thread_id in order to put it
 	 into the thread */
@@ -855,6 +1144,7 @@ mail_msg::store()
 	    st1 >> m_thread_id;
 	    // and link the original message to that thread
 	    sql_stream sru ("UPDATE mail SET thread_id=:p1 WHERE mail_id=:p2", db);
+	    sru.set_batch(&batch);
 	    sru << m_thread_id << m_nInReplyTo;
 	  }
 	}
@@ -862,51 +1152,46 @@ mail_msg::store()
       }
       // update the status of the message we're replying to
       sql_stream sr ("UPDATE mail SET status=(status | :p1) WHERE mail_id=:p2", db);
+      sr.set_batch(&batch);
       sr << statusReplied+statusArchived << m_nInReplyTo;
     }
     fields.add("status", statusRead + statusOutgoing);
-    if (m_identity_id != 0)
-      fields.add("identity_id", m_identity_id);
+    if (d.m_identity_id != 0)
+      fields.add("identity_id", d.m_identity_id);
 
     QString sq = QString("INSERT INTO mail(%1) VALUES (%2)").arg(fields.fields()).arg(fields.values());
-    const char* query;
-    QByteArray qquery;
-    if (db.datab()->encoding()=="UTF8")
-      qquery=sq.toUtf8();
-    else
-      qquery=sq.toLocal8Bit();
-    query=(const char*)qquery;
-    DBG_PRINTF(5, "%s\n", query);
-    res=PQexec(c,query);
-    if (!res || PQresultStatus(res)!=PGRES_COMMAND_OK)
-      throw 1;
-    if (res)
-      PQclear(res);
+    batch.add(sq);
 
-    msg_status_cache::update(get_id(), statusRead + statusOutgoing);
-
-    if (m_body_html.isEmpty()) {
+    if (d.m_body_html.isEmpty()) {
       // plain text only
       sql_stream sb("INSERT INTO body(mail_id,bodytext) VALUES (:p1,:p2)", db);
-      sb << get_id() << m_sBody;
+      sb.set_batch(&batch);
+      sb << get_id() << d.m_sBody;
     }
     else {
       // plain text + html
       sql_stream sb("INSERT INTO body(mail_id,bodytext,bodyhtml) VALUES (:p1,:p2,:p3)", db);
-      sb << get_id() << m_sBody << m_body_html;
+      sb.set_batch(&batch);
+      sb << get_id() << d.m_sBody << d.m_body_html;
     }
 
-    result=store_tags();
+    result=store_tags(&batch);
+    batch.execute();
+    msg_status_cache::update(get_id(), statusRead + statusOutgoing);
+    result_cache::mail_changed(get_id());
+    if (m_nInReplyTo)
+      result_cache::mail_changed(m_nInReplyTo);
+
     if (result) {
       mail_header& h=header();
       h.setMailId(GetId());
       result=h.store();
     }
-    if (!m_mail_note.isEmpty()) {
+    if (!d.m_mail_note.isEmpty()) {
       result = (result && store_note());
     }
-    m_Attachments.setMailId(m_nMailId);
-    result=(result && m_Attachments.store());
+    d.m_Attachments.setMailId(m_nMailId);
+    result=(result && d.m_Attachments.store());
     if (result)
       db.commit_transaction();
     else {
@@ -954,8 +1239,8 @@ mail_msg::body_html_attached_part()
 void
 mail_msg::set_tags (const std::list<uint>& l)
 {
-  m_tags = l;
-  m_tags_fetched=true;
+  details().m_tags = l;
+  details().m_tags_fetched=true;
 }
 
 /* Extract the text that can be quoted from a message when there is no
@@ -1163,30 +1448,32 @@ QString&
 mail_msg::get_body_html()
 {
   fetch_body_html();
-  return m_body_html;
+  return details().m_body_html;
 }
 
 bool
 mail_msg::fetch_body_html()
 {
+  mail_msg_details& d = details();
   if (!GetId())
     return false;
 
-  if (!m_body_html_fetched) {
+  if (!d.m_body_html_fetched) {
     db_cnx db;
     try {
       sql_stream s("SELECT bodyhtml FROM body WHERE mail_id=:p1", db);
       s << get_id();
       if (!s.eos()) {
-	s >> m_body_html;
+	s >> d.m_body_html;
       }
-      m_body_html_fetched = true;
+      d.m_body_html_fetched = true;
     }
     catch (db_excpt p) {
       DBEXCPT(p);
-      m_body_html = QString("");
+      d.m_body_html = QString("");
       return false;
     }
+    d.touch();
   }
   return true;
 
@@ -1196,8 +1483,9 @@ mail_msg::fetch_body_html()
 bool
 mail_msg::get_rawsize(int* size)
 {
-  if (m_rawsize>0) {
-    *size=m_rawsize;
+  mail_msg_details& d = details();
+  if (d.m_rawsize>0) {
+    *size=d.m_rawsize;
     return true;
   }
   if (!get_id())
@@ -1208,8 +1496,8 @@ mail_msg::get_rawsize(int* size)
     sql_stream s("SELECT raw_size FROM mail WHERE mail_id=:p1", db);
     s << get_id();
     if (!s.eos()) {
-      s >> m_rawsize;
-      *size = m_rawsize;
+      s >> d.m_rawsize;
+      *size = d.m_rawsize;
     }
   }
   catch (db_excpt p) {
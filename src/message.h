@@ -22,6 +22,7 @@
 
 #include "dbtypes.h"
 #include "time.h"
+#include "date.h"
 #include <QString>
 
 #include "addresses.h"
@@ -36,7 +37,7 @@ public:
   mail_id_t m_id;
   QString m_from;
   QString m_subject;
-  QString m_date;
+  date m_date;
   int m_thread_id;
   int m_status;
   mail_id_t m_in_replyto;
@@ -44,6 +45,62 @@ public:
   QString m_sender_name;
   uint m_flags;
   QString m_recipients;
+  // make the strings share their buffer with equal ones (see string_pool)
+  void share_strings();
+};
+
+/*
+  The parts of a message that are needed only when it's opened or
+  composed: header, body, attachments, note, tags. A mail_msg that's
+  only a row of a list doesn't allocate them.
+
+  The texts fetched from the database (body, HTML body, headers) are
+  accounted for in a cache shared by all messages, and the least
+  recently used ones are dropped when it exceeds its size limit, to
+  be fetched again if needed.
+*/
+class mail_msg_details
+{
+public:
+  mail_msg_details(mail_id_t id);
+  ~mail_msg_details();
+  mail_msg_details(const mail_msg_details&);
+  mail_msg_details& operator=(const mail_msg_details&);
+
+  // account for the fetched texts, and drop those of other messages if needed
+  void touch();
+
+  mail_header m_header;
+  QString m_sBody;
+  QString m_body_html;
+  QString m_sHeaders;
+  int m_identity_id;
+  bool m_body_fetched;
+  bool m_body_html_fetched;
+  int m_body_fetched_length;
+  int m_body_length;
+  bool m_bHeaderFetched;
+  bool m_tags_fetched;
+  bool m_note_fetched;
+  std::list<uint> m_tags;
+  attachments_list m_Attachments;
+  QString m_mail_note;
+  bool m_mailnote_in_db;
+  int m_rawsize;
+  std::vector<mail_id_t> m_forwarded_mail_vect;
+
+private:
+  void unlink();
+  void drop_texts();
+  qint64 texts_size() const;
+  // in the cache, most recently used first
+  mail_msg_details* m_prev;
+  mail_msg_details* m_next;
+  qint64 m_cached_size;
+  static mail_msg_details* m_first;
+  static mail_msg_details* m_last;
+  static qint64 m_cache_size;
+  static qint64 max_cache_size();
 };
 
 class mail_msg
@@ -58,14 +115,18 @@ public:
     format_html
   };
 
-  virtual ~mail_msg() {}
+  mail_msg(const mail_msg&);
+  mail_msg& operator=(const mail_msg&);
+  virtual ~mail_msg();
   mail_id_t GetId() const { return m_nMailId; }
   mail_id_t getId() const { return m_nMailId; }
   mail_id_t get_id() const { return m_nMailId; }
   void SetId(mail_id_t id) {
     m_nMailId=id;
-    m_Attachments.setMailId(id);
-    m_header.setMailId(id);
+    if (m_details) {
+      m_details->m_Attachments.setMailId(id);
+      m_details->m_header.setMailId(id);
+    }
   }
   void set_mail_id(mail_id_t id) { SetId(id); }
   //static QString SubjectMakeReply(const QString& subject);
@@ -84,13 +145,13 @@ public:
     return (m_flags & flag_has_note)!=0;
   }
   bool get_rawsize(int*);
-  mail_header& header() { return m_header; }
+  mail_header& header() { return details().m_header; }
   int identity_id();
   void set_identity_id(int);
   const QString& get_headers();
   QString get_header(const QString);
   void set_header(const mail_header& header) {
-    m_header=header;
+    details().m_header=header;
   }
   void set_priority(int pri) {
     m_pri=pri;
@@ -105,8 +166,8 @@ public:
   mail_id_t inReplyTo() const { return m_nInReplyTo; }
   void setInReplyTo(mail_id_t i) { m_nInReplyTo=i; }
 
-  const std::vector<mail_id_t>& forwardOf() const { return m_forwarded_mail_vect; }
-  void set_fwded_mail_id (mail_id_t i) { m_forwarded_mail_vect.push_back(i); }
+  const std::vector<mail_id_t>& forwardOf() const { return details().m_forwarded_mail_vect; }
+  void set_fwded_mail_id (mail_id_t i) { details().m_forwarded_mail_vect.push_back(i); }
 
   void setThread(int id) { m_thread_id=id; }
 
@@ -114,19 +175,19 @@ public:
   QString& get_body_text(bool partial=false);
   QString& get_body_html();
 
-  void set_body_text(const QString& body) { m_sBody = body; }
-  void set_body_html(const QString& html) { m_body_html = html; }
+  void set_body_text(const QString& body) { details().m_sBody = body; }
+  void set_body_html(const QString& html) { details().m_body_html = html; }
   bool body_in_cache() const {
-    return m_body_fetched;
+    return m_details && m_details->m_body_fetched;
   }
   bool fetch_body_text(bool partial=false);
   bool fetch_body_html();
 
   int body_fetched_length() const {
-    return m_body_fetched_length;
+    return m_details ? m_details->m_body_fetched_length : 0;
   }
   int body_length() const {
-    return m_body_length;
+    return m_details ? m_details->m_body_length : 0;
   }
   void set_quoted_body(const QString&, const QString&, body_format);
 
@@ -138,13 +199,15 @@ public:
   QString recipients() const { return m_recipients; }
   QString Subject() const { return m_sSubject; }
   const QString subject() const { return m_sSubject; }
-  const date& msg_date() const { return m_cDate; }
+  date msg_date() const {
+    return date::from_pg_timestamp(m_timestamp);
+  }
   bool get_msg_age(const QString unit, int*); // unit="days" or "hours" or "minutes"
   bool get_sender_timestamp(time_t*);
   void set_note(const QString& s) {
-    m_mail_note=s;
+    details().m_mail_note=s;
   }
-  const QString& getNote() const { return m_mail_note; }
+  const QString& getNote() const { return details().m_mail_note; }
 
   bool set_tag (uint id, bool set=true);
   void set_tags (const std::list<uint>& l);
@@ -168,7 +231,7 @@ public:
   // (status, thread_id, operator, ...)
   void refresh();
 
-  void setDate(const date& d) { m_cDate=d; }
+  void setDate(const date& d) { m_timestamp=d.pg_timestamp(); }
 
   mail_msg setup_reply(const QString& quoteText, int whom_to, body_format format);
   mail_msg setup_forward();
@@ -188,11 +251,20 @@ public:
   bool bounce();
   bool store_note();
   bool fetchNote();
+  bool note_fetched() const { return m_details && m_details->m_note_fetched; }
+
+  /* Send without waiting for the results the queries that get what
+     is needed to display the message: status, body, header, note,
+     tags and attachments. Returns NULL if the connection can't run
+     queries asynchronously */
+  db_async_reply* fetch_display_data_async();
+  // fill the cached data with the results of fetch_display_data_async()
+  bool load_display_data(db_async_reply*);
   /* At the end of the composition of a new HTML mail, paths of files
      that are to be converted into database attachments are stored here */
   QStringList m_attached_local_files;
 
-  attachments_list& attachments() { return m_Attachments; }
+  attachments_list& attachments() { return details().m_Attachments; }
   attachment* body_html_attached_part();
 
   bool hasTag(int tag_id) const;
@@ -232,7 +304,7 @@ private:
 				   QString& dest);
   static void mail_id_to_sql_array(const std::set<mail_msg*>& s,
 				   QString& dest);
-  bool store_tags();
+  bool store_tags(sql_batch* batch=NULL);
   bool storeHeader();
   bool store_addresses();
   bool store_addresses_list(const QString&, int/*mail_address::t_addrType*/);
@@ -241,39 +313,30 @@ private:
   void make_header();
   // returns header as a string (empty if header is missing)
 private:
-  mail_header m_header;
+  // allocated at the first use
+  mail_msg_details& details() const;
+  mutable mail_msg_details* m_details;
+
   mail_id_t m_nMailId;
   uint m_flags;
-  QString m_sBody;
-  QString m_body_html;
-  QString m_sHeaders;
   QString m_sFrom;
   QString m_sSubject;
   QString m_recipients;
   QString m_sender_name;
   unsigned int m_thread_id;
   int m_pri;			// priority
-  int m_identity_id;
-  date m_cDate;
-  bool m_body_fetched;
-  bool m_body_html_fetched;
-  int m_body_fetched_length;
-  int m_body_length;
-  bool m_bHeaderFetched;
-  bool m_tags_fetched;
-  std::list<uint> m_tags;
+  /* msg_date as a PostgreSQL timestamp, rather than a date with its
+     two strings that only the opened messages need */
+  qint64 m_timestamp;
   uint m_status;
   uint m_db_status;
 
   // id of the user that last updated the status
   uint m_user_id_status;
 
-  attachments_list m_Attachments;
-  QString m_mail_note;
-  bool m_mailnote_in_db;
   mail_id_t m_nInReplyTo;
-  int m_rawsize;
-  std::vector<mail_id_t> m_forwarded_mail_vect;
+  // size of the beginning of the body text fetched for display
+  static const int partial_body_size=30000;
 };
 
 Q_DECLARE_METATYPE(mail_msg*)
@@ -34,6 +34,7 @@
 #include "body_edit.h"
 #include "searchbox.h"
 #include "selectmail.h"
+#include "sqlstream.h"
 #include "notewidget.h"
 #include "tagsdialog.h"
 #include "addressbook.h"
@@ -41,6 +42,7 @@
 #include "tags.h"
 #include "filter_log.h"
 #include "notepad.h"
+#include "query_stats.h"
 
 #ifdef HAVE_TRAYICON
 #include "trayicon.h"
@@ -94,7 +96,7 @@ msg_list_window::search_db()
   msgs_filter f;
   //  f.m_max_results=200;
   f.set_date_order(-1);	// latest results first
-  f.parse_search_string(txt, f.m_words, f.m_substrs);
+  f.parse_search_string(txt, f.m_words, f.m_substrs, &f.m_excluded_words);
   //  DBG_PRINTF(3, "words=(%s)\n", f.m_words.join("/").latin1());
   //  DBG_PRINTF(3, "substrs=(%s)\n", f.m_substrs.join("/").latin1());
   //  f.m_words = QStringList::split(" ", txt);
@@ -555,6 +557,7 @@ msg_list_window::init_menu()
   m_pMenuDisplay->addMenu(m_pPopupHeaders);
 
   m_pMenuDisplay->addAction(tr("Store settings"), this, SLOT(save_display_settings()));
+  m_pMenuDisplay->addAction(tr("Query statistics"), this, SLOT(show_query_stats()));
 
 
   
@@ -720,9 +723,18 @@ msg_list_window::msg_list_window (const msgs_filter* filter, display_prefs* dpre
   m_abort = false;
   m_ignore_selection_change = false;
   m_waiting_for_results = true;
+  m_loading_filter = NULL;
+  m_loading_page_opened = false;
+  m_prefetch_filter = NULL;
+  m_prefetch_source = NULL;
+  m_prefetch_bound = 0;
+  m_prefetch_ready = false;
+  m_use_prefetch = false;
   m_qlist = NULL;
   m_filter = new msgs_filter(*filter);
   m_pCurrentItem = NULL;
+  m_display_reply = NULL;
+  m_display_mail_id = 0;
 
   // application icon
   setWindowIcon(FT_MAKE_ICON(FT_ICON16_EDIT));
@@ -817,9 +829,15 @@ msg_list_window::msg_list_window (const msgs_filter* filter, display_prefs* dpre
 
   m_timer = new QTimer(this);
   m_timer_ticks=0;
-  m_timer->start(200);
+  m_timer->start(60*1000);
   connect(m_timer, SIGNAL(timeout()), this, SLOT(timer_func()));
 
+  connect(&m_thread, SIGNAL(fetch_done(int)), this, SLOT(fetch_finished(int)));
+  connect(&m_thread, SIGNAL(results_available()), this, SLOT(show_partial_results()));
+  connect(&m_thread, SIGNAL(progress(int)), this, SLOT(show_fetch_progress(int)));
+  connect(&m_prefetch_thread, SIGNAL(fetch_done(int)), this, SLOT(prefetch_finished(int)));
+  connect(&m_count_thread, SIGNAL(counted(int,int,bool)), this, SLOT(count_result(int,int,bool)));
+
   connect(this, SIGNAL(mail_chg_status(int,mail_msg*)), SLOT(change_mail_status(int,mail_msg*)));
 
   connect(this, SIGNAL(mail_multi_chg_status(int,std::vector<mail_msg*>*)), SLOT(change_multi_mail_status(int,std::vector<mail_msg*>*)));
@@ -853,7 +871,7 @@ msg_list_window::msg_list_postprocess()
   m_qlist->header()->setSortIndicatorShown(true);
   m_qlist->setRootIsDecorated(display_vars.m_threaded);
   // m_qlist->scroll_to_bottom(); // too slow
-  m_qlist->expandAll();
+  start_count();
   set_title();
 }
 
@@ -913,6 +931,11 @@ msg_list_window::toggle_fetch_on_demand(bool on_demand)
 
 msg_list_window::~msg_list_window()
 {
+  cancel_prefetch();
+  m_count_thread.cancel();
+  m_count_thread.wait();
+  if (m_display_reply)
+    m_display_reply->abandon();
   if (m_wSearch) {
     delete m_wSearch;
   }
@@ -1210,7 +1233,12 @@ void
 msg_list_window::set_title(const QString title/*=QString::null*/)
 {
   if (title.isEmpty()) {
-    QString sTitle=QString("%3: %1%4 %2").arg(m_filter->m_list_msgs.size()).arg(tr("message(s)")).arg(db_cnx::dbname(), m_filter->has_more_results()?"+":"");
+    QString sTitle;
+    if (m_filter->has_more_results() && m_filter->m_total_count>=0) {
+      sTitle=QString("%1: %2 %3 %4%5 %6").arg(db_cnx::dbname()).arg(m_filter->m_list_msgs.size()).arg(tr("of")).arg(m_filter->m_total_exact?"":"~").arg(qMax(m_filter->m_total_count, (int)m_filter->m_list_msgs.size())).arg(tr("message(s)"));
+    }
+    else
+      sTitle=QString("%3: %1%4 %2").arg(m_filter->m_list_msgs.size()).arg(tr("message(s)")).arg(db_cnx::dbname(), m_filter->has_more_results()?"+":"");
     setWindowTitle(sTitle);
   }
   else
@@ -1549,6 +1577,15 @@ msg_list_window::show_headers(QAction* which)
   mails_selected();
 }
 
+void
+msg_list_window::show_query_stats()
+{
+  query_stats_window* w = query_stats_window::open_unique();
+  w->show();
+  w->activateWindow();
+  w->raise();
+}
+
 void
 msg_list_window::open_global_notepad()
 {
@@ -1917,6 +1954,12 @@ void
 msg_list_window::abort_operation()
 {
   m_abort=true;
+  if (m_use_prefetch) {
+    cancel_prefetch();
+    hide_abort_button();
+    enable_interaction(true);
+    statusBar()->showMessage(tr("Query cancelled."));
+  }
   if (m_waiting_for_results) {	// query in progress
     m_waiting_for_results = false;
     m_thread.cancel();
@@ -1980,6 +2023,9 @@ msg_list_window::sel_filter(const msgs_filter& f)
   statusBar()->showMessage(tr("Querying database..."));
 
   m_loading_filter = new msgs_filter(f);
+  m_loading_page_opened = false;
+  // results can be shown as they come unless they go to another window
+  m_thread.m_progressive = !want_new_window();
   int r = m_loading_filter->asynchronous_fetch(&m_thread);
   if (r==1) {
     m_waiting_for_results = true;
@@ -2121,6 +2167,23 @@ msg_list_window::sel_refine()
 void
 msg_list_window::fetch_more()
 {
+  if (m_prefetch_filter && m_prefetch_source==m_filter &&
+      m_prefetch_bound==m_filter->bound_mail_id())
+  {
+    if (m_prefetch_ready)
+      use_prefetch();
+    else {
+      // the next page is being fetched: wait for it
+      setCursor(Qt::WaitCursor);
+      show_abort_button();
+      enable_interaction(false);
+      statusBar()->showMessage(tr("Querying database..."));
+      m_use_prefetch = true;
+    }
+    return;
+  }
+  cancel_prefetch();
+
   setCursor(Qt::WaitCursor);
 //  m_new_mail_btn->hide();
   show_abort_button();
@@ -2128,6 +2191,7 @@ msg_list_window::fetch_more()
   statusBar()->showMessage(tr("Querying database..."));
 
   m_filter->m_fetch_results=NULL;
+  m_thread.m_progressive = true;
   int r = m_filter->asynchronous_fetch(&m_thread, true);
   DBG_PRINTF(8, "after async_fetch m_filter->results as %d elements", m_filter->m_list_msgs.size());
   if (r==1) {
@@ -2141,10 +2205,109 @@ msg_list_window::fetch_more()
   }
 }
 
+/*
+  Start fetching the page that follows the results of the current
+  selection, unless it's already done or the selection is complete.
+  Client-side word searches are excluded since their "fetch more"
+  relies on the state of the thread that ran the search.
+*/
+void
+msg_list_window::prefetch_next_page()
+{
+  if (m_prefetch_filter || m_waiting_for_results || !m_filter)
+    return;
+  if (!m_filter->has_more_results() || m_filter->m_client_wordsearch ||
+      !get_config().get_bool("fetch/prefetch_next_page", true))
+    return;
+  DBG_PRINTF(5, "prefetch of the next page after mail_id=%u", m_filter->bound_mail_id());
+  m_prefetch_filter = new msgs_filter(*m_filter);
+  // the results and messages belong to m_filter
+  m_prefetch_filter->m_fetch_results = NULL;
+  m_prefetch_filter->m_list_msgs.clear();
+  m_prefetch_source = m_filter;
+  m_prefetch_bound = m_filter->bound_mail_id();
+  m_prefetch_ready = false;
+  m_prefetch_thread.m_progressive = false;
+  if (m_prefetch_filter->asynchronous_fetch(&m_prefetch_thread, true)!=1) {
+    m_prefetch_thread.release();
+    delete m_prefetch_filter;
+    m_prefetch_filter = NULL;
+  }
+}
+
+void
+msg_list_window::prefetch_finished(int generation)
+{
+  if (!m_prefetch_filter || generation!=m_prefetch_thread.m_generation)
+    return;
+  m_prefetch_thread.wait();
+  /* give back the connection now: the results stay in the thread
+     object until the page is used, which may never happen */
+  m_prefetch_thread.release();
+  if (!m_prefetch_thread.m_errstr.isEmpty()) {
+    DBG_PRINTF(3, "prefetch failed: %s", m_prefetch_thread.m_errstr.toLocal8Bit().constData());
+    bool waiting = m_use_prefetch;
+    cancel_prefetch();
+    if (waiting) {
+      unsetCursor();
+      hide_abort_button();
+      enable_interaction(true);
+      fetch_more();		// the regular way, which reports the error
+    }
+    return;
+  }
+  m_prefetch_ready = true;
+  if (m_use_prefetch) {
+    unsetCursor();
+    hide_abort_button();
+    enable_interaction(true);
+    use_prefetch();
+  }
+}
+
+// Append the prefetched page to the list, as fetch_more() would do
+void
+msg_list_window::use_prefetch()
+{
+  m_use_prefetch = false;
+  m_filter->postprocess_fetch(m_prefetch_thread);
+  // like fetch_more(), don't free the list that m_fetch_results points to
+  m_filter->m_fetch_results = m_prefetch_filter->m_fetch_results;
+  m_prefetch_filter->m_fetch_results = NULL;
+  m_filter->make_list(m_qlist);
+  delete m_prefetch_filter;
+  m_prefetch_filter = NULL;
+  m_prefetch_ready = false;
+  set_title();
+  statusBar()->clearMessage();
+  // the user is paging through the results: get the following page
+  prefetch_next_page();
+}
+
+// Stop and forget the prefetch, if any
+void
+msg_list_window::cancel_prefetch()
+{
+  if (!m_prefetch_filter)
+    return;
+  DBG_PRINTF(5, "cancel_prefetch()");
+  m_prefetch_thread.cancel();
+  m_prefetch_thread.release();
+  delete m_prefetch_filter;
+  m_prefetch_filter = NULL;
+  m_prefetch_source = NULL;
+  m_prefetch_ready = false;
+  if (m_use_prefetch) {
+    m_use_prefetch = false;
+    unsetCursor();
+  }
+}
+
 void
 msg_list_window::fill_fetch(msgs_filter* f)
 {
   DBG_PRINTF(5,"fill_fetch()");
+  cancel_prefetch();
 
   // clear old contents
   m_qlist->clear();
@@ -2155,6 +2318,7 @@ msg_list_window::fill_fetch(msgs_filter* f)
   // show new contents
   *m_filter=*f;
   m_filter->make_list(m_qlist);
+  start_count();
   set_title();
 }
 
@@ -2209,7 +2373,9 @@ msg_list_window::sel_bottom()
 void
 msg_list_window::sel_refresh_list()
 {
+  cancel_prefetch();
   m_filter->fetch(m_qlist);
+  start_count();
   set_title();
   if (m_filter->auto_refresh()) {
 //    m_new_mail_btn->enable(false);
@@ -2223,7 +2389,9 @@ void
 msg_list_window::sel_auto_refresh_list()
 {
   if (m_filter->auto_refresh()) {
+    cancel_prefetch();
     m_filter->fetch(m_qlist);
+    start_count();
     set_title();
   }
 }
@@ -2600,7 +2768,8 @@ msg_list_window::display_msg_note()
 {
   if (!m_pCurrentItem || !m_qAttch)
     return;
-  m_pCurrentItem->fetchNote();
+  if (!m_pCurrentItem->note_fetched())
+    m_pCurrentItem->fetchNote();
   QString n = m_pCurrentItem->getNote();
   uint index=0;
   attch_lvitem* lvpItem = dynamic_cast<attch_lvitem*>(m_qAttch->topLevelItem(0));
@@ -2832,12 +3001,58 @@ void
 msg_list_window::mail_selected(mail_msg* msg)
 {
   m_pCurrentItem=msg;
+  if (m_display_reply) {
+    // a previous selection is still being fetched
+    m_display_reply->abandon();
+    m_display_reply=NULL;
+  }
   if (!msg) {
     DBG_PRINTF(6, "mail_selected: null msg");
     return;
   }
   DBG_PRINTF(5,"mail_selected: %d", msg->GetId());
+  if (!m_fetch_on_demand && !(msg->status() & mail_msg::statusAttached)) {
+    /* Get everything to display in one round trip, without blocking
+       the window. The display happens in display_data_fetched() */
+    m_display_reply = msg->fetch_display_data_async();
+    if (m_display_reply) {
+      m_display_mail_id = msg->get_id();
+      connect(m_display_reply, SIGNAL(finished()),
+	      this, SLOT(display_data_fetched()));
+      return;
+    }
+  }
   m_qlist->refresh(msg->get_id()); // will update from database
+  show_selected_mail(msg);
+}
+
+// slot
+void
+msg_list_window::display_data_fetched()
+{
+  db_async_reply* r = dynamic_cast<db_async_reply*>(sender());
+  if (!r)
+    return;
+  r->deleteLater();
+  if (r!=m_display_reply)
+    return;
+  m_display_reply=NULL;
+  mail_msg* msg=m_pCurrentItem;
+  if (!msg || msg->get_id()!=m_display_mail_id)
+    return;
+  if (msg->load_display_data(r))
+    m_qlist->update_msg(msg);
+  else
+    m_qlist->refresh(msg->get_id()); // synchronous fallback
+  show_selected_mail(msg);
+}
+
+/* Display the message that has just been selected, and mark it as
+   read. The data that hasn't been loaded beforehand is fetched
+   synchronously */
+void
+msg_list_window::show_selected_mail(mail_msg* msg)
+{
   // display body
   m_msgview->set_mail_item(msg);
   if (!m_fetch_on_demand) {
@@ -2982,17 +3197,19 @@ msg_list_window::check_new_mail()
     statusBar()->showMessage(tr("Checking for new mail..."));
     sql_query q;
     m_filter->build_query(q);
-#ifdef WITH_PGSQL
-    PGconn* c=GETDB();
-    QString s=q.get();
-    QByteArray qb = s.toLatin1();
-    const char* query=qb.constData();
-    DBG_PRINTF(5,"%s", query);
-    PGresult* res = PQexec(c, query);
     m_auto_refresh_results.clear();
-    m_filter->load_result_list(res, &m_auto_refresh_results);
-    if (res) PQclear(res);
-#endif // WITH_PGSQL
+    try {
+      db_cnx db;
+      sql_stream s(q.get(), db, false);
+      s.set_binary_results();
+      s.execute();
+      m_filter->load_result_list(s, &m_auto_refresh_results);
+    }
+    catch(db_excpt& p) {
+      DBG_PRINTF(2, "check_new_mail: %s", p.errmsg().toLocal8Bit().constData());
+      statusBar()->showMessage(tr("Error while checking for new mail."));
+      return;
+    }
     if (!m_auto_refresh_results.empty()) {
       DBG_PRINTF(5, "non empty refresh result list");
       // check if any of these results is new
@@ -3040,85 +3257,170 @@ msg_list_window::blip_status_message(const QString& msg)
     statusBar()->showMessage(msg, 3000);
 }
 
+/*
+  Incorporate the results that a progressive fetch has received
+  so far. The first batch of a new selection opens its page.
+*/
 void
-msg_list_window::timer_func()
+msg_list_window::show_partial_results()
 {
-  m_timer_ticks++;
+  if (!m_thread.m_progressive)
+    return;
+  std::list<mail_result> batch;
+  if (m_thread.take_results(batch)==0)
+    return;
+  DBG_PRINTF(5, "%d partial results received", (int)batch.size());
+  if (m_thread.m_fetch_more) {
+    m_filter->append_results(m_qlist, batch);
+  }
+  else if (m_loading_filter && m_loading_filter->m_fetch_results) {
+    if (!m_loading_page_opened) {
+      m_loading_filter->m_fetch_results->splice(m_loading_filter->m_fetch_results->end(), batch);
+      add_msgs_page(m_loading_filter, false); // will instantiate m_filter
+      m_loading_page_opened = true;
+    }
+    else {
+      m_filter->append_results(m_qlist, batch);
+    }
+  }
+}
 
-  // Check if we got results from a fetch
-  if (m_waiting_for_results && m_thread.isFinished()) {
-    DBG_PRINTF(5, "End of asynchronous fetch detected in timer_func()");
-    m_waiting_for_results = false;
+/*
+  End of a fetch run by m_thread. The signal of a run that was aborted
+  may arrive after another one was started, hence the generation
+*/
+void
+msg_list_window::fetch_finished(int generation)
+{
+  if (!m_waiting_for_results || generation!=m_thread.m_generation)
+    return;
+  DBG_PRINTF(5, "End of asynchronous fetch");
+  m_waiting_for_results = false;
+  // run() is returning
+  m_thread.wait();
 
-    enable_interaction(true);
+  enable_interaction(true);
+  show_partial_results();
 
-    if (m_thread.m_fetch_more) { // FIXME: use a better abstraction
-      // this is a "fetch more" operation. It uses the current filter (m_filter)
-      m_filter->postprocess_fetch(m_thread);
+  if (m_thread.m_fetch_more) { // FIXME: use a better abstraction
+    // this is a "fetch more" operation. It uses the current filter (m_filter)
+    m_filter->postprocess_fetch(m_thread);
+    if (!m_thread.m_progressive) {
       DBG_PRINTF(8, "fetch_more -> make_list");
       m_filter->make_list(m_qlist);
-      DBG_PRINTF(8, "after async_fetch m_filter->results as %d elements", m_filter->m_list_msgs.size());
-      set_title();
     }
-    else if (m_loading_filter && m_loading_filter->m_fetch_results) {
-      // this is a fetch for a new list of results. It uses a temporary filter
-      m_loading_filter->postprocess_fetch(m_thread);
-      if (want_new_window()) {
-	msg_list_window* w = new msg_list_window(m_loading_filter, 0);
-	w->show();
-      }
-      else {
-	add_msgs_page(m_loading_filter, false); // will instantiate m_filter
-      }
+    DBG_PRINTF(8, "after async_fetch m_filter->results as %d elements", m_filter->m_list_msgs.size());
+    set_title();
+  }
+  else if (m_loading_page_opened) {
+    // the page was opened by the first batch of results
+    m_filter->postprocess_fetch(m_thread);
+    msg_list_postprocess();
+  }
+  else if (m_loading_filter && m_loading_filter->m_fetch_results) {
+    // this is a fetch for a new list of results. It uses a temporary filter
+    m_loading_filter->postprocess_fetch(m_thread);
+    if (want_new_window()) {
+      msg_list_window* w = new msg_list_window(m_loading_filter, 0);
+      w->show();
     }
+    else {
+      add_msgs_page(m_loading_filter, false); // will instantiate m_filter
+    }
+  }
 
-    m_thread.release();
+  m_thread.release();
 
-    unsetCursor();
-    hide_abort_button();
+  unsetCursor();
+  hide_abort_button();
 //    m_new_mail_btn->show();
 
 #if 0
-    if (m_loading_filter->exec_time() < 0) {
-      statusBar()->showMessage(tr("Query failed."));
-    }
-    else
+  if (m_loading_filter->exec_time() < 0) {
+    statusBar()->showMessage(tr("Query failed."));
+  }
+  else
 #endif
-    {
-      double exec_time = m_thread.m_exec_time/1000.0; // in seconds
-      statusBar()->showMessage(tr("Query executed in %1 s.").arg(exec_time, 0, 'f', 2),3000);
-    }
-    if (m_loading_filter) {
-      delete m_loading_filter;
-      m_loading_filter = NULL;
-    }
+  {
+    double exec_time = m_thread.m_exec_time/1000.0; // in seconds
+    statusBar()->showMessage(tr("Query executed in %1 s.").arg(exec_time, 0, 'f', 2),3000);
+  }
+  if (m_loading_filter) {
+    delete m_loading_filter;
+    m_loading_filter = NULL;
   }
+}
 
-  else {
-    int delay=get_config().get_number("fetch/auto_refresh_messages_list"); // minutes
-    if (delay!=0 && m_timer_ticks%(delay*60*5)==0) {
-      db_cnx db;
-      if (!db.ping()) {
-	DBG_PRINTF(3, "No reply to database ping");
-	if (!db.datab()->reconnect()) {
-	  DBG_PRINTF(3, "Failed to reconnect to database");
-	  return;
-	}
-	else {
-	  DBG_PRINTF(3, "Database reconnect successful");
-	}
-      }
+/*
+  Count the results of the current selection in the background if
+  they're not all fetched. The planner's estimate comes first, then
+  the exact count unless it takes longer than fetch/count_timeout
+  seconds.
+*/
+void
+msg_list_window::start_count()
+{
+  if (!m_filter || !m_filter->has_more_results() || m_filter->m_total_count>=0
+      || !m_filter->countable())
+    return;
+  if (m_count_thread.isRunning() && m_count_thread.m_query==m_filter->user_query())
+    return;
+  int timeout = get_config().exists("fetch/count_timeout") ?
+    get_config().get_number("fetch/count_timeout") : 10;
+  if (timeout<=0)
+    return;			// disabled
+  m_count_thread.count(m_filter->user_query(), timeout*1000);
+}
 
-      m_query_lv->refresh();
+void
+msg_list_window::count_result(int generation, int count, bool exact)
+{
+  if (generation!=m_count_thread.m_generation || !m_filter)
+    return;
+  if (m_filter->user_query()!=m_count_thread.m_query)
+    return;			// another page is shown
+  if (m_filter->m_total_exact)
+    return;
+  m_filter->m_total_count = count;
+  m_filter->m_total_exact = exact;
+  set_title();
+}
+
+void
+msg_list_window::show_fetch_progress(int count)
+{
+  if (m_waiting_for_results)
+    statusBar()->showMessage(tr("Querying database... (%1 messages)").arg(count));
+}
+
+void
+msg_list_window::timer_func()
+{
+  m_timer_ticks++;
 
-      if (get_config().get_bool("fetch/auto_incorporate_new_results", false)) {
-	if (m_filter->auto_refresh())
-	  sel_refresh_list();
+  int delay=get_config().get_number("fetch/auto_refresh_messages_list"); // minutes
+  if (delay!=0 && !m_waiting_for_results && m_timer_ticks%delay==0) {
+    db_cnx db;
+    if (!db.ping()) {
+      DBG_PRINTF(3, "No reply to database ping");
+      if (!db.datab()->reconnect()) {
+	DBG_PRINTF(3, "Failed to reconnect to database");
+	return;
       }
       else {
-	check_new_mail();
+	DBG_PRINTF(3, "Database reconnect successful");
       }
     }
+
+    m_query_lv->refresh();
+
+    if (get_config().get_bool("fetch/auto_incorporate_new_results", false)) {
+      if (m_filter->auto_refresh())
+	sel_refresh_list();
+    }
+    else {
+      check_new_mail();
+    }
   }
 }
 
@@ -142,6 +142,12 @@ public slots:
   void show_progress(int progress);
   void timer_func();
   void timer_idle();
+  void fetch_finished(int generation);
+  void show_partial_results();
+  void show_fetch_progress(int count);
+  void prefetch_next_page();
+  void prefetch_finished(int generation);
+  void count_result(int generation, int count, bool exact);
   void abort_operation();
 
   void msg_zoom_in();
@@ -199,9 +205,11 @@ public slots:
   void toggle_include_tags_in_headers(bool);
   void cycle_headers();
   void save_display_settings();
+  void show_query_stats();
 
   void search_finished();
   void mail_selected(mail_msg*);
+  void display_data_fetched();
   void display_selection_tags();
   void mails_selected();
   void mail_reply_sender();
@@ -279,6 +287,7 @@ private:
 
   void store_quick_sel(query_lvitem::item_type type, uint tag_id=0);
   void msg_list_postprocess();
+  void show_selected_mail(mail_msg*);
   void remove_selected_msgs(int action);	// 0=trash, 1=delete
   void change_page(msgs_page*);
   bool want_new_window() const;
@@ -389,13 +398,39 @@ private:
   QTimer* m_timer;
   QTimer* m_timer_idle;
   msgs_filter* m_loading_filter;
-  int m_timer_ticks;		/* in 1/5 seconds */
+  int m_timer_ticks;		/* in minutes */
   bool m_waiting_for_results;
+  /* true when the page for m_loading_filter has been opened with
+     the first batch of results, before the end of the query */
+  bool m_loading_page_opened;
+
+  /* Next page of the current selection, fetched in the background when
+     the list is scrolled to its end. m_prefetch_filter is a copy of
+     m_prefetch_source (m_filter at the time) whose results are those
+     of the page. When m_use_prefetch is set, fetch_more() is waiting
+     for it */
+  fetch_thread m_prefetch_thread;
+  msgs_filter* m_prefetch_filter;
+  const msgs_filter* m_prefetch_source;
+  mail_id_t m_prefetch_bound;
+  bool m_prefetch_ready;
+  bool m_use_prefetch;
+  void cancel_prefetch();
+  void use_prefetch();
+
+  /* Total number of results of the current selection when it's not
+     fetched entirely, shown in the title by set_title() */
+  count_thread m_count_thread;
+  void start_count();
 
   // current page's widgets and data
   msgs_filter* m_filter;
   message_view* m_msgview;
   mail_msg* m_pCurrentItem;
+  /* pending asynchronous fetch of the data to display the selected
+     message, and that message's id */
+  db_async_reply* m_display_reply;
+  mail_id_t m_display_mail_id;
   attch_listview* m_qAttch;
   mail_listview* m_qlist;
 
@@ -34,6 +34,7 @@
 void
 msg_list_window::change_page(msgs_page* p)
 {
+  cancel_prefetch();
   // update the variables that have to point to the current page's data
   m_qlist = p->m_page_qlist;
   m_qAttch = p->m_page_attach;
@@ -156,6 +157,7 @@ msgs_page::refresh_status(mail_msg* msg, int code)
 void
 msg_list_window::add_msgs_page(const msgs_filter* f, bool if_results _UNUSED_)
 {
+  cancel_prefetch();
   m_filter = new msgs_filter(*f);
   QFont body_font;
   QFont list_font;
@@ -253,6 +255,7 @@ msg_list_window::add_msgs_page(const msgs_filter* f, bool if_results _UNUSED_)
 	  this, SLOT(action_click_msg_list(const QModelIndex&)));
 
   connect(m_qlist, SIGNAL(scroll_page_down()), m_msgview, SLOT(page_down()));
+  connect(m_qlist, SIGNAL(near_end()), this, SLOT(prefetch_next_page()));
 
   if (m_pages->next_page()) {
     // we're in the middle of a page list, and asked to go forward.
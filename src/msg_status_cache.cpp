@@ -114,6 +114,7 @@ msg_status_cache::db_new_mail_notif()
       count++;
       DBG_PRINTF(3, "Seen mail_id %d with status %d", mail_id, status);
       update(mail_id, status);
+      result_cache::mail_changed(mail_id);
       //      emit new_mail_notified(mail_id); // for the message port
       message_port::instance()->broadcast_new_mail(mail_id);
     }
@@ -23,6 +23,7 @@
 #include "dbtypes.h"
 #include "db_listener.h"
 #include "message.h"
+#include "result_cache.h"
 #include <map>
 
 // mail_id => status
@@ -40,9 +41,14 @@ public:
   static const int c_mask_unread=mail_msg::statusRead | mail_msg::statusTrashed | mail_msg::statusArchived;
   static const int c_mask_unprocessed = mail_msg::statusTrashed | mail_msg::statusArchived | mail_msg::statusSent;
   static inline void update(mail_id_t id, int status) {
-    if (status==-1 /*|| (status&(mail_msg::statusTrashed | mail_msg::statusArchived))!=0*/)
+    if (status==-1 /*|| (status&(mail_msg::statusTrashed | mail_msg::statusArchived))!=0*/) {
       global_status_map.erase(id);
+      result_cache::mail_changed(id);
+    }
     else {
+      msg_status_map::iterator it = global_status_map.find(id);
+      if (it!=global_status_map.end() && it->second!=status)
+	result_cache::mail_changed(id);
       global_status_map[id] = status;
       if (id > m_max_mail_id)
 	m_max_mail_id = id;
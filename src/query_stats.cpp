@@ -0,0 +1,353 @@
+/* Copyright (C) 2004-2011 Daniel Verite
+
+   This file is part of Manitou-Mail (see http://www.manitou-mail.org)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#include "main.h"
+#include "query_stats.h"
+
+#ifdef _WINDOWS
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include <algorithm>
+
+#include <QBoxLayout>
+#include <QFile>
+#include <QFileDialog>
+#include <QFont>
+#include <QMessageBox>
+#include <QPlainTextEdit>
+#include <QPushButton>
+#include <QRegExp>
+#include <QTextStream>
+#include <QTimer>
+
+std::map<std::string,query_stats::entry> query_stats::m_entries;
+std::map<std::string,qint64> query_stats::m_counters;
+QMutex query_stats::m_mutex;
+volatile bool query_stats::m_enabled;
+
+//static
+qint64
+query_stats::clock_us()
+{
+#ifdef _WINDOWS
+  return (qint64)GetTickCount()*1000;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (qint64)tv.tv_sec*1000000 + tv.tv_usec;
+#endif
+}
+
+//static
+void
+query_stats::set_enabled(bool on)
+{
+  m_enabled=on;
+}
+
+/*
+  Replace the string and numeric literals by '?', collapse lists of
+  them and the runs of whitespace. Placeholders like :p1 or $1 are
+  kept as they are.
+*/
+//static
+std::string
+query_stats::normalize(const char* query)
+{
+  std::string out;
+  const char* p=query;
+  bool in_word=false;		// inside an identifier or placeholder
+  while (*p) {
+    char c=*p;
+    if (c=='\'') {
+      p++;
+      while (*p) {
+	if (*p=='\'') {
+	  if (*(p+1)=='\'')
+	    p++;		// doubled quote
+	  else
+	    break;
+	}
+	p++;
+      }
+      if (*p)
+	p++;
+      out += '?';
+      in_word=false;
+    }
+    else if (c>='0' && c<='9' && !in_word) {
+      while ((*p>='0' && *p<='9') || *p=='.')
+	p++;
+      out += '?';
+    }
+    else if (c==' ' || c=='\t' || c=='\n' || c=='\r') {
+      while (*p==' ' || *p=='\t' || *p=='\n' || *p=='\r')
+	p++;
+      if (!out.empty())
+	out += ' ';
+      in_word=false;
+    }
+    else {
+      in_word = ((c>='a' && c<='z') || (c>='A' && c<='Z') ||
+		 (c>='0' && c<='9') || c=='_' || c==':' || c=='$');
+      out += c;
+      p++;
+    }
+  }
+  // IN (?,?,?) and the like
+  QString s=QString::fromUtf8(out.c_str());
+  s.replace(QRegExp("\\?(\\s*,\\s*\\?)+"), "?,...");
+  return std::string(s.trimmed().toUtf8().constData());
+}
+
+//static
+qint64
+query_stats::result_bytes(const PGresult* res)
+{
+  qint64 bytes=0;
+  int nrows=PQntuples(res);
+  int ncols=PQnfields(res);
+  for (int r=0; r<nrows; r++) {
+    for (int c=0; c<ncols; c++)
+      bytes += PQgetlength(res, r, c);
+  }
+  return bytes;
+}
+
+//static
+void
+query_stats::result_size(const PGresult* res, int* rows, qint64* bytes)
+{
+  *rows=0;
+  *bytes=0;
+  if (res) {
+    if (PQresultStatus(res)==PGRES_TUPLES_OK) {
+      *rows=PQntuples(res);
+      *bytes=result_bytes(res);
+    }
+    else {
+      const char* t=PQcmdTuples((PGresult*)res);
+      if (t && *t)
+	*rows=atoi(t);
+    }
+  }
+}
+
+//static
+void
+query_stats::record(const char* query, qint64 elapsed_us, const PGresult* res)
+{
+  if (!m_enabled)
+    return;
+  int rows;
+  qint64 bytes;
+  result_size(res, &rows, &bytes);
+  record_normalized(normalize(query), elapsed_us, rows, bytes);
+}
+
+//static
+void
+query_stats::record(const char* query, qint64 elapsed_us, int rows,
+		    qint64 bytes)
+{
+  if (m_enabled)
+    record_normalized(normalize(query), elapsed_us, rows, bytes);
+}
+
+//static
+void
+query_stats::record_normalized(const std::string& key, qint64 elapsed_us,
+			       int rows, qint64 bytes)
+{
+  if (!m_enabled)
+    return;
+  QMutexLocker locker(&m_mutex);
+  entry& e=m_entries[key];
+  e.calls++;
+  e.total_us += elapsed_us;
+  if (elapsed_us > e.max_us)
+    e.max_us = elapsed_us;
+  e.rows += rows;
+  e.bytes += bytes;
+  if ((int)e.samples.size() < max_samples)
+    e.samples.push_back(elapsed_us);
+  else {
+    e.samples[e.next_sample] = elapsed_us;
+    e.next_sample = (e.next_sample+1) % max_samples;
+  }
+}
+
+//static
+void
+query_stats::reset()
+{
+  QMutexLocker locker(&m_mutex);
+  m_entries.clear();
+  m_counters.clear();
+}
+
+void
+query_stats::add_counter(const char* name, qint64 value)
+{
+  QMutexLocker locker(&m_mutex);
+  m_counters[name] += value;
+}
+
+static bool
+total_time_greater(const std::pair<std::string,qint64>& a,
+		   const std::pair<std::string,qint64>& b)
+{
+  return a.second > b.second;
+}
+
+//static
+QString
+query_stats::report()
+{
+  QMutexLocker locker(&m_mutex);
+  std::vector<std::pair<std::string,qint64> > order;
+  std::map<std::string,entry>::const_iterator it;
+  for (it=m_entries.begin(); it!=m_entries.end(); ++it) {
+    order.push_back(std::pair<std::string,qint64>(it->first, it->second.total_us));
+  }
+  std::sort(order.begin(), order.end(), total_time_greater);
+
+  QString out = QString("%1 %2 %3 %4 %5 %6 %7 %8  %9\n")
+    .arg("calls", 7).arg("total ms", 10).arg("avg ms", 9)
+    .arg("p50 ms", 9).arg("p99 ms", 9).arg("max ms", 9)
+    .arg("rows", 9).arg("kB", 9).arg("statement");
+  for (unsigned int i=0; i<order.size(); i++) {
+    const entry& e=m_entries[order[i].first];
+    std::vector<qint64> sorted=e.samples;
+    std::sort(sorted.begin(), sorted.end());
+    qint64 p50=0, p99=0;
+    if (!sorted.empty()) {
+      p50=sorted[(sorted.size()-1)*50/100];
+      p99=sorted[(sorted.size()-1)*99/100];
+    }
+    out.append(QString("%1 %2 %3 %4 %5 %6 %7 %8  %9\n")
+	       .arg(e.calls, 7)
+	       .arg(e.total_us/1000.0, 10, 'f', 1)
+	       .arg(e.total_us/1000.0/e.calls, 9, 'f', 2)
+	       .arg(p50/1000.0, 9, 'f', 2)
+	       .arg(p99/1000.0, 9, 'f', 2)
+	       .arg(e.max_us/1000.0, 9, 'f', 2)
+	       .arg(e.rows, 9)
+	       .arg(e.bytes/1024.0, 9, 'f', 1)
+	       .arg(QString::fromUtf8(order[i].first.c_str())));
+  }
+  if (!m_counters.empty()) {
+    out.append('\n');
+    std::map<std::string,qint64>::const_iterator ic;
+    for (ic=m_counters.begin(); ic!=m_counters.end(); ++ic) {
+      out.append(QString("%1: %2\n").arg(QString::fromUtf8(ic->first.c_str())).arg(ic->second));
+    }
+  }
+  return out;
+}
+
+query_stats_window* query_stats_window::m_instance;
+
+//static
+query_stats_window*
+query_stats_window::open_unique()
+{
+  if (!m_instance)
+    m_instance = new query_stats_window();
+  return m_instance;
+}
+
+query_stats_window::query_stats_window()
+{
+  setWindowTitle(tr("Query statistics"));
+  m_edit->setReadOnly(true);
+  m_edit->setLineWrapMode(QPlainTextEdit::NoWrap);
+  QFont font("Courier");
+  font.setStyleHint(QFont::TypeWriter);
+  m_edit->setFont(font);
+
+  QHBoxLayout* buttons = new QHBoxLayout;
+  QPushButton* b_save = new QPushButton(tr("Save to file..."));
+  QPushButton* b_reset = new QPushButton(tr("Reset"));
+  QPushButton* b_close = new QPushButton(tr("Close"));
+  buttons->addWidget(b_save);
+  buttons->addWidget(b_reset);
+  buttons->addStretch(1);
+  buttons->addWidget(b_close);
+  QBoxLayout* l = dynamic_cast<QBoxLayout*>(layout());
+  if (l)
+    l->addLayout(buttons);
+  connect(b_save, SIGNAL(clicked()), this, SLOT(save()));
+  connect(b_reset, SIGNAL(clicked()), this, SLOT(reset_stats()));
+  connect(b_close, SIGNAL(clicked()), this, SLOT(close()));
+  resize(900, 400);
+
+  m_timer = new QTimer(this);
+  connect(m_timer, SIGNAL(timeout()), this, SLOT(refresh()));
+  m_timer->start(2000);
+  refresh();
+}
+
+void
+query_stats_window::showEvent(QShowEvent* e)
+{
+  query_stats::set_enabled(true);
+  log_window::showEvent(e);
+}
+
+void
+query_stats_window::hideEvent(QHideEvent* e)
+{
+  query_stats::set_enabled(false);
+  log_window::hideEvent(e);
+}
+
+void
+query_stats_window::refresh()
+{
+  if (!isVisible() && m_edit->document()->characterCount()>1)
+    return;
+  m_edit->setPlainText(query_stats::report());
+}
+
+void
+query_stats_window::reset_stats()
+{
+  query_stats::reset();
+  refresh();
+}
+
+void
+query_stats_window::save()
+{
+  QString fname = QFileDialog::getSaveFileName(this, tr("Save statistics"));
+  if (fname.isEmpty())
+    return;
+  QFile f(fname);
+  if (!f.open(QIODevice::WriteOnly|QIODevice::Truncate|QIODevice::Text)) {
+    QMessageBox::critical(this, tr("Error"), tr("Unable to open file '%1' for writing").arg(fname));
+    return;
+  }
+  QTextStream ts(&f);
+  ts << query_stats::report();
+  f.close();
+}
@@ -0,0 +1,109 @@
+/* Copyright (C) 2004-2011 Daniel Verite
+
+   This file is part of Manitou-Mail (see http://www.manitou-mail.org)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#ifndef INC_QUERY_STATS_H
+#define INC_QUERY_STATS_H
+
+#include <QString>
+#include <QMutex>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <libpq-fe.h>
+
+#include "log_window.h"
+
+class QTimer;
+
+/*
+  Execution statistics of SQL statements, aggregated by statement
+  template: the text of the query with its literal values replaced
+  by '?'. Used from any thread.
+
+  Nothing is recorded unless the statistics are enabled, which they
+  are while the statistics window is shown, so that measuring doesn't
+  slow down the queries the rest of the time.
+*/
+class query_stats
+{
+public:
+  // current time in microseconds, to measure durations
+  static qint64 clock_us();
+  static bool enabled() {
+    return m_enabled;
+  }
+  static void set_enabled(bool on);
+  static void record(const char* query, qint64 elapsed_us,
+		     int rows, qint64 bytes);
+  // rows and bytes are taken from 'res'
+  static void record(const char* query, qint64 elapsed_us,
+		     const PGresult* res);
+  // 'key' being already normalized
+  static void record_normalized(const std::string& key, qint64 elapsed_us,
+				int rows, qint64 bytes);
+  static void result_size(const PGresult* res, int* rows, qint64* bytes);
+  static qint64 result_bytes(const PGresult* res);
+  /* named totals kept along with the statements, such as the memory
+     used by the word search. They're listed after the statements */
+  static void add_counter(const char* name, qint64 value);
+  // formatted table, the statements taking the most time first
+  static QString report();
+  static void reset();
+  static std::string normalize(const char* query);
+private:
+  struct entry {
+    entry() : calls(0), total_us(0), max_us(0), rows(0), bytes(0),
+	      next_sample(0) {}
+    int calls;
+    qint64 total_us;
+    qint64 max_us;
+    qint64 rows;
+    qint64 bytes;
+    // latest durations, for the percentiles
+    std::vector<qint64> samples;
+    int next_sample;
+  };
+  static const int max_samples=256;
+  static std::map<std::string,entry> m_entries;
+  static std::map<std::string,qint64> m_counters;
+  static QMutex m_mutex;
+  static volatile bool m_enabled;
+};
+
+/* Live display of query_stats */
+class query_stats_window: public log_window
+{
+  Q_OBJECT
+public:
+  query_stats_window();
+  static query_stats_window* open_unique();
+protected:
+  void showEvent(QShowEvent*);
+  void hideEvent(QHideEvent*);
+private slots:
+  void refresh();
+  void reset_stats();
+  void save();
+private:
+  QTimer* m_timer;
+  static query_stats_window* m_instance;
+};
+
+#endif // INC_QUERY_STATS_H
@@ -0,0 +1,250 @@
+/* Copyright (C) 2004-2011 Daniel Verite
+
+   This file is part of Manitou-Mail (see http://www.manitou-mail.org)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#include "main.h"
+#include "app_config.h"
+#include "db.h"
+#include "db_listener.h"
+#include "result_cache.h"
+
+#include <QMutexLocker>
+#include <iterator>
+
+// static members
+result_cache* result_cache::m_this;
+QMutex result_cache::m_mutex;
+std::map<QString,result_cache::entry> result_cache::m_entries;
+uint result_cache::m_max_entries;
+int result_cache::m_max_age;
+std::deque<std::pair<quint64,mail_id_t> > result_cache::m_changes;
+quint64 result_cache::m_seq;
+quint64 result_cache::m_oldest_seq;
+quint64 result_cache::m_use_counter;
+
+static const uint max_changes=2000;
+
+/*
+  Set up the listeners for the changes made by other clients. A
+  notification may carry the mail_id as its payload, otherwise all
+  the entries are dropped. New messages are signalled through
+  msg_status_cache.
+*/
+// static
+void
+result_cache::init_db()
+{
+  m_this = new result_cache();
+  m_max_entries = get_config().exists("fetch/result_cache_entries") ?
+    get_config().get_number("fetch/result_cache_entries") : 0;
+  m_max_age = get_config().exists("fetch/result_cache_max_age") ?
+    get_config().get_number("fetch/result_cache_max_age") : 60;
+  db_cnx db;
+  db_listener* l1 = new db_listener(db, "mail_status_change");
+  connect(l1, SIGNAL(notified(const QString&)),
+	  m_this, SLOT(db_change_notif(const QString&)));
+  db_listener* l2 = new db_listener(db, "mail_tags_change");
+  connect(l2, SIGNAL(notified(const QString&)),
+	  m_this, SLOT(db_change_notif(const QString&)));
+}
+
+//static
+bool
+result_cache::enabled()
+{
+  QMutexLocker locker(&m_mutex);
+  return m_max_entries>0;
+}
+
+void
+result_cache::db_change_notif(const QString& payload)
+{
+  bool ok;
+  mail_id_t id = payload.toUInt(&ok);
+  if (ok && id!=0)
+    mail_changed(id);
+  else
+    invalidate();
+}
+
+//static
+quint64
+result_cache::sequence()
+{
+  QMutexLocker locker(&m_mutex);
+  return m_seq;
+}
+
+//static
+bool
+result_cache::lookup(const QString& query, std::list<mail_result>& rows,
+		     int* tuples, std::set<mail_id_t>& recheck,
+		     time_t* stored_at)
+{
+  QMutexLocker locker(&m_mutex);
+  std::map<QString,entry>::iterator it = m_entries.find(query);
+  if (it==m_entries.end())
+    return false;
+  entry& e = it->second;
+  if (m_max_age>0 && time(NULL)-e.stored_at >= m_max_age) {
+    // too old to trust that all the changes have been notified
+    m_entries.erase(it);
+    return false;
+  }
+  rows = e.rows;
+  *tuples = e.tuples;
+  *stored_at = e.stored_at;
+  recheck.swap(e.recheck);
+  e.recheck.clear();
+  e.last_use = ++m_use_counter;
+  return true;
+}
+
+//static
+void
+result_cache::put(const QString& query, const std::list<mail_result>& rows,
+		  int tuples, quint64 seq, time_t stored_at)
+{
+  QMutexLocker locker(&m_mutex);
+  if (m_max_entries==0)
+    return;
+  if (seq < m_oldest_seq) {
+    // can't tell what changed while the query was running
+    m_entries.erase(query);
+    return;
+  }
+  entry& e = m_entries[query];
+  e.rows = rows;
+  e.tuples = tuples;
+  e.recheck.clear();
+  std::deque<std::pair<quint64,mail_id_t> >::const_reverse_iterator ic;
+  for (ic=m_changes.rbegin(); ic!=m_changes.rend() && ic->first>seq; ++ic)
+    e.recheck.insert(ic->second);
+  e.last_use = ++m_use_counter;
+  e.stored_at = stored_at ? stored_at : time(NULL);
+
+  if (m_entries.size() > m_max_entries) {
+    // evict the least recently used
+    std::map<QString,entry>::iterator it, lru=m_entries.begin();
+    for (it=m_entries.begin(); it!=m_entries.end(); ++it) {
+      if (it->second.last_use < lru->second.last_use)
+	lru=it;
+    }
+    m_entries.erase(lru);
+  }
+}
+
+//static
+void
+result_cache::mail_changed(mail_id_t id)
+{
+  QMutexLocker locker(&m_mutex);
+  m_changes.push_back(std::make_pair(++m_seq, id));
+  if (m_changes.size() > max_changes) {
+    m_oldest_seq = m_changes.front().first;
+    m_changes.pop_front();
+  }
+  std::map<QString,entry>::iterator it;
+  for (it=m_entries.begin(); it!=m_entries.end(); ++it)
+    it->second.recheck.insert(id);
+}
+
+//static
+void
+result_cache::invalidate()
+{
+  QMutexLocker locker(&m_mutex);
+  DBG_PRINTF(5, "result_cache::invalidate()");
+  m_entries.clear();
+  m_changes.clear();
+  m_oldest_seq = ++m_seq;
+}
+
+namespace {
+  /* The order of the results of msgs_filter::build_query():
+     msg_date,mail_id both ascending or both descending. Null dates
+     come last in ascending order, like in postgres */
+  struct result_order {
+    result_order(int order) : m_order(order) {}
+    bool operator()(const mail_result& a, const mail_result& b) const {
+      int c;
+      if (a.m_date.is_null() != b.m_date.is_null())
+	c = a.m_date.is_null() ? 1 : -1;
+      else if (!a.m_date.is_null() && a.m_date < b.m_date)
+	c = -1;
+      else if (!a.m_date.is_null() && b.m_date < a.m_date)
+	c = 1;
+      else
+	c = (a.m_id < b.m_id) ? -1 : (a.m_id > b.m_id ? 1 : 0);
+      return m_order<0 ? c>0 : c<0;
+    }
+    int m_order;
+  };
+}
+
+//static
+bool
+result_cache::merge(std::list<mail_result>& rows, int* tuples,
+		    const std::set<mail_id_t>& recheck,
+		    std::list<mail_result>& fresh, int max_results, int order)
+{
+  result_order before(order);
+  bool complete = (max_results<=0 || *tuples<=max_results);
+
+  /* when the selection has more results than the rows, the rows
+     coming after the last one belong to the next pages */
+  if (!complete && !rows.empty()) {
+    const mail_result last = rows.back();
+    std::list<mail_result>::iterator it=fresh.begin();
+    while (it!=fresh.end()) {
+      if (before(last, *it))
+	it = fresh.erase(it);
+      else
+	++it;
+    }
+  }
+
+  std::set<mail_id_t> kept;
+  std::list<mail_result>::iterator it;
+  for (it=fresh.begin(); it!=fresh.end(); ++it)
+    kept.insert(it->m_id);
+
+  it=rows.begin();
+  while (it!=rows.end()) {
+    if (recheck.find(it->m_id)!=recheck.end()) {
+      // a message leaving the rows would leave a hole before the next page
+      if (!complete && kept.find(it->m_id)==kept.end())
+	return false;
+      it = rows.erase(it);
+    }
+    else
+      ++it;
+  }
+
+  rows.merge(fresh, before);
+
+  if (max_results>0 && (int)rows.size()>max_results) {
+    it=rows.begin();
+    std::advance(it, max_results);
+    rows.erase(it, rows.end());
+    *tuples = max_results+1;
+  }
+  else if (complete)
+    *tuples = rows.size();
+  return true;
+}
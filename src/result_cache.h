@@ -0,0 +1,121 @@
+/* Copyright (C) 2004-2011 Daniel Verite
+
+   This file is part of Manitou-Mail (see http://www.manitou-mail.org)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#ifndef INC_RESULT_CACHE_H
+#define INC_RESULT_CACHE_H
+
+#include <QObject>
+#include <QString>
+#include <QMutex>
+#include <time.h>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+
+#include "dbtypes.h"
+#include "message.h"
+
+/*
+  Results of the latest selections, keyed by the text of their query,
+  so that going back to a selection doesn't run it again.
+
+  Rather than being dropped when messages change, an entry collects
+  the mail_id of the messages whose status or tags have changed and
+  of the new messages. Before it's used, the query is run again
+  restricted to these messages, and what it returns replaces them in
+  the entry (see merge()).
+
+  The changes made by other clients are known only if the database
+  sends the mail_status_change and mail_tags_change notifications,
+  which needs triggers that the schema doesn't have by default. So
+  the cache is disabled unless fetch/result_cache_entries is set,
+  and its entries expire after fetch/result_cache_max_age seconds.
+
+  Used from the GUI and the fetch threads.
+*/
+class result_cache: public QObject
+{
+  Q_OBJECT
+public:
+  static void init_db();
+  static bool enabled();
+
+  /* To be obtained before running the query whose results are then
+     passed to put(), so that the changes that happen meanwhile are
+     known to the entry */
+  static quint64 sequence();
+
+  /* If 'query' is cached, copy its results to 'rows', the number of
+     rows the query returned to 'tuples', the time they were obtained
+     to 'stored_at', and move the mail_id that need to be checked
+     again to 'recheck' */
+  static bool lookup(const QString& query, std::list<mail_result>& rows,
+		     int* tuples, std::set<mail_id_t>& recheck,
+		     time_t* stored_at);
+
+  /* Store the results of 'query', 'seq' being the value of
+     sequence() when it started. 'stored_at' is the time the query
+     was run, 0 for now, and is kept when patched results are stored
+     again, so that they still expire */
+  static void put(const QString& query, const std::list<mail_result>& rows,
+		  int tuples, quint64 seq, time_t stored_at=0);
+
+  /* Apply to 'rows' the results of the query restricted to the
+     mail_id in 'recheck'. The query is run with LIMIT max_results+1
+     (or no limit if max_results<=0) and 'order' is as in
+     msgs_filter::m_order. Return false if 'rows' can't be patched,
+     when a message leaves a selection that has more results than
+     the rows cached */
+  static bool merge(std::list<mail_result>& rows, int* tuples,
+		    const std::set<mail_id_t>& recheck,
+		    std::list<mail_result>& fresh, int max_results, int order);
+
+  // the status or tags of a message have changed, or it's new
+  static void mail_changed(mail_id_t id);
+  // drop all the entries
+  static void invalidate();
+
+public slots:
+  void db_change_notif(const QString& payload);
+
+private:
+  struct entry {
+    std::list<mail_result> rows;
+    int tuples;
+    std::set<mail_id_t> recheck;
+    quint64 last_use;
+    time_t stored_at;
+  };
+  static result_cache* m_this;
+  static QMutex m_mutex;
+  static std::map<QString,entry> m_entries;
+  static uint m_max_entries;
+  static int m_max_age;		// in seconds, 0 for no expiry
+
+  /* the latest changes, numbered by m_seq, to be added to an entry
+     by put(). Older ones are forgotten, as well as those preceding
+     invalidate() */
+  static std::deque<std::pair<quint64,mail_id_t> > m_changes;
+  static quint64 m_seq;
+  static quint64 m_oldest_seq;	// of the changes still known
+  static quint64 m_use_counter;
+};
+
+#endif // INC_RESULT_CACHE_H
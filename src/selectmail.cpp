@@ -30,6 +30,8 @@
 #include "icons.h"
 #include "sql_editor.h"
 #include "words.h"
+#include "result_cache.h"
+#include "string_pool.h"
 
 #include <QLineEdit>
 #include <QComboBox>
@@ -42,6 +44,7 @@
 #include <QPushButton>
 #include <QToolButton>
 #include <QTimer>
+#include <QRegExp>
 #include <QFontMetrics>
 #include <QRadioButton>
 #include <QDateTimeEdit>
@@ -85,6 +88,9 @@ msgs_filter::init()
   m_date_max=QDate();
   //  m_word=QString::null;
   m_words.clear();
+  m_substrs.clear();
+  m_excluded_words.clear();
+  m_client_wordsearch=false;
   m_in_trash=false;
   m_auto_refresh=false;
   m_min_prio = max_possible_prio+1;
@@ -95,9 +101,11 @@ msgs_filter::init()
   // results
   m_fetched=false;
   m_fetch_results=NULL;
-  m_date_bound=QString::null;
-  m_mail_id_bound=0;
+  m_bound_date=date();
+  m_bound_mail_id=0;
   m_has_more_results = false;
+  m_total_count = -1;
+  m_total_exact = false;
   
 }
 
@@ -121,19 +129,38 @@ msgs_filter::postprocess_fetch(fetch_thread& thread)
 {
   m_has_more_results = m_max_results>0 && (thread.m_tuples_count > m_max_results);
   DBG_PRINTF(6,"postprocess_fetch: m_has_more_results=%d", (int)m_has_more_results);
-  m_boundary = thread.m_boundary;
-  if (m_order>0) {
-    m_mail_id_bound = thread.m_max_mail_id;
-    m_date_bound = thread.m_max_msg_date;
-  }
-  else {
-    m_mail_id_bound = thread.m_min_mail_id;
-    m_date_bound = thread.m_min_msg_date;
-    m_boundary = thread.m_boundary;
+  if (thread.m_last_mail_id!=0) {
+    m_bound_date = thread.m_last_date;
+    m_bound_mail_id = thread.m_last_mail_id;
   }
   m_psearch = thread.m_psearch;
 }
 
+/*
+  Condition for the rows that follow m_bound_date,m_bound_mail_id
+  in the order of the results, 'order' being as m_order. Written as a
+  row comparison so that an index on (msg_date,mail_id) can serve it.
+  Null dates come first in descending order and last in ascending
+  order.
+*/
+QString
+msgs_filter::keyset_clause(int order) const
+{
+  if (m_bound_date.is_null()) {
+    if (order<0)
+      return QString("(msg_date IS NOT NULL OR m.mail_id<%1)").arg(m_bound_mail_id);
+    else
+      return QString("(msg_date IS NULL AND m.mail_id>%1)").arg(m_bound_mail_id);
+  }
+  /* msg_date has microseconds: the bound must keep them, or the
+     rows of the same second would be skipped or fetched twice */
+  QString ts = m_bound_date.sql_timestamp();
+  if (order<0)
+    return QString("(msg_date,m.mail_id)<(%1,%2)").arg(ts).arg(m_bound_mail_id);
+  else
+    return QString("((msg_date,m.mail_id)>(%1,%2) OR msg_date IS NULL)").arg(ts).arg(m_bound_mail_id);
+}
+
 int
 msgs_filter::add_address_selection (sql_query& q,
 				    const QString email_addr,
@@ -157,93 +184,324 @@ msgs_filter::add_address_selection (sql_query& q,
 }
 
 
+/*
+  Read the results of a query built by build_query() into 'l'.
+  The stream must have been set up with set_binary_results().
+  If max_nb==-1, keep all the tuples, otherwise keep at most max_nb tuples
+*/
 //static
 int
-msgs_filter::load_result_list(PGresult* res, std::list<mail_result>* l, int max_nb)
+msgs_filter::load_result_list(sql_stream& s, std::list<mail_result>* l, int max_nb, bool update_cache)
 {
-  if (res && PQresultStatus(res)==PGRES_TUPLES_OK) {
-    DBG_PRINTF(5,"load_result_list %d results max=%d", PQntuples(res), max_nb);
-
-    // if max_nb==-1, keep all the tuples
-    // if max_nb>=0, keep at most max_nb tuples
-    if (max_nb<0)
-      max_nb=PQntuples(res);
-    else if (max_nb > PQntuples(res))
-      max_nb = PQntuples(res);
-
-    for (int i=0; i < max_nb; i++) {
-      mail_result r;
-      r.m_id = atoi(PQgetvalue(res, i , 0));
-      r.m_from = PQgetvalue(res, i, 1);
-      r.m_subject = QString::fromUtf8(PQgetvalue(res, i, 2));
-      r.m_date = PQgetvalue(res, i, 3);
-      r.m_thread_id = atoi(PQgetvalue(res, i , 4));
-      r.m_status = atoi(PQgetvalue(res, i, 5));
+  DBG_PRINTF(5,"load_result_list %d results max=%d", s.row_count(), max_nb);
+  int i=0;
+  while (!s.eos() && (max_nb<0 || i<max_nb)) {
+    mail_result r;
+    s >> r.m_id >> r.m_from >> r.m_subject >> r.m_date >> r.m_thread_id
+      >> r.m_status >> r.m_in_replyto >> r.m_sender_name >> r.m_pri >> r.m_flags
+      >> r.m_recipients;
+    r.share_strings();
+    if (update_cache)
       msg_status_cache::update(r.m_id, r.m_status);
-      r.m_in_replyto = atoi(PQgetvalue(res, i, 6));
-      r.m_sender_name = QString::fromUtf8(PQgetvalue(res, i, 7));
-      r.m_pri = atoi(PQgetvalue(res, i, 8));
-      r.m_flags = (uint)atoi(PQgetvalue(res, i, 9));
-      r.m_recipients = QString::fromUtf8(PQgetvalue(res, i, 10));
-      l->push_back(r);
-    }
-    return max_nb;
+    l->push_back(r);
+    i++;
   }
-  else
-    return 0;
+  string_pool::report_counters();
+  return i;
 }
 
 int
 fetch_thread::store_results(sql_stream& s, int max_nb)
 {
   int i=0;
-  QString date_stamp;
   mail_result r;
+  std::list<mail_result> batch;
+  int batch_count=0;
 
   while (!s.eos() && (max_nb==-1 || i<max_nb)) {
     s >> r.m_id >> r.m_from >> r.m_subject >> r.m_date >> r.m_thread_id
       >> r.m_status >> r.m_in_replyto >> r.m_sender_name >> r.m_pri >> r.m_flags
       >> r.m_recipients;
+    r.share_strings();
     msg_status_cache::update(r.m_id, r.m_status);
-    m_results->push_back(r);
+    if (m_capture)
+      m_capture->push_back(r);
+    if (m_progressive) {
+      batch.push_back(r);
+      if (++batch_count >= m_batch_size) {
+	flush_batch(batch);
+	batch_count=0;
+      }
+    }
+    else
+      m_results->push_back(r);
 
-    date_stamp = r.m_date.isEmpty() ? QString("00000000000000%1").arg(r.m_id) :
-      QString("%1%2").arg(r.m_date).arg(r.m_id);
-    if (m_boundary.isEmpty() || m_boundary < date_stamp)
-      m_boundary = date_stamp;
+    if (++i%m_batch_size == 0)
+      emit progress(i);
+  }
+  if (i>0) {
+    // results come sorted by (msg_date,mail_id): the last one is the bound
+    m_last_date = r.m_date;
+    m_last_mail_id = r.m_id;
+  }
+  if (batch_count>0)
+    flush_batch(batch);
+  return i;
+}
 
-    if (m_min_msg_date.isEmpty() && !r.m_date.isEmpty())
-      m_min_msg_date=r.m_date;
-    else if (r.m_date < m_min_msg_date)
-      m_min_msg_date=r.m_date;
+/*
+  Fetch the IWI partitions starting at parts_idx, m_parallel_parts
+  at a time. The results are merged in the order of the partitions,
+  and once enough of them are merged the queries still running are
+  cancelled. m_nb_fetched_parts is set to the last partition merged,
+  as in the serial fetch.
+*/
+void
+fetch_thread::fetch_parts_parallel(int parts_idx)
+{
+  std::list<part_fetch_thread*> running; // in the order of m_parts
+  int nb_parts = m_psearch.m_parts.size();
+  int last_idx = parts_idx;
+  bool stop=false;
+
+  while (!stop) {
+    while ((int)running.size()<m_parallel_parts && parts_idx<nb_parts) {
+      part_fetch_thread* t = new part_fetch_thread(m_query, parts_idx,
+						   m_psearch.m_parts.at(parts_idx),
+						   m_query_timeout);
+      parts_idx++;
+      running.push_back(t);
+      t->start();
+    }
+    if (running.empty())
+      break;
+    part_fetch_thread* t = running.front();
+    running.pop_front();
+    while (!t->wait(100)) {
+      // fetch_thread::cancel() only knows about our own connection
+      if (m_cancel.cancelled())
+	t->cancel();
+    }
+    last_idx = t->m_part_idx;
+    if (!t->m_errstr.isEmpty() || m_cancel.cancelled()) {
+      m_errstr = t->m_errstr;
+      stop=true;
+    }
+    else {
+      int count = t->m_results.size();
+      merge_results(t->m_results, m_max_results-m_tuples_count);
+      m_tuples_count += count;
+      if (m_tuples_count>=m_max_results)
+	stop=true;
+    }
+    delete t;
+  }
 
-    if (m_max_msg_date.isEmpty() && !r.m_date.isEmpty())
-      m_max_msg_date=r.m_date;
-    else if (r.m_date > m_max_msg_date)
-      m_max_msg_date=r.m_date;
+  // results from the partitions after the last merged are not needed
+  std::list<part_fetch_thread*>::iterator it;
+  for (it=running.begin(); it!=running.end(); ++it)
+    (*it)->cancel();
+  for (it=running.begin(); it!=running.end(); ++it) {
+    (*it)->wait();
+    delete *it;
+  }
+  m_psearch.m_nb_fetched_parts = last_idx;
+}
 
-    if (m_min_mail_id==0)
-      m_min_mail_id=r.m_id;
-    else if (r.m_id < m_min_mail_id)
-      m_min_mail_id=r.m_id;
+/*
+  Evaluate the word search from the vectors of the inverted index,
+  and fetch the messages found with one query. The mail_id are kept
+  from one "fetch more" to the next, the query continuing after the
+  last result with the keyset clause.
+*/
+void
+fetch_thread::fetch_client_wordsearch()
+{
+  try {
+    if (!m_fetch_more) {
+      m_wsearch_ids.clear();
+      m_wsearch.evaluate(*m_cnx, m_wsearch_ids);
+    }
+    QString ids;
+    ids.reserve(m_wsearch_ids.size()*8+2);
+    ids.append('{');
+    for (unsigned int i=0; i<m_wsearch_ids.size(); i++) {
+      if (i>0)
+	ids.append(',');
+      ids.append(QString::number(m_wsearch_ids[i]));
+    }
+    ids.append('}');
+    sql_stream sq(m_query, *m_cnx);
+    sq.set_prepared();
+    sq.set_binary_results();
+    sq.set_row_by_row(m_progressive);
+    sq << ids;
+    store_results(sq, m_max_results>0?m_max_results:-1);
+    m_tuples_count = sq.row_count();
+  }
+  catch(db_excpt& x) {
+    m_errstr = x.errmsg();
+  }
+}
 
-    if (r.m_id > m_max_mail_id)
-      m_max_mail_id=r.m_id;
+/*
+  Keep at most max_nb results from 'l', which are in the order of the
+  query, as if they had been read by store_results()
+*/
+int
+fetch_thread::merge_results(std::list<mail_result>& l, int max_nb)
+{
+  int n=0;
+  std::list<mail_result>::iterator it=l.begin();
+  for (; it!=l.end() && (max_nb==-1 || n<max_nb); ++it) {
+    msg_status_cache::update(it->m_id, it->m_status);
+    m_last_date = it->m_date;
+    m_last_mail_id = it->m_id;
+    n++;
+  }
+  std::list<mail_result> kept;
+  kept.splice(kept.end(), l, l.begin(), it);
+  if (m_progressive)
+    flush_batch(kept);
+  else
+    m_results->splice(m_results->end(), kept);
+  return n;
+}
 
-    i++;
+part_fetch_thread::part_fetch_thread(const QString query, int part_idx,
+				     int part_no, int timeout_ms) :
+  m_part_idx(part_idx), m_query(query), m_part_no(part_no),
+  m_timeout(timeout_ms)
+{
+}
+
+void
+part_fetch_thread::run()
+{
+  DBG_PRINTF(5, "part_fetch_thread::run(), part %d", m_part_no);
+  try {
+    db_cnx cnx(true);
+    cnx.set_cancel_token(&m_cancel);
+    if (m_timeout>0)
+      cnx.set_statement_timeout(m_timeout);
+    sql_stream sq(m_query, cnx);
+    sq.set_binary_results();
+    sq << m_part_no;
+    msgs_filter::load_result_list(sq, &m_results, -1, false);
+  }
+  catch(db_excpt& x) {
+    m_errstr = x.errmsg();
+  }
+}
+
+count_thread::count_thread()
+{
+  m_generation=0;
+  m_timeout=0;
+}
+
+void
+count_thread::count(const QString& query, int timeout_ms)
+{
+  if (isRunning()) {
+    m_cancel.cancel();
+    wait();
+  }
+  m_query = query;
+  m_timeout = timeout_ms;
+  m_generation++;
+  m_cancel.reset();
+  start();
+}
+
+void
+count_thread::run()
+{
+  int generation = m_generation;
+  DBG_PRINTF(5, "count_thread::run()");
+  try {
+    db_cnx cnx(true);
+    cnx.set_cancel_token(&m_cancel);
+    if (m_timeout>0)
+      cnx.set_statement_timeout(m_timeout);
+    {
+      // the first line of the plan has the estimated number of rows
+      sql_stream se(QString("EXPLAIN ") + m_query, cnx, false);
+      se.execute();
+      if (!se.eos()) {
+	QString plan;
+	se >> plan;
+	QRegExp rx("rows=(\\d+)");
+	if (rx.indexIn(plan)>=0)
+	  emit counted(generation, rx.cap(1).toInt(), false);
+      }
+    }
+    sql_stream sc(QString("SELECT count(*) FROM (") + m_query + ") s", cnx, false);
+    sc.execute();
+    if (!sc.eos()) {
+      int n;
+      sc >> n;
+      emit counted(generation, n, true);
+    }
+  }
+  catch(db_excpt& x) {
+    // cancelled or too long: the estimate stays
+    DBG_PRINTF(4, "count aborted: %s", x.errmsg().toLocal8Bit().constData());
   }
-  return i;
+}
+
+/* Make a batch of results available to take_results(). The signal
+   is only needed when the previous batches have been taken */
+void
+fetch_thread::flush_batch(std::list<mail_result>& batch)
+{
+  QMutexLocker lock(&m_batch_mutex);
+  bool was_empty = m_pending.empty();
+  m_pending.splice(m_pending.end(), batch);
+  if (was_empty)
+    emit results_available();
+}
+
+/*
+  Move the results received so far to 'dest' and return their
+  number. To be called from the GUI thread when m_progressive is set.
+*/
+int
+fetch_thread::take_results(std::list<mail_result>& dest)
+{
+  QMutexLocker lock(&m_batch_mutex);
+  int n=m_pending.size();
+  dest.splice(dest.end(), m_pending);
+  return n;
 }
 
 fetch_thread::fetch_thread()
 {
   m_cnx=NULL;
   m_fetch_more=false;
+  m_progressive=false;
+  m_batch_size=200;
+  m_parallel_parts=1;
+  m_query_timeout=0;
+  m_client_wordsearch=false;
+  m_use_cache=false;
+  m_order=1;
+  m_capture=NULL;
+  m_generation=0;
 }
 
-// Launch the query and fetch results fetch. Overrides QThread::run()
+// Overrides QThread::run()
 void
 fetch_thread::run()
+{
+  int generation = m_generation;
+  fetch();
+  emit fetch_done(generation);
+}
+
+// Launch the query and fetch results
+void
+fetch_thread::fetch()
 {
   if (!m_cnx) return;
   DBG_PRINTF(5,"fetch_thread::run(), max_results=%d", m_max_results);
@@ -251,23 +509,34 @@ fetch_thread::run()
   QTime start = QTime::currentTime();
 
   m_tuples_count=0;
-  m_min_mail_id = m_max_mail_id = 0;
-  m_max_msg_date = QString::null;
-  m_min_msg_date = QString::null;
-  m_boundary = QString::null;
-
+  m_last_date = date();
+  m_last_mail_id = 0;
+  m_batch_mutex.lock();
+  m_pending.clear();
+  m_batch_mutex.unlock();
+
+  if (m_client_wordsearch) {
+    fetch_client_wordsearch();
+  }
   // special case repeated executions of the query for piecemeal fetch of
   // IWI results
-  if (!m_psearch.m_parts.isEmpty()) {
+  else if (!m_psearch.m_parts.isEmpty()) {
     /* if it's a "fetch more" kind of search, m_nb_fetched_parts is the index of
        the last IWI part that was joined against at the previous step,
        otherwise it's 0 */
     int parts_idx = m_psearch.m_nb_fetched_parts;
+    if (m_parallel_parts>1 && m_psearch.m_parts.size()-parts_idx>1) {
+      fetch_parts_parallel(parts_idx);
+      m_exec_time = start.elapsed();
+      return;
+    }
     do {
       int part_no = m_psearch.m_parts.at(parts_idx++);
       QString s=m_query;
       try {
 	sql_stream sq(m_query, *m_cnx);
+	sq.set_binary_results();
+	sq.set_row_by_row(m_progressive);
 	sq << part_no;
 	sq.execute();
 	store_results(sq, m_max_results-m_tuples_count);
@@ -280,31 +549,86 @@ fetch_thread::run()
     } while (m_tuples_count<m_max_results && parts_idx<m_psearch.m_parts.size());
     m_psearch.m_nb_fetched_parts = parts_idx-1;
   }
-  else {
+  else if (!m_use_cache || !fetch_cached()) {
     // search not involving the word indexes
+    std::list<mail_result> captured;
+    quint64 seq = result_cache::sequence();
+    if (m_use_cache)
+      m_capture = &captured;
     try {
-      sql_stream sq(m_query, *m_cnx);
+      sql_stream sq(m_query, *m_cnx, false);
+      sq.set_binary_results();
+      sq.set_row_by_row(m_progressive);
       sq.execute();
       store_results(sq, m_max_results>0?m_max_results:-1);
       m_tuples_count = sq.row_count();
+      if (m_use_cache)
+	result_cache::put(m_query, captured, m_tuples_count, seq);
     }
     catch(db_excpt& x) {
       m_errstr = x.errmsg();
     }
+    m_capture=NULL;
   }
   m_exec_time = start.elapsed();
+  string_pool::report_counters();
+}
 
+/*
+  Take the results from result_cache if the query is there, after
+  running it again for the messages that changed since it was cached.
+  Return false if the query has to be run.
+*/
+bool
+fetch_thread::fetch_cached()
+{
+  quint64 seq = result_cache::sequence();
+  std::list<mail_result> rows;
+  int tuples;
+  std::set<mail_id_t> recheck;
+  time_t stored_at;
+  if (!result_cache::lookup(m_query, rows, &tuples, recheck, &stored_at))
+    return false;
+
+  if (!recheck.empty()) {
+    QString ids="{";
+    std::set<mail_id_t>::const_iterator it;
+    for (it=recheck.begin(); it!=recheck.end(); ++it) {
+      if (it!=recheck.begin())
+	ids.append(',');
+      ids.append(QString::number(*it));
+    }
+    ids.append('}');
+    sql_query q = m_cache_query;
+    q.add_clause(QString("m.mail_id=ANY('%1'::int[])").arg(ids));
+    std::list<mail_result> fresh;
+    try {
+      sql_stream s(q.get(), *m_cnx, false);
+      s.set_binary_results();
+      s.execute();
+      msgs_filter::load_result_list(s, &fresh, -1, false);
+    }
+    catch(db_excpt& x) {
+      DBG_PRINTF(3, "recheck of cached results failed: %s", x.errmsg().toLocal8Bit().constData());
+      return false;
+    }
+    if (!result_cache::merge(rows, &tuples, recheck, fresh, m_max_results, m_order))
+      return false;
+    result_cache::put(m_query, rows, tuples, seq, stored_at);
+  }
+  DBG_PRINTF(5, "%d results from the cache, %d rechecked",
+	     (int)rows.size(), (int)recheck.size());
+  merge_results(rows, -1);
+  m_tuples_count = tuples;
+  return true;
 }
 
 // stop the fetch
 void
 fetch_thread::cancel()
 {
-  if (m_cnx) {
-    DBG_PRINTF(5, "fetch_thread::cancel()");
-    PGconn* c = m_cnx->connection();
-    PQrequestCancel(c);
-  }
+  DBG_PRINTF(5, "fetch_thread::cancel()");
+  m_cancel.cancel();
   m_fetch_more=false;
 }
 
@@ -313,6 +637,10 @@ fetch_thread::release()
 {
   DBG_PRINTF(4, "fetch_thread::release()");
   if (m_cnx) {
+    /* the connection goes back to the pool, so the query must be
+       finished. After cancel() it doesn't take long */
+    if (isRunning())
+      wait();
     delete m_cnx;
     m_cnx=NULL;
   }
@@ -321,16 +649,21 @@ fetch_thread::release()
 
 int
 msgs_filter::parse_search_string(QString s, QStringList& words,
-				 QStringList& substrs)
+				 QStringList& substrs, QStringList* excluded)
 {
   int state=10;
   QString curr_word;
   QString curr_substr;
+  bool negated=false;		// curr_word is to be excluded
   uint len=s.length();
   for (uint i=0; i<len; i++) {
     QChar c=s.at(i);
     DBG_PRINTF(5, "p i=%u, char=%c, state=%d", i, c.toLatin1(), state);
-    if (c==QChar('"')) {
+    if (c==QChar('-') && state==10 && excluded && curr_word.isEmpty() &&
+	(i==0 || s.at(i-1).isSpace())) {
+      negated=true;
+    }
+    else if (c==QChar('"')) {
       if (state==10) state=40;
       else if (state==40) {
 	if (!curr_substr.isEmpty())
@@ -351,9 +684,13 @@ msgs_filter::parse_search_string(QString s, QStringList& words,
       // delimiter
       if (state==10 || state==40 || state==50) {
 	if (!curr_word.isEmpty()) {
-	  words.append(curr_word);
+	  if (negated)
+	    excluded->append(curr_word);
+	  else
+	    words.append(curr_word);
 	  curr_word.truncate(0);
 	}
+	negated=false;
       }
       if (state==40 || state==50) {
 	curr_substr.append(c);
@@ -371,7 +708,10 @@ msgs_filter::parse_search_string(QString s, QStringList& words,
     DBG_PRINTF(3, "parse error: state=%d", state);
   }
   if (!curr_word.isEmpty()) {
-    words.append(curr_word);
+    if (negated)
+      excluded->append(curr_word);
+    else
+      words.append(curr_word);
   }
   return 0;
 }
@@ -447,29 +787,15 @@ msgs_filter::build_query(sql_query& q, bool fetch_more/*=false*/)
     }
     q.add_table(main_table);
 
-    // bounds. m_mail_id_bound and m_date_bound should be either both set or both unset
-#if 0
-    if (fetch_more && m_mail_id_bound>0) {
-      if (m_order>0) {
-	q.add_clause(QString("m.mail_id>%1").arg(m_mail_id_bound));
-      }
-      else
-	q.add_clause(QString("m.mail_id<%1").arg(m_mail_id_bound));
-    }
-    if (fetch_more && !m_date_bound.isEmpty()) {
-      if (m_order>0) {
-	// msgs fetched from oldest to newest
-	q.add_clause(QString("msg_date>=to_date('%1','YYYYMMDDHH24MISS')").arg(m_date_bound));
-      }
-      else {
-	q.add_clause(QString("msg_date<=to_date('%1','YYYYMMDDHH24MISS')").arg(m_date_bound));  
-      }
-    }
-#else
-    if (!m_boundary.isEmpty() && !m_date_bound.isEmpty() && m_order<0) {
-      q.add_clause(QString("msg_date<=to_date('%1','YYYYMMDDHH24MISS') AND to_char(msg_date,'YYYYMMDDHH24MISS')||m.mail_id::text<'%2'").arg(m_date_bound).arg(m_boundary));
+    m_client_wordsearch = !m_words.empty() &&
+      get_config().get_bool("search/client_side", true);
+
+    /* continue after the last result of the previous fetch. The
+       server-side word search always sorts in descending order */
+    if (fetch_more && m_bound_mail_id!=0) {
+      bool server_wordsearch = !m_words.empty() && !m_client_wordsearch;
+      q.add_clause(keyset_clause(server_wordsearch ? -1 : m_order));
     }
-#endif
 
     if (!m_sql_stmt.isEmpty()) {
       q.add_clause(QString("m.mail_id in (") + m_sql_stmt + QString(")"));
@@ -532,7 +858,16 @@ msgs_filter::build_query(sql_query& q, bool fetch_more/*=false*/)
       q.add_clause(QString("strpos(b.bodytext,'") + m_body_substring + QString("')>0 and m.mail_id=b.mail_id"));
     }
 
-    if (!m_words.empty()) {
+    if (m_client_wordsearch) {
+      m_wsearch = wordsearch_query();
+      for (int i=0; i<m_words.size(); i++)
+	m_wsearch.add_word(m_words.at(i));
+      for (int i=0; i<m_excluded_words.size(); i++)
+	m_wsearch.add_excluded(m_excluded_words.at(i));
+      m_psearch.m_parts.clear();
+      q.add_clause("m.mail_id=ANY(:ids::int[])");
+    }
+    else if (!m_words.empty()) {
       m_psearch.get_index_parts(m_words);
       if (!m_psearch.m_parts.isEmpty()) {
 	QString words_array = db_word::format_db_string_array(m_words, db);
@@ -541,6 +876,10 @@ msgs_filter::build_query(sql_query& q, bool fetch_more/*=false*/)
       else
 	q.add_clause("m.mail_id=0");
     }
+    /* excluded words without a client-side word search: with the
+       server-side one, or with nothing but excluded words */
+    if (!m_excluded_words.empty() && !m_client_wordsearch)
+      q.add_clause(wordsearch_query::excluded_clause(m_excluded_words, db));
 
     if (!m_substrs.empty()) {
       QStringList::Iterator it = m_substrs.begin();
@@ -597,7 +936,7 @@ msgs_filter::build_query(sql_query& q, bool fetch_more/*=false*/)
       }
     }
 
-    if (m_words.isEmpty()) {
+    if (m_words.isEmpty() || m_client_wordsearch) {
       QString sFinal="ORDER BY msg_date";
       if (m_order<0)
 	sFinal+=" DESC";
@@ -614,16 +953,22 @@ msgs_filter::build_query(sql_query& q, bool fetch_more/*=false*/)
     else {
       // wordsearch has a different limit and sort
       // currently: none
-      QString sFinal="ORDER BY to_char(msg_date,'YYYYMMDDHH24MISS')||m.mail_id::text DESC";
+      QString sFinal="ORDER BY msg_date DESC,m.mail_id DESC";
       q.add_final(sFinal);
     }
 
-    QString select = "SELECT m.mail_id,sender,subject,to_char(msg_date,'YYYYMMDDHH24MISS'),thread_id,m.status,in_reply_to,sender_fullname,priority,flags,recipients";
+    // the results are meant to be fetched in binary format (see load_result_list)
+    QString select = "SELECT m.mail_id,sender,subject,msg_date::timestamp,thread_id,m.status,in_reply_to,sender_fullname,priority,flags,recipients";
     q.start(select);
-    if (m_sql_stmt.isEmpty())
-      m_user_query = q.subquery("m.mail_id");
-    else
-      m_user_query=m_sql_stmt;
+    // the whole selection, not what follows the bound of fetch_more
+    if (!fetch_more) {
+      if (m_sql_stmt.isEmpty())
+	m_user_query = q.subquery("m.mail_id");
+      else
+	m_user_query=m_sql_stmt;
+      m_total_count = -1;
+      m_total_exact = false;
+    }
   }
   catch(db_excpt& p) {
     DBEXCPT(p);
@@ -632,6 +977,17 @@ msgs_filter::build_query(sql_query& q, bool fetch_more/*=false*/)
   return 1;
 }
 
+bool
+msgs_filter::cacheable() const
+{
+  /* user-written SQL may refer to anything, the word index lags behind
+     the messages, and "newer than" moves with the current date */
+  return result_cache::enabled() &&
+    m_sql_stmt.isEmpty() && m_words.isEmpty() && m_excluded_words.isEmpty() &&
+    m_substrs.isEmpty() &&
+    m_body_substring.isEmpty() && m_newer_than==0;
+}
+
 /*
   Return values: same as build_query()
 */
@@ -650,6 +1006,14 @@ msgs_filter::asynchronous_fetch(fetch_thread* t, bool fetch_more/*=false*/)
     t->m_fetch_more = fetch_more;
     t->m_max_results = m_max_results;
     t->m_psearch = m_psearch;
+    t->m_wsearch = m_wsearch;
+    t->m_client_wordsearch = m_client_wordsearch;
+    t->m_use_cache = !fetch_more && cacheable();
+    t->m_cache_query = q;
+    t->m_order = m_order;
+    t->m_batch_size = get_config().get_number("fetch/batch_size");
+    if (t->m_batch_size<=0)
+      t->m_batch_size=200;
     if (!t->m_cnx) {
       t->m_cnx = new db_cnx(true);
       if (!t->m_cnx->ping()) {
@@ -660,8 +1024,35 @@ msgs_filter::asynchronous_fetch(fetch_thread* t, bool fetch_more/*=false*/)
 	  return 0;
 	}
       }
+      t->m_cnx->set_cancel_token(&t->m_cancel);
+      /* a runaway query, typically a user-written one, shouldn't hold
+	 a pooled connection for long. User SQL statements are limited
+	 to 60s by default; the built-in selections have no limit by
+	 default since long ones may be legitimate */
+      int timeout;
+      if (!m_sql_stmt.isEmpty()) {
+	timeout = get_config().exists("db/user_query_timeout") ?
+	  get_config().get_number("db/user_query_timeout") : 60;
+      }
+      else {
+	timeout = get_config().exists("db/query_timeout") ?
+	  get_config().get_number("db/query_timeout") : 0;
+      }
+      t->m_query_timeout = timeout>0 ? timeout*1000 : 0;
+      try {
+	if (t->m_query_timeout>0)
+	  t->m_cnx->set_statement_timeout(t->m_query_timeout);
+      }
+      catch(db_excpt& p) {
+	m_errmsg = p.errmsg();
+	return 0;
+      }
     }
+    t->m_parallel_parts = get_config().exists("fetch/parallel_parts") ?
+      get_config().get_number("fetch/parallel_parts") : 3;
+    t->m_cancel.reset();
     t->m_query = q.get();
+    t->m_generation++;
     m_start_time = QTime::currentTime();
     t->start();
   }
@@ -692,33 +1083,25 @@ msgs_filter::fetch(mail_listview* qlv, bool fetch_more/*=false*/)
     r=build_query(q, fetch_more);
     if (r==1) {
       db_cnx db;
-      QString s=q.get();
-      const char* query = s.toUtf8().constData();
-      DBG_PRINTF(5,"%s", query);
       m_exec_time=0;
       m_start_time = QTime::currentTime();
-#ifdef WITH_PGSQL
-      PGconn* c=GETDB();
-      PGresult* res = PQexec(c, query);
-      if (res && PQresultStatus(res)==PGRES_TUPLES_OK) {
+      try {
+	sql_stream s(q.get(), db, false);
+	s.set_binary_results();
+	s.execute();
 	m_exec_time = m_start_time.elapsed();
 	m_fetch_results = new std::list<mail_result>;
-	if (m_fetch_results) {
-	  load_result_list(res, m_fetch_results, m_max_results-1);
-	  make_list(qlv);
-	  delete m_fetch_results;
-	  m_fetch_results=NULL;
-	}
+	load_result_list(s, m_fetch_results, m_max_results-1);
+	make_list(qlv);
+	delete m_fetch_results;
+	m_fetch_results=NULL;
       }
-      else {
-	DBG_PRINTF(2, "PQexec error");
+      catch(db_excpt& p) {
+	DBG_PRINTF(2, "fetch error");
 	m_exec_time=-1;
-	m_errmsg = PQerrorMessage(c);
+	m_errmsg = p.errmsg();
 	QMessageBox::warning(NULL, APP_NAME, QObject::tr("Unable to execute query.") + QString("\n")+ m_errmsg);
       }
-      if (res)
-	PQclear(res);
-#endif
     }
     else if (r==0) {
       QMessageBox::information(NULL, APP_NAME, QObject::tr("Fetch error"));
@@ -757,10 +1140,34 @@ msgs_filter::add_result(mail_result& r, mail_listview* qlv)
 void
 msgs_filter::make_list(mail_listview* qlv)
 {
-  bool all_outgoing=false;
   if (!m_fetch_results)
     return;       // No result
+  make_msgs(qlv, *m_fetch_results, m_list_msgs);
+  qlv->insert_list(m_list_msgs);
+}
+
+/*
+  Add a batch of results to the list widget while the query is
+  still running (see fetch_thread::take_results)
+*/
+void
+msgs_filter::append_results(mail_listview* qlv, const std::list<mail_result>& results)
+{
+  mlist_t batch;
+  make_msgs(qlv, results, batch);
+  m_list_msgs.insert(m_list_msgs.end(), batch.begin(), batch.end());
+  qlv->insert_list(batch);
+}
 
+/*
+  Instantiate messages from 'results' and append them to 'msgs',
+  skipping those that are already in the list widget
+*/
+void
+msgs_filter::make_msgs(mail_listview* qlv, const std::list<mail_result>& results,
+		       mlist_t& msgs)
+{
+  bool all_outgoing=false;
   bool refetch=false;
   if (!qlv->empty()) {
     /* the list already contains some messages. That means
@@ -770,18 +1177,18 @@ msgs_filter::make_list(mail_listview* qlv)
   }
 
 
-  std::list<mail_result>::const_iterator iter = m_fetch_results->begin();
-  if (iter!=m_fetch_results->end())
+  std::list<mail_result>::const_iterator iter = results.begin();
+  if (iter!=results.end())
     all_outgoing = (iter->m_status & mail_msg::statusOutgoing) == mail_msg::statusOutgoing;
 
-  for (; iter != m_fetch_results->end(); ++iter) {
+  for (; iter != results.end(); ++iter) {
     if (refetch) {
       if (qlv->find(iter->m_id)!=NULL)
 	continue;		// avoid duplicates
     }
 
     mail_msg* msg = new mail_msg(iter->m_id, iter->m_from, iter->m_subject,
-				 date(iter->m_date));
+				 iter->m_date);
     msg->setThread(iter->m_thread_id);
     msg->set_orig_status(iter->m_status);
     msg->setStatus(iter->m_status);
@@ -792,13 +1199,11 @@ msgs_filter::make_list(mail_listview* qlv)
     msg->set_priority(iter->m_pri);
     msg->set_recipients(iter->m_recipients);
 
-    m_list_msgs.push_back(msg);
+    msgs.push_back(msg);
   }
   
   if (all_outgoing && qlv->empty() && get_config().get_bool("display/auto_sender_column"))
     qlv->swap_sender_recipient(true);
-
-  qlv->insert_list(m_list_msgs);
 }
 
 /*
@@ -814,6 +1219,7 @@ msg_select_dialog::msg_select_dialog(bool open_new/*=true*/) : QDialog(0)
   setWindowIcon(UI_ICON(FT_ICON16_NEW_QUERY));
   m_waiting_for_results = false;
   m_new_selection=open_new;
+  connect(&m_thread, SIGNAL(fetch_done(int)), this, SLOT(fetch_finished(int)));
 
   QVBoxLayout* topLayout = new QVBoxLayout(this);
   //  QVBox* box=new QVBox(this,"vbox");
@@ -1196,11 +1602,12 @@ msg_select_dialog::filter_to_dialog(const msgs_filter* filter)
 }
 
 void
-msg_select_dialog::timer_done()
+msg_select_dialog::fetch_finished(int generation)
 {
-  if (m_waiting_for_results && m_thread.isFinished()) {
+  if (m_waiting_for_results && generation==m_thread.m_generation) {
     m_waiting_for_results=false;
-    DBG_PRINTF(5,"msg_select_dialog::timer_done()");
+    DBG_PRINTF(5,"msg_select_dialog::fetch_finished()");
+    m_thread.wait();
     QApplication::restoreOverrideCursor();
 
     m_filter.postprocess_fetch(m_thread);
@@ -1217,9 +1624,6 @@ msg_select_dialog::timer_done()
       close();
     }
     else {
-      m_waiting_for_results = false;
-      m_timer->stop();
-      delete m_timer;
       if (!m_thread.m_errstr.isEmpty()) {
 	QMessageBox::information(this, APP_NAME, m_thread.m_errstr);
       }
@@ -1253,12 +1657,9 @@ msg_select_dialog::ok()
   to_filter(&m_filter);
   int r = m_filter.asynchronous_fetch(&m_thread);
   // at this point, the query is currently being run in m_thread,
-  // and we'll check for its completion in timer_done()
+  // and fetch_finished() will be called at its completion
   if (r==1) {
-    m_timer = new QTimer(this);
-    connect(m_timer, SIGNAL(timeout()), this, SLOT(timer_done()));
     m_waiting_for_results = true;
-    m_timer->start(100);		// check results every 1/10s
 
     //    QIconSet ico_stop(FT_MAKE_ICON(FT_ICON16_STOP));
     m_wCancelButton->setText(tr("Abort"));
@@ -23,6 +23,7 @@
 #include <QDialog>
 #include <QKeyEvent>
 #include <QThread>
+#include <QMutex>
 #include <QStringList>
 #include <QDateTime>
 #include <QTime>
@@ -47,8 +48,63 @@ class QButtonGroup;
 class QComboBox;
 
 
+/*
+  Fetches the results of one partition of the inverted word index
+  on its own pooled connection, for the parallel mode of fetch_thread
+*/
+class part_fetch_thread: public QThread
+{
+public:
+  part_fetch_thread(const QString query, int part_idx, int part_no,
+		    int timeout_ms);
+  virtual void run();
+  void cancel() {
+    m_cancel.cancel();
+  }
+  int m_part_idx;		// index into progressive_wordsearch::m_parts
+  std::list<mail_result> m_results;
+  QString m_errstr;
+private:
+  QString m_query;
+  int m_part_no;
+  int m_timeout;
+  db_cancel_token m_cancel;
+};
+
+/*
+  Counts the messages of a selection on its own pooled connection:
+  first an estimate from the planner, then the exact count unless
+  it's cancelled or exceeds the timeout.
+*/
+class count_thread: public QThread
+{
+  Q_OBJECT
+public:
+  count_thread();
+  virtual void run();
+  // cancel the current count if any, and count the results of 'query'
+  void count(const QString& query, int timeout_ms);
+  void cancel() {
+    m_cancel.cancel();
+  }
+  QString m_query;		// as given by msgs_filter::user_query()
+  int m_generation;		// incremented by each count()
+signals:
+  // 'exact' is false for the estimate
+  void counted(int generation, int count, bool exact);
+private:
+  int m_timeout;
+  db_cancel_token m_cancel;
+};
+
+/*
+  Runs the query of a msgs_filter. The GUI thread is told about the
+  progress and the end of the fetch by the signals, which are queued
+  to it since the object belongs to the GUI thread.
+*/
 class fetch_thread: public QThread
 {
+  Q_OBJECT
 public:
   fetch_thread();
   virtual void run();
@@ -64,15 +120,66 @@ public:
   int m_exec_time;   // query exec time in milliseconds
   int m_tuples_count;
 
-  // boundaries
-  mail_id_t m_max_mail_id;
-  mail_id_t m_min_mail_id;
-  QString m_max_msg_date;
-  QString m_min_msg_date;
-  QString m_boundary;
+  /* sort key of the last result stored, from which the next
+     "fetch more" continues. m_last_mail_id is 0 if no result */
+  date m_last_date;
+  mail_id_t m_last_mail_id;
 
   progressive_wordsearch m_psearch;
   bool m_fetch_more;
+
+  /* when m_client_wordsearch is set, the query selects the mail_id
+     found by m_wsearch, passed as an array to its only parameter */
+  wordsearch_query m_wsearch;
+  bool m_client_wordsearch;
+
+  /* When m_progressive is set, rows are read as they come from the
+     server and handed over in batches of m_batch_size results, to
+     be collected by the GUI thread with take_results() while the
+     query is still running. Otherwise they go to m_results. */
+  bool m_progressive;
+  int m_batch_size;
+  int take_results(std::list<mail_result>& dest);
+
+  /* number of IWI partitions fetched concurrently by a word search,
+     each on a pooled connection. 1 for a serial fetch */
+  int m_parallel_parts;
+  int m_query_timeout;		// in milliseconds, 0 for no limit
+
+  /* cancel() aborts the running query on the server. The token is
+     reset by msgs_filter::asynchronous_fetch() before each run */
+  db_cancel_token m_cancel;
+
+  /* When m_use_cache is set, the results are taken from result_cache
+     if m_query is there, otherwise they're stored into it.
+     m_cache_query is m_query as a sql_query, to recheck the messages
+     that changed since, and m_order the order of the results */
+  bool m_use_cache;
+  sql_query m_cache_query;
+  int m_order;
+
+  /* incremented by msgs_filter::asynchronous_fetch() for each run, to
+     tell the fetch_done() of the current run from the one of a run
+     that was aborted */
+  int m_generation;
+signals:
+  // end of run(), 'generation' being the m_generation of that run
+  void fetch_done(int generation);
+  // a batch of results is ready for take_results()
+  void results_available();
+  // number of results received so far
+  void progress(int count);
+private:
+  void fetch();
+  bool fetch_cached();
+  std::list<mail_result>* m_capture; // copy of the results for the cache
+  void flush_batch(std::list<mail_result>& batch);
+  void fetch_parts_parallel(int parts_idx);
+  void fetch_client_wordsearch();
+  std::vector<mail_id_t> m_wsearch_ids; // kept for "fetch more"
+  int merge_results(std::list<mail_result>& l, int max_nb);
+  QMutex m_batch_mutex;
+  std::list<mail_result> m_pending;
 };
 
 class msgs_filter
@@ -95,6 +202,7 @@ public:
   int fetch(mail_listview*, bool fetch_more=false);
   int asynchronous_fetch (fetch_thread* t, bool fetch_more=false);
   void make_list(mail_listview*);
+  void append_results(mail_listview*, const std::list<mail_result>&);
   void set_auto_refresh(bool s=true) {
     m_auto_refresh=s;
   }
@@ -104,7 +212,27 @@ public:
   bool has_more_results() const {
     return m_has_more_results;
   }
-  int parse_search_string(QString s, QStringList& words, QStringList& substrs);
+  // mail_id of the last result fetched, 0 if none
+  mail_id_t bound_mail_id() const {
+    return m_bound_mail_id;
+  }
+  /* whether count_thread can count the results of user_query(), which
+     must not depend on a word search */
+  bool countable() const {
+    return m_words.isEmpty() && !m_user_query.isEmpty();
+  }
+  /* total number of results given by count_thread, -1 if unknown.
+     m_total_exact is false if it's the planner's estimate */
+  int m_total_count;
+  bool m_total_exact;
+  /* words prefixed with '-' go to 'excluded' if it's not NULL,
+     otherwise they're considered as the others */
+  int parse_search_string(QString s, QStringList& words, QStringList& substrs,
+			  QStringList* excluded=NULL);
+
+  /* whether the results can be kept in result_cache: the selection
+     must not depend on anything else than the messages themselves */
+  bool cacheable() const;
 
   // to do some pre-processing before the fetch
   void preprocess_fetch(fetch_thread&);
@@ -134,6 +262,7 @@ public:
   //  QString m_word;
   QStringList m_words;		// full-text search: words to find
   QStringList m_substrs;	// full-text search: substrings to find
+  QStringList m_excluded_words;	// full-text search: words to exclude
   uint m_thread_id;
 
   int m_status;			// exact value wanted in mail.status
@@ -167,7 +296,9 @@ public:
   std::list<mail_result>* m_fetch_results;
   int build_query (sql_query&, bool fetch_more=false);
   //  mail_msg* in_list(mail_id_t id);
-  static int load_result_list(PGresult* res, std::list<mail_result>* l, int max_nb=-1);
+  /* update_cache is false when called outside of the GUI or the
+     fetch thread, since msg_status_cache isn't thread-safe */
+  static int load_result_list(sql_stream& s, std::list<mail_result>* l, int max_nb=-1, bool update_cache=true);
 
   QTime m_start_time;
   int m_exec_time;
@@ -175,6 +306,11 @@ public:
 
   progressive_wordsearch m_psearch;
 
+  /* word search evaluated on the client, when m_client_wordsearch
+     is set instead of the server-side search by partition */
+  wordsearch_query m_wsearch;
+  bool m_client_wordsearch;
+
 private:
   bool m_auto_refresh;
   int add_address_selection (sql_query& q, const QString email_addr, int addr_type);
@@ -184,6 +320,8 @@ private:
   unsigned int m_addresses_count;
   static const int max_possible_prio;
 
+  void make_msgs(mail_listview*, const std::list<mail_result>&, mlist_t&);
+
   /* escape % and _ for LIKE clauses and add % at the start and end */
   QString quote_like_arg(const QString&);
 
@@ -198,10 +336,12 @@ private:
      ... LIMIT ... */
   QString m_user_query;
 
-  /* used to fetch another set of results that are older/newer (depending on m_order) */
-  QString m_date_bound;
-  int m_mail_id_bound;
-  QString m_boundary;
+  /* keyset of the last result fetched, used to fetch another set of
+     results that are older/newer (depending on m_order). No bound if
+     m_bound_mail_id is 0 */
+  date m_bound_date;
+  mail_id_t m_bound_mail_id;
+  QString keyset_clause(int order) const;
 
   /* ordering of msg_date (+1=ASC, -1=DESC) column for the fetch */
   int m_order;
@@ -274,7 +414,7 @@ public slots:
 private slots:
   void more_status();
   void zoom_on_sql();
-  void timer_done();
+  void fetch_finished(int generation);
   void addr_type_changed(int);
 private:
   QString str_status_mask();
@@ -305,7 +445,6 @@ private:
   void enable_inputs (bool enable);
 
   fetch_thread m_thread;
-  QTimer* m_timer;
   bool m_waiting_for_results;
   bool m_new_selection;
 signals:
@@ -19,6 +19,9 @@
 
 #include <string>
 #include <iostream>
+#include <map>
+
+#include <QMutex>
 
 #include <ctype.h>
 #include <stdlib.h>
@@ -26,6 +29,22 @@
 #include "main.h"
 #include "sqlstream.h"
 #include "db.h"
+#include "date.h"
+#include "query_stats.h"
+
+// network byte order to host, for results in binary format
+static inline quint32
+get_be32(const char* p)
+{
+  const unsigned char* u = (const unsigned char*)p;
+  return ((quint32)u[0]<<24) | ((quint32)u[1]<<16) | ((quint32)u[2]<<8) | u[3];
+}
+
+static inline quint64
+get_be64(const char* p)
+{
+  return ((quint64)get_be32(p)<<32) | get_be32(p+4);
+}
 
 sql_stream::sql_stream(const QString query, db_cnx& db, bool auto_exec) :
   m_db(db), m_auto_exec(auto_exec)
@@ -40,65 +59,56 @@ sql_stream::sql_stream(const char *query, db_cnx& db, bool auto_exec) :
   init(query);
 }
 
+sql_stream::sql_stream(PGresult* res, db_cnx& db) :
+  m_db(db), m_auto_exec(false)
+{
+  init("");
+  m_pgRes=res;
+  m_bExecuted=1;
+  m_rowNumber=0;
+  m_colNumber=0;
+  const char* t = res ? PQcmdTuples(res) : NULL;
+  m_affected_rows = (t && *t) ? atoi(t) : 0;
+}
+
 void
 sql_stream::init(const char *query)
 {
   m_nArgPos = 0;
-  m_queryBuf = m_localQueryBuf;
-  m_queryBufSize = sizeof(m_localQueryBuf)-1;
-  m_queryFmt = query;
-  m_chunk_size = 1024;
   m_bExecuted = 0;
   m_pgRes = NULL;
+  m_prepared = false;
+  m_binary = false;
+  m_row_by_row = false;
+  m_streaming = false;
+  m_rows_streamed = 0;
+  m_bytes_streamed = 0;
+  m_exec_start = 0;
+  m_batch = NULL;
 
-  int len=strlen(query);
-  if (len>m_queryBufSize)
-    query_make_space(len);
-
-  m_queryLen=m_initialQueryLen=len;
-  strcpy(m_queryBuf, query);
-
-  const char* q=query;
-  while (*q) {
-//     if (*q=='\'') {
-//       q++;
-//       while (*q && *q!='\'') q++;
-//     }
-//     else
-    if (*q==':') {
-      q++;
-      const char* start_var=q;
-      while ((*q>='A' && *q<='Z') || (*q>='a' && *q<='z') ||
-	     (*q>='0' && *q<='9') || *q=='_')
-	{
-	  q++;
-	}
-      if (q-start_var>0) {
-	// if the ':' was actually followed by a parameter name
-	sql_bind_param p(std::string(start_var,q-start_var), (start_var-1)-query);
-	m_vars.push_back(p);
-      }
-      else {
-	/* '::' is a special case because we don't want the parser to
-	   find the second colon at the start of the loop. Otherwise
-	   '::int' will be understood as a colon followed by the
-	   parameter ':int'. So in this case, we skip the second colon */
-	if (*q==':')
-	  q++;
-      }
-    }
-    else
-      q++;
-  }
+  m_tmpl = sql_template::get(query, &m_tmpl_owned);
+  m_vars.resize(m_tmpl->params_count());
   if (m_vars.size()==0 && m_auto_exec)
     execute();
 }
 
+/* Templates are shared between threads, hence the lock. This is only
+   called while query_stats are enabled */
+const std::string&
+sql_template::stats_key() const
+{
+  static QMutex key_mutex;
+  QMutexLocker locker(&key_mutex);
+  if (m_stats_key.empty())
+    m_stats_key = query_stats::normalize(m_text.c_str());
+  return m_stats_key;
+}
+
 sql_stream::~sql_stream()
 {
 #if 0
   if (m_nArgPos<(int)m_vars.size()) {
-    QString q(m_queryBuf);
+    QString q(query_text());
     if (q.length()>40) { // cut the query to an reasonable size for debug output
       q.truncate(37);
       q.append("...");
@@ -106,10 +116,19 @@ sql_stream::~sql_stream()
     DBG_PRINTF(2, "WRN: m_nArgPos=%d while m_vars.size()=%d for query '%s'", m_nArgPos, (int)m_vars.size(), q.toLocal8Bit().constData());
   }
 #endif
+  finish_streaming();
   if (m_pgRes)
     PQclear(m_pgRes);
-  if (m_queryBuf!=m_localQueryBuf)
-    free(m_queryBuf);
+  if (m_tmpl_owned)
+    delete m_tmpl;
+}
+
+/* The query text for error messages: with its values once it has
+   been built, otherwise the text with placeholders */
+const char*
+sql_stream::query_text() const
+{
+  return m_query.empty() ? m_tmpl->text().c_str() : m_query.c_str();
 }
 
 void
@@ -117,57 +136,20 @@ sql_stream::reset_results()
 {
   m_bExecuted=false;
   m_nArgPos=0;
+  finish_streaming();
   if (m_pgRes) {
     PQclear(m_pgRes);
     m_pgRes=NULL;
   }
-  strcpy(m_queryBuf, m_queryFmt.c_str());
-  for (unsigned int i=0; i<m_vars.size(); i++) {
-    m_vars[i].resetOffset();
-  }
-  m_queryLen=m_initialQueryLen;
-}
-
-void
-sql_stream::query_make_space(int len)
-{
-  if (m_queryLen+len < m_queryBufSize)
-    return;			// m_queryBuf is big enough
-  if (m_queryBuf==m_localQueryBuf) {
-    char* p=(char*)malloc(1+m_queryBufSize+len+m_chunk_size);
-    if (p) {
-      strcpy (p, m_queryBuf);
-      m_queryBuf = p;
-    }
-  }
-  else {
-    m_queryBuf=(char*)realloc(m_queryBuf, 1+m_queryBufSize+len+m_chunk_size);
-  }
-  if (!m_queryBuf)
-    throw "not enough memory";
-  m_queryBufSize+=len+m_chunk_size;
-  m_chunk_size<<=1;
+  m_query.clear();
 }
 
+/* Store the text of a value. It's put in place of its placeholder
+   when the query is built by execute() */
 void
 sql_stream::replace_placeholder(int argPos, const char* buf, int size)
 {
-  query_make_space(size);
-  sql_bind_param& p=m_vars[argPos];
-  // Replace the placeholder with the value
-  int placeholder_len=p.name().size()+1; // +1 for the leading ':'
-  // shift the substring at the right of the placeholder
-  memmove(m_queryBuf+p.pos()+size,
-	  m_queryBuf+p.pos()+placeholder_len,
-	  m_queryLen-(p.pos()+placeholder_len));
-  // insert the value where the placeholder was
-  memcpy(m_queryBuf+p.pos(), buf, size);
-  m_queryLen+=(size-placeholder_len);
-  m_queryBuf[m_queryLen]='\0';
-  // change the offsets of the remaining placeholders
-  for (unsigned int i=argPos+1; i<m_vars.size(); i++) {
-    m_vars[i].offset(size-placeholder_len);
-  }
+  m_vars[argPos].set_value(buf, size);
 }
 
 void
@@ -177,11 +159,36 @@ sql_stream::next_bind()
     execute();
 }
 
+void
+sql_stream::set_prepared(bool on)
+{
+  if (on && m_batch)
+    throw db_excpt(m_tmpl->text().c_str(), "A batched statement can't be prepared");
+  m_prepared=on;
+}
+
+void
+sql_stream::set_batch(sql_batch* batch)
+{
+  if (batch && m_prepared)
+    throw db_excpt(m_tmpl->text().c_str(), "A prepared statement can't be batched");
+  m_batch=batch;
+}
+
 sql_stream&
 sql_stream::operator<<(const char* p)
 {
   check_binds();
   size_t len=p?strlen(p):0;
+  if (m_prepared) {
+    // no escaping or quoting needed for out-of-line values
+    if (p)
+      m_vars[m_nArgPos].set_value(p, len);
+    else
+      m_vars[m_nArgPos].set_null();
+    next_bind();
+    return *this;
+  }
   char local_buf[1024+1];
   char* buf;
   if (len<(sizeof(local_buf)-1)/2)
@@ -196,8 +203,7 @@ sql_stream::operator<<(const char* p)
      TODO: make all the callers NOT enclose the values, since it's a
      problem for backends that support real bind parameters
      (oracle) */
-  int pos = m_vars[m_nArgPos].pos();
-  if (pos>0 && m_queryBuf[pos-1]!='\'') {
+  if (m_tmpl->param_pos(m_nArgPos)>0 && !m_tmpl->param_quoted(m_nArgPos)) {
     //    DBG_PRINTF(5,"bindpos=%d", pos);
     if (p) {
       char placeholder[2+escaped_size+1];
@@ -329,7 +335,10 @@ sql_stream&
 sql_stream::operator<<(sql_null n _UNUSED_)
 {
   check_binds();
-  replace_placeholder(m_nArgPos, "null", 4);
+  if (m_prepared)
+    m_vars[m_nArgPos].set_null();
+  else
+    replace_placeholder(m_nArgPos, "null", 4);
   next_bind();
   return *this;
 }
@@ -342,18 +351,17 @@ sql_stream::check_binds()
     reset_results();
   }
   if (m_nArgPos>=(int)m_vars.size())
-    throw db_excpt(m_queryBuf, "Mismatch between bound variables and query");
+    throw db_excpt(query_text(), "Mismatch between bound variables and query");
 }
 
 void
 sql_stream::print()
 {
-  std::cout << "buf=" << m_queryBuf << std::endl;
-  std::cout << "len=" << m_queryLen << ", bufsize=" << m_queryBufSize << std::endl;
+  std::cout << "query=" << m_tmpl->text() << std::endl;
   std::cout << "params\n";
-  for (int i=0; i<(int)m_vars.size(); i++) {
-    const sql_bind_param& v=m_vars[i];
-    std::cout << v.name() << " => " << v.pos() << std::endl;
+  for (int i=0; i<m_tmpl->params_count(); i++) {
+    const char* v = i<m_nArgPos ? m_vars[i].value() : "(unbound)";
+    std::cout << m_tmpl->param_name(i) << " => " << (v?v:"null") << std::endl;
   }
 }
 
@@ -372,14 +380,89 @@ sql_stream::execute()
     return;
 
   if (m_nArgPos<(int)m_vars.size())
-    throw db_excpt(m_queryBuf, QString("Not all variables are bound (%1 out of %2)").arg(m_nArgPos).arg(m_vars.size()));
+    throw db_excpt(query_text(), QString("Not all variables are bound (%1 out of %2)").arg(m_nArgPos).arg(m_vars.size()));
+
+  if (!m_prepared && !m_vars.empty())
+    m_tmpl->build(m_query, m_vars);
+  const char* query = query_text();
+
+  db_cancel_token* token = m_db.cancel_token();
+  if (token && token->cancelled())
+    throw db_excpt(query, QObject::tr("Query cancelled"), "57014");
 
-  DBG_PRINTF(5,"execute: %s", m_queryBuf);
-  m_pgRes=PQexec(m_db.connection(), m_queryBuf);
+  if (m_batch) {
+    // deferred: the query text with its interpolated values is queued
+    m_batch->add(query);
+    m_affected_rows=0;
+    m_rowNumber=0;
+    m_colNumber=0;
+    m_bExecuted=1;
+    return;
+  }
+
+  PGconn* c = m_db.connection();
+  const char* stmt=NULL;
+  std::vector<const char*> values;
+  if (m_prepared && !m_vars.empty()) {
+    stmt = prepared_statement();
+    values.resize(m_vars.size());
+    for (unsigned int i=0; i<m_vars.size(); i++) {
+      values[i] = m_vars[i].value();
+    }
+  }
+  /* binary timestamps can be decoded only if they're int64
+     microseconds, otherwise the results come as text */
+  bool binary = m_binary && m_db.cnx()->integer_datetimes();
+  int result_format = binary?1:0;
+  m_exec_start = query_stats::clock_us();
+
+  if (m_row_by_row) {
+    DBG_PRINTF(5,"execute (row by row): %s", query);
+    int sent;
+    if (stmt)
+      sent=PQsendQueryPrepared(c, stmt, values.size(), &values[0], NULL, NULL, result_format);
+    else
+      sent=PQsendQueryParams(c, query, 0, NULL, NULL, NULL, NULL, result_format);
+    if (!sent)
+      throw db_excpt(query, PQerrorMessage(c));
+    m_streaming=true;
+    if (!PQsetSingleRowMode(c)) {
+      finish_streaming();
+      throw db_excpt(query, "Unable to switch to single row mode");
+    }
+    m_rows_streamed=0;
+    m_bytes_streamed=0;
+    m_affected_rows=0;
+    m_colNumber=0;
+    m_bExecuted=1;
+    next_row_result();
+    return;
+  }
+
+  if (stmt) {
+    DBG_PRINTF(5,"execute prepared %s: %s", stmt, query);
+    m_pgRes=PQexecPrepared(c, stmt, values.size(), &values[0], NULL, NULL,
+			   result_format);
+  }
+  else if (binary) {
+    DBG_PRINTF(5,"execute (binary results): %s", query);
+    m_pgRes=PQexecParams(c, query, 0, NULL, NULL, NULL, NULL, 1);
+  }
+  else {
+    DBG_PRINTF(5,"execute: %s", query);
+    m_pgRes=PQexec(c, query);
+  }
   if (!m_pgRes)
-    throw db_excpt(m_queryBuf, PQerrorMessage(m_db.connection()));
+    throw db_excpt(query, PQerrorMessage(c));
+  if (query_stats::enabled()) {
+    int rows;
+    qint64 bytes;
+    query_stats::result_size(m_pgRes, &rows, &bytes);
+    query_stats::record_normalized(m_tmpl->stats_key(),
+				   query_stats::clock_us()-m_exec_start, rows, bytes);
+  }
   if (PQresultStatus(m_pgRes)!=PGRES_TUPLES_OK && PQresultStatus(m_pgRes)!=PGRES_COMMAND_OK) {
-    throw db_excpt(m_queryBuf, PQresultErrorMessage(m_pgRes),
+    throw db_excpt(query, PQresultErrorMessage(m_pgRes),
 		   QString(PQresultErrorField(m_pgRes, PG_DIAG_SQLSTATE)));
   }
   const char* t=PQcmdTuples(m_pgRes);
@@ -394,9 +477,81 @@ sql_stream::execute()
   m_bExecuted=1;
 }
 
+/*
+  Return the name of the server-side statement for our query,
+  preparing it first if this connection doesn't know it yet.
+*/
+const char*
+sql_stream::prepared_statement()
+{
+  pgConnection* cnx = m_db.cnx();
+  const char* stmt = cnx->prepared_statement(m_tmpl->text());
+  if (!stmt) {
+    std::string pg_query;
+    m_tmpl->build_prepared(pg_query);
+    stmt = cnx->prepare_statement(m_tmpl->text(), pg_query.c_str(), m_vars.size());
+  }
+  return stmt;
+}
+
+/*
+  Row-by-row mode: replace the current result with the next row
+  coming from the server. At the end of the results, the final
+  (empty) result is kept and the connection is made available again.
+*/
+void
+sql_stream::next_row_result()
+{
+  if (m_pgRes) {
+    PQclear(m_pgRes);
+    m_pgRes=NULL;
+  }
+  m_rowNumber=0;
+  PGconn* c = m_db.connection();
+  PGresult* res = PQgetResult(c);
+  if (res && PQresultStatus(res)==PGRES_SINGLE_TUPLE) {
+    m_pgRes=res;
+    m_rows_streamed++;
+    if (query_stats::enabled())
+      m_bytes_streamed += query_stats::result_bytes(res);
+    return;
+  }
+  finish_streaming();
+  if (query_stats::enabled()) {
+    query_stats::record_normalized(m_tmpl->stats_key(),
+				   query_stats::clock_us()-m_exec_start,
+				   m_rows_streamed, m_bytes_streamed);
+  }
+  if (!res)
+    throw db_excpt(query_text(), PQerrorMessage(c));
+  if (PQresultStatus(res)!=PGRES_TUPLES_OK && PQresultStatus(res)!=PGRES_COMMAND_OK) {
+    db_excpt e(query_text(), PQresultErrorMessage(res),
+	       QString(PQresultErrorField(res, PG_DIAG_SQLSTATE)));
+    PQclear(res);
+    throw e;
+  }
+  m_pgRes=res;
+  const char* t=PQcmdTuples(m_pgRes);
+  m_affected_rows = (t && *t) ? atoi(t) : 0;
+}
+
+// Discard any result still pending on the connection
+void
+sql_stream::finish_streaming()
+{
+  if (!m_streaming)
+    return;
+  m_streaming=false;
+  PGresult* res;
+  while ((res=PQgetResult(m_db.connection()))!=NULL)
+    PQclear(res);
+}
+
 int
 sql_stream::row_count() const
 {
+  if (m_row_by_row)
+    return m_rows_streamed;
   return (m_pgRes && PQresultStatus(m_pgRes)==PGRES_TUPLES_OK) ? PQntuples(m_pgRes) : 0;
 }
 
@@ -405,6 +560,8 @@ sql_stream::eof()
 {
   if (!m_bExecuted)
     execute();
+  if (m_streaming && m_rowNumber>=PQntuples(m_pgRes))
+    next_row_result();
   return m_rowNumber>=PQntuples(m_pgRes);
 }
 
@@ -420,7 +577,29 @@ void
 sql_stream::check_eof()
 {
   if (eof())
-    throw db_excpt(m_queryBuf, "End of stream reached");
+    throw db_excpt(query_text(), "End of stream reached");
+}
+
+/* Decode the current value as an integer of any size, in either
+   text or binary format */
+qint64
+sql_stream::int_value()
+{
+  const char* p=PQgetvalue(m_pgRes, m_rowNumber, m_colNumber);
+  if (!binary_value())
+    return strtoll(p, NULL, 10);
+  switch(PQgetlength(m_pgRes, m_rowNumber, m_colNumber)) {
+  case 2:
+    return (qint16)((quint16)(((unsigned char)p[0]<<8) | (unsigned char)p[1]));
+  case 4:
+    return (qint32)get_be32(p);
+  case 8:
+    return (qint64)get_be64(p);
+  case 1:
+    return *p;
+  default:
+    throw db_excpt(query_text(), QString("Unexpected binary size for integer value in column %1").arg(m_colNumber+1));
+  }
 }
 
 sql_stream&
@@ -429,7 +608,7 @@ sql_stream::operator>>(int& i)
   check_eof();
   m_val_null = PQgetisnull(m_pgRes, m_rowNumber, m_colNumber);
   if (!m_val_null)
-    i=atoi(PQgetvalue(m_pgRes, m_rowNumber, m_colNumber));
+    i=(int)int_value();
   else
     i=0;
   next_result();
@@ -440,17 +619,43 @@ sql_stream&
 sql_stream::operator>>(unsigned int& i)
 {
   check_eof();
-  unsigned long ul=strtoul(PQgetvalue(m_pgRes, m_rowNumber, m_colNumber),
-			   NULL, 10);
   m_val_null = PQgetisnull(m_pgRes, m_rowNumber, m_colNumber);
   if (!m_val_null)
-    i=(unsigned int)ul;
+    i=(unsigned int)int_value();
   else
     i=0;
   next_result();
   return *this;
 }
 
+sql_stream&
+sql_stream::operator>>(qint64& i)
+{
+  check_eof();
+  m_val_null = PQgetisnull(m_pgRes, m_rowNumber, m_colNumber);
+  if (!m_val_null)
+    i=int_value();
+  else
+    i=0;
+  next_result();
+  return *this;
+}
+
+sql_stream&
+sql_stream::operator>>(bool& b)
+{
+  check_eof();
+  m_val_null = PQgetisnull(m_pgRes, m_rowNumber, m_colNumber);
+  if (!m_val_null) {
+    const char* p=PQgetvalue(m_pgRes, m_rowNumber, m_colNumber);
+    b = binary_value() ? (*p!=0) : (*p=='t');
+  }
+  else
+    b=false;
+  next_result();
+  return *this;
+}
+
 sql_stream&
 sql_stream::operator>>(char& c)
 {
@@ -478,15 +683,78 @@ sql_stream::operator>>(char* p)
   return *this;
 }
 
+/* text types have the same representation in text and binary
+   formats, so there's nothing special to do for binary results */
 sql_stream&
 sql_stream::operator>>(QString& s)
 {
   check_eof();
+  const char* p=PQgetvalue(m_pgRes, m_rowNumber, m_colNumber);
   if (m_db.datab()->encoding() == "UTF8")
-    s=QString::fromUtf8(PQgetvalue(m_pgRes, m_rowNumber, m_colNumber));
+    s=QString::fromUtf8(p, PQgetlength(m_pgRes, m_rowNumber, m_colNumber));
   else
-    s=PQgetvalue(m_pgRes, m_rowNumber, m_colNumber);
+    s=p;
+  m_val_null = PQgetisnull(m_pgRes, m_rowNumber, m_colNumber);
+  next_result();
+  return *this;
+}
+
+sql_stream&
+sql_stream::operator>>(QByteArray& a)
+{
+  check_eof();
+  m_val_null = PQgetisnull(m_pgRes, m_rowNumber, m_colNumber);
+  if (m_val_null)
+    a.clear();
+  else {
+    const char* p=PQgetvalue(m_pgRes, m_rowNumber, m_colNumber);
+    if (binary_value())
+      a = QByteArray(p, PQgetlength(m_pgRes, m_rowNumber, m_colNumber));
+    else {
+      size_t len;
+      unsigned char* u = PQunescapeBytea((const unsigned char*)p, &len);
+      if (!u)
+	throw db_excpt(query_text(), "not enough memory");
+      a = QByteArray((const char*)u, len);
+      PQfreemem(u);
+    }
+  }
+  next_result();
+  return *this;
+}
+
+sql_stream&
+sql_stream::operator>>(date& d)
+{
+  check_eof();
   m_val_null = PQgetisnull(m_pgRes, m_rowNumber, m_colNumber);
+  if (m_val_null)
+    d = date();
+  else if (binary_value()) {
+    if (PQgetlength(m_pgRes, m_rowNumber, m_colNumber)!=8)
+      throw db_excpt(query_text(), QString("Unexpected binary size for timestamp value in column %1").arg(m_colNumber+1));
+    d = date::from_pg_timestamp((qint64)get_be64(PQgetvalue(m_pgRes, m_rowNumber, m_colNumber)));
+  }
+  else {
+    /* keep the digits of 'YYYY-MM-DD HH:MI:SS[.ffffff]' or
+       'YYYYMMDDHH24MISS' */
+    const char* p=PQgetvalue(m_pgRes, m_rowNumber, m_colNumber);
+    char digits[15];
+    int n=0;
+    for (; *p && n<14; p++) {
+      if (*p>='0' && *p<='9')
+	digits[n++]=*p;
+    }
+    d = date(QString::fromLatin1(digits, n));
+    if (n==14 && *p=='.') {
+      int usec=0, scale=100000;
+      for (p++; *p>='0' && *p<='9'; p++) {
+	usec += (*p-'0')*scale;
+	scale /= 10;
+      }
+      d.set_usec(usec);
+    }
+  }
   next_result();
   return *this;
 }
@@ -495,9 +763,342 @@ sql_stream&
 sql_stream::operator>>(float& f)
 {
   check_eof();
-  char* endptr;
-  f = strtof(PQgetvalue(m_pgRes, m_rowNumber, m_colNumber), &endptr);
   m_val_null = PQgetisnull(m_pgRes, m_rowNumber, m_colNumber);
+  const char* p=PQgetvalue(m_pgRes, m_rowNumber, m_colNumber);
+  if (m_val_null)
+    f=0;
+  else if (binary_value()) {
+    if (PQgetlength(m_pgRes, m_rowNumber, m_colNumber)==4) {
+      quint32 u=get_be32(p);
+      memcpy(&f, &u, sizeof(f));
+    }
+    else {
+      quint64 u=get_be64(p);
+      double d;
+      memcpy(&d, &u, sizeof(d));
+      f=(float)d;
+    }
+  }
+  else {
+    char* endptr;
+    f = strtof(p, &endptr);
+  }
   next_result();
   return *this;
 }
+
+sql_copy_in::sql_copy_in(const QString target, db_cnx& db) :
+  m_db(db), m_nb_fields(0), m_rows(0), m_finished(false)
+{
+  m_query = QString("COPY %1 FROM STDIN").arg(target);
+  DBG_PRINTF(5,"execute: %s", m_query.toLocal8Bit().constData());
+  PGresult* res = PQexec(m_db.connection(), m_query.toUtf8().constData());
+  if (!res)
+    throw db_excpt(m_query, PQerrorMessage(m_db.connection()));
+  if (PQresultStatus(res)!=PGRES_COPY_IN) {
+    db_excpt e(m_query, PQresultErrorMessage(res),
+	       QString(PQresultErrorField(res, PG_DIAG_SQLSTATE)));
+    PQclear(res);
+    m_finished=true;
+    throw e;
+  }
+  PQclear(res);
+  m_buf.reserve(flush_size+1024);
+}
+
+sql_copy_in::~sql_copy_in()
+{
+  if (!m_finished) {
+    // abort the COPY, ignoring the errors since we can't throw from here
+    PGconn* c = m_db.connection();
+    PQputCopyEnd(c, "COPY aborted by the client");
+    PGresult* res;
+    while ((res=PQgetResult(c))!=NULL)
+      PQclear(res);
+  }
+}
+
+/*
+  Append a value to the current row, escaped for the text format
+  of COPY. A null pointer means a null value.
+*/
+void
+sql_copy_in::add_field(const char* value, int len)
+{
+  if (m_nb_fields++ > 0)
+    m_buf += '\t';
+  if (!value) {
+    m_buf.append("\\N");
+    return;
+  }
+  const char* end=value+len;
+  const char* start=value;
+  for (const char* p=value; p<end; p++) {
+    char esc;
+    switch(*p) {
+    case '\\': esc='\\'; break;
+    case '\t': esc='t'; break;
+    case '\n': esc='n'; break;
+    case '\r': esc='r'; break;
+    default: continue;
+    }
+    m_buf.append(start, p-start);
+    m_buf += '\\';
+    m_buf += esc;
+    start=p+1;
+  }
+  m_buf.append(start, end-start);
+}
+
+sql_copy_in&
+sql_copy_in::operator<<(const char* p)
+{
+  add_field(p, p?strlen(p):0);
+  return *this;
+}
+
+sql_copy_in&
+sql_copy_in::operator<<(const QString& s)
+{
+  if (s.isNull()) {
+    add_field(NULL, 0);
+    return *this;
+  }
+  QByteArray q;
+  if (m_db.datab()->encoding() == "UTF8")
+    q=s.toUtf8();
+  else
+    q=s.toLocal8Bit();
+  add_field(q.constData(), q.size());
+  return *this;
+}
+
+sql_copy_in&
+sql_copy_in::operator<<(int i)
+{
+  char buf[15];
+  int len=sprintf(buf, "%d", i);
+  add_field(buf, len);
+  return *this;
+}
+
+sql_copy_in&
+sql_copy_in::operator<<(unsigned int i)
+{
+  char buf[15];
+  int len=sprintf(buf, "%u", i);
+  add_field(buf, len);
+  return *this;
+}
+
+sql_copy_in&
+sql_copy_in::operator<<(sql_null n _UNUSED_)
+{
+  add_field(NULL, 0);
+  return *this;
+}
+
+void
+sql_copy_in::end_row()
+{
+  m_buf += '\n';
+  m_nb_fields=0;
+  m_rows++;
+  if ((int)m_buf.size() >= flush_size)
+    flush();
+}
+
+void
+sql_copy_in::flush()
+{
+  if (m_buf.empty())
+    return;
+  if (PQputCopyData(m_db.connection(), m_buf.data(), m_buf.size())!=1)
+    throw db_excpt(m_query, PQerrorMessage(m_db.connection()));
+  m_buf.clear();
+}
+
+void
+sql_copy_in::finish()
+{
+  if (m_finished)
+    return;
+  if (m_nb_fields>0)
+    end_row();
+  flush();
+  m_finished=true;
+  PGconn* c = m_db.connection();
+  if (PQputCopyEnd(c, NULL)!=1)
+    throw db_excpt(m_query, PQerrorMessage(c));
+  PGresult* res;
+  QString errmsg, errcode;
+  while ((res=PQgetResult(c))!=NULL) {
+    if (PQresultStatus(res)!=PGRES_COMMAND_OK && errmsg.isEmpty()) {
+      errmsg = PQresultErrorMessage(res);
+      errcode = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+    }
+    PQclear(res);
+  }
+  if (!errmsg.isEmpty())
+    throw db_excpt(m_query, errmsg, errcode);
+  DBG_PRINTF(5, "COPY done: %d rows", m_rows);
+}
+
+sql_batch::sql_batch(db_cnx& db) : m_db(db)
+{
+}
+
+void
+sql_batch::add(const char* query)
+{
+  m_queries.push_back(std::string(query));
+}
+
+void
+sql_batch::add(const QString query)
+{
+  if (m_db.datab()->encoding() == "UTF8")
+    m_queries.push_back(std::string(query.toUtf8().constData()));
+  else
+    m_queries.push_back(std::string(query.toLocal8Bit().constData()));
+}
+
+void
+sql_batch::execute()
+{
+  if (m_queries.empty())
+    return;
+  DBG_PRINTF(5, "execute batch of %d statements", (int)m_queries.size());
+  qint64 start=query_stats::clock_us();
+  // the batch is accounted as a whole, under its first statement
+  std::string stats_key;
+  if (query_stats::enabled())
+    stats_key = "BATCH " + m_queries[0];
+  try {
+#ifdef LIBPQ_HAS_PIPELINING
+    execute_pipeline();
+#else
+    execute_multi();
+#endif
+  }
+  catch(db_excpt& p) {
+    m_queries.clear();
+    throw p;
+  }
+  if (!stats_key.empty()) {
+    query_stats::record(stats_key.c_str(), query_stats::clock_us()-start,
+			m_queries.size(), 0);
+  }
+  m_queries.clear();
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+/*
+  Send all the statements followed by a single sync point, then read
+  the results. libpq returns a NULL result after the results of each
+  statement, which is how they're matched with their statement. After
+  an error the server skips the rest of the statements up to the sync
+  point, and they're reported as PGRES_PIPELINE_ABORTED.
+*/
+void
+sql_batch::execute_pipeline()
+{
+  PGconn* c = m_db.connection();
+  if (!PQenterPipelineMode(c)) {
+    // not idle or not supported by the server: send it the old way
+    execute_multi();
+    return;
+  }
+  int sent=0;
+  for (unsigned int i=0; i<m_queries.size(); i++) {
+    DBG_PRINTF(5,"queue: %s", m_queries[i].c_str());
+    if (!PQsendQueryParams(c, m_queries[i].c_str(), 0, NULL, NULL, NULL, NULL, 0))
+      break;
+    sent++;
+  }
+  QString send_error;
+  if (sent<(int)m_queries.size())
+    send_error = PQerrorMessage(c);
+  bool sync_sent = PQpipelineSync(c);
+  if (!sync_sent && send_error.isEmpty())
+    send_error = PQerrorMessage(c);
+
+  int idx=0;
+  int err_idx=-1;
+  QString errmsg, errcode;
+  bool synced=false;
+  while (!synced) {
+    PGresult* res=PQgetResult(c);
+    if (!res) {
+      idx++;			// end of the results for one statement
+      if (idx>sent && (!sync_sent || PQstatus(c)!=CONNECTION_OK))
+	break;			// the sync result will never come
+      continue;
+    }
+    switch(PQresultStatus(res)) {
+    case PGRES_PIPELINE_SYNC:
+      synced=true;
+      break;
+    case PGRES_COMMAND_OK:
+    case PGRES_TUPLES_OK:
+    case PGRES_PIPELINE_ABORTED:
+      break;
+    default:
+      if (err_idx<0) {
+	err_idx=idx;
+	errmsg = PQresultErrorMessage(res);
+	errcode = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+      }
+      break;
+    }
+    PQclear(res);
+  }
+  PQexitPipelineMode(c);
+
+  if (err_idx>=0 && err_idx<(int)m_queries.size())
+    throw db_excpt(m_queries[err_idx].c_str(), errmsg, errcode);
+  if (!send_error.isEmpty()) {
+    int i = (sent<(int)m_queries.size()) ? sent : m_queries.size()-1;
+    throw db_excpt(m_queries[i].c_str(), send_error);
+  }
+}
+#endif
+
+/*
+  Send all the statements as one multi-statement query. Each statement
+  produces its own result, so the first failed result tells which
+  statement failed. The server runs them in an implicit transaction
+  unless a transaction is already open.
+*/
+void
+sql_batch::execute_multi()
+{
+  PGconn* c = m_db.connection();
+  std::string q;
+  for (unsigned int i=0; i<m_queries.size(); i++) {
+    q.append(m_queries[i]);
+    q.append(";\n");
+  }
+  DBG_PRINTF(5,"execute: %s", q.c_str());
+  if (!PQsendQuery(c, q.c_str()))
+    throw db_excpt(m_queries[0].c_str(), PQerrorMessage(c));
+  PGresult* res;
+  int idx=0;
+  int err_idx=-1;
+  QString errmsg, errcode;
+  while ((res=PQgetResult(c))!=NULL) {
+    ExecStatusType st=PQresultStatus(res);
+    if (st!=PGRES_COMMAND_OK && st!=PGRES_TUPLES_OK && err_idx<0) {
+      err_idx=idx;
+      errmsg = PQresultErrorMessage(res);
+      errcode = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+    }
+    PQclear(res);
+    idx++;
+  }
+  if (err_idx>=0) {
+    if (err_idx>=(int)m_queries.size())
+      err_idx=m_queries.size()-1;
+    throw db_excpt(m_queries[err_idx].c_str(), errmsg, errcode);
+  }
+}
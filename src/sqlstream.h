@@ -21,35 +21,16 @@
 #define INC_SQLSTREAM_H
 
 #include <vector>
+#include <string>
 
 #include "database.h"
 #include "sqlquery.h"
+#include "sqltemplate.h"
 #include <QString>
+#include <QByteArray>
 
-/// sql_bind_param class. To be used for sql_stream internal purposes
-class sql_bind_param
-{
-public:
-  sql_bind_param() {}
-  sql_bind_param(const std::string s, int pos) {
-    m_name=s;
-    m_initialOffsetInQuery=m_offsetInQuery=pos;
-  }
-  virtual ~sql_bind_param() {}
-  void offset(int off) {
-    m_offsetInQuery+=off;
-  }
-  void resetOffset() {
-    m_offsetInQuery=m_initialOffsetInQuery;
-  }
-  const std::string name() const { return m_name; }
-  int pos() const { return m_offsetInQuery; }
-private:
-  std::string m_name;
-  std::string m_value;
-  int m_offsetInQuery;		/* position of the ':' character in query */
-  int m_initialOffsetInQuery;
-};
+class date;
+class sql_batch;
 
 /**
    sql_stream class. Allows the parametrized execution of a query
@@ -61,6 +42,10 @@ public:
   /// constructor
   sql_stream(const char* query, db_cnx& db, bool auto_exec=true);
   sql_stream(const QString query, db_cnx& db, bool auto_exec=true);
+  /** read the results of a query that has been executed by other
+      means, typically db_async_reply::take_result(). The stream
+      takes ownership of 'res' */
+  sql_stream(PGresult* res, db_cnx& db);
   /// destructor
   virtual ~sql_stream();
   /// assign a char* parameter
@@ -82,12 +67,49 @@ public:
   sql_stream& operator>>(char&);
   sql_stream& operator>>(float&);
   sql_stream& operator>>(QString&);
+  sql_stream& operator>>(qint64&);
+  sql_stream& operator>>(bool&);
+  sql_stream& operator>>(QByteArray&); // bytea
+  sql_stream& operator>>(date&); // timestamp
 
   void print();
 
   /** send the query to the server */
   void execute();
 
+  /** use a server-side prepared statement, cached per connection,
+      with the bound values sent as parameters instead of being
+      interpolated into the query. Must be called before binding.
+      Incompatible with set_batch() */
+  void set_prepared(bool on=true);
+
+  /** ask for results in binary format. Results are then decoded
+      according to their size and type instead of being parsed, so
+      the extracted variables must match the column types. Timestamps
+      must be of type timestamp without time zone. With a server built
+      without integer_datetimes, the results come as text instead.
+      Must be called before execution */
+  void set_binary_results(bool on=true) {
+    m_binary=on;
+  }
+
+  /** retrieve the results one row at a time as they are produced by
+      the server (libpq single-row mode) instead of waiting for the
+      entire result set. No other query may be run on the connection
+      until eof() is reached or the stream is destroyed, and
+      row_count() is the number of rows received so far. Must be
+      called before execution */
+  void set_row_by_row(bool on=true) {
+    m_row_by_row=on;
+  }
+
+  /** instead of being sent to the server, the query is queued into
+      'batch' once all its variables are bound. The stream can then be
+      rebound for another instance of the query, but it has no
+      results. Must be called before binding. Incompatible with
+      set_prepared(), since the batch needs the values interpolated */
+  void set_batch(sql_batch* batch);
+
   /** returns true if there are no more results to read from the stream,
       or false otherwise */
   int eof();
@@ -105,19 +127,22 @@ private:
   void reset_results();
   void next_result();
   void check_eof();
-  void query_make_space(int len);
   void replace_placeholder(int argPos, const char* buf, int size);
   void next_bind();
+  const char* query_text() const;
+  const char* prepared_statement();
+  void next_row_result();
+  void finish_streaming();
+  bool binary_value() const {
+    return PQfformat(m_pgRes, m_colNumber)==1;
+  }
+  qint64 int_value();
 
   db_cnx& m_db;
   int m_nArgPos;
-  char* m_queryBuf;
-  int m_queryBufSize;
-  int m_queryLen;
-  int m_initialQueryLen;
-  char m_localQueryBuf[1024+1];
-  std::string m_queryFmt;
-  int m_chunk_size;
+  const sql_template* m_tmpl;
+  bool m_tmpl_owned;
+  std::string m_query;		/* text built for the last execution */
   std::vector<sql_bind_param> m_vars;
   // results
   int m_bExecuted;
@@ -127,6 +152,76 @@ private:
   bool m_val_null;
   int m_affected_rows;
   bool m_auto_exec;
+  bool m_prepared;
+  bool m_binary;
+  bool m_row_by_row;
+  bool m_streaming; // row-by-row results pending on the connection
+  int m_rows_streamed;
+  qint64 m_bytes_streamed;
+  qint64 m_exec_start;		// for query_stats, in microseconds
+  sql_batch* m_batch;
+};
+
+/**
+   sql_batch class. Queues independent statements that return no
+   results and sends them together, with libpq's pipeline mode when
+   available or else as a multi-statement query. The statements are
+   executed in order and stop at the first error, which is reported
+   with the text of the failing statement.
+*/
+class sql_batch
+{
+public:
+  sql_batch(db_cnx& db);
+  virtual ~sql_batch() {}
+  void add(const char* query);
+  void add(const QString query);
+  /// send the queued statements and empty the queue
+  void execute();
+  int size() const {
+    return (int)m_queries.size();
+  }
+private:
+  void execute_pipeline();
+  void execute_multi();
+  db_cnx& m_db;
+  std::vector<std::string> m_queries;
+};
+
+/**
+   sql_copy_in class. Bulk insertion of rows with COPY FROM STDIN in
+   text format. The values of each row are passed in column order with
+   operator<<, and end_row() terminates the row. The data is sent to
+   the server in chunks, and finish() ends the COPY and checks its result.
+   If finish() isn't called, the COPY is aborted by the destructor.
+*/
+class sql_copy_in
+{
+public:
+  /// 'target' is the table name, optionally followed by a list of columns
+  sql_copy_in(const QString target, db_cnx& db);
+  virtual ~sql_copy_in();
+  sql_copy_in& operator<<(const char*);
+  sql_copy_in& operator<<(const QString&);
+  sql_copy_in& operator<<(int);
+  sql_copy_in& operator<<(unsigned int);
+  sql_copy_in& operator<<(sql_null);
+  void end_row();
+  void finish();
+  /// number of rows passed so far
+  int rows() const {
+    return m_rows;
+  }
+private:
+  void add_field(const char* value, int len);
+  void flush();
+  db_cnx& m_db;
+  QString m_query;
+  std::string m_buf;
+  int m_nb_fields;		// number of fields in the current row
+  int m_rows;
+  bool m_finished;
+  static const int flush_size=64*1024;
 };
 
 #endif // INC_SQLSTREAM_H
@@ -0,0 +1,142 @@
+/* Copyright (C) 2004-2011 Daniel Verite
+
+   This file is part of Manitou-Mail (see http://www.manitou-mail.org)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#include "sqltemplate.h"
+
+#include <map>
+#include <stdio.h>
+#include <string.h>
+
+#include <QMutex>
+
+sql_template::sql_template(const char* query) : m_text(query)
+{
+  const char* q=query;
+  while (*q) {
+//     if (*q=='\'') {
+//       q++;
+//       while (*q && *q!='\'') q++;
+//     }
+//     else
+    if (*q==':') {
+      q++;
+      const char* start_var=q;
+      while ((*q>='A' && *q<='Z') || (*q>='a' && *q<='z') ||
+	     (*q>='0' && *q<='9') || *q=='_')
+	{
+	  q++;
+	}
+      if (q-start_var>0) {
+	// if the ':' was actually followed by a parameter name
+	param p;
+	p.name.assign(start_var, q-start_var);
+	p.pos = (start_var-1)-query;
+	p.end = q-query;
+	m_params.push_back(p);
+      }
+      else {
+	/* '::' is a special case because we don't want the parser to
+	   find the second colon at the start of the loop. Otherwise
+	   '::int' will be understood as a colon followed by the
+	   parameter ':int'. So in this case, we skip the second colon */
+	if (*q==':')
+	  q++;
+      }
+    }
+    else
+      q++;
+  }
+}
+
+const sql_template*
+sql_template::get(const char* query, bool* owned)
+{
+  static QMutex cache_mutex;
+  static std::map<std::string,const sql_template*> cache;
+
+  /* Long queries are usually built with literal lists of values
+     (see mail_id_to_select_in) and are unlikely to be seen twice */
+  size_t len=strlen(query);
+  if (len<=(size_t)max_cached_length) {
+    QMutexLocker locker(&cache_mutex);
+    std::map<std::string,const sql_template*>::const_iterator it = cache.find(query);
+    if (it!=cache.end()) {
+      *owned=false;
+      return it->second;
+    }
+    if (cache.size() < (size_t)max_cached_templates) {
+      const sql_template* t = new sql_template(query);
+      cache[t->text()]=t;
+      *owned=false;
+      return t;
+    }
+  }
+  *owned=true;
+  return new sql_template(query);
+}
+
+void
+sql_template::build(std::string& out, const std::vector<sql_bind_param>& vars) const
+{
+  size_t len=m_text.size();
+  for (unsigned int i=0; i<m_params.size(); i++) {
+    len += vars[i].value() ? vars[i].size() : 4;
+  }
+  out.clear();
+  out.reserve(len);
+  int start=0;
+  for (unsigned int i=0; i<m_params.size(); i++) {
+    out.append(m_text, start, m_params[i].pos-start);
+    const char* v = vars[i].value();
+    if (v)
+      out.append(v, vars[i].size());
+    else
+      out.append("null", 4);
+    start=m_params[i].end;
+  }
+  out.append(m_text, start, std::string::npos);
+}
+
+/*
+  Build the query text in the form expected by PQprepare: each
+  :placeholder becomes $N. A placeholder enclosed in quotes (':p1')
+  loses its quotes since the value is no longer interpolated.
+*/
+void
+sql_template::build_prepared(std::string& out) const
+{
+  const char* fmt = m_text.c_str();
+  int start=0;
+  out.reserve(m_text.size()+16);
+  for (unsigned int i=0; i<m_params.size(); i++) {
+    int pos = m_params[i].pos;
+    int end = m_params[i].end;
+    int lit_end = pos;
+    if (pos>0 && fmt[pos-1]=='\'' && fmt[end]=='\'') {
+      lit_end--;
+      end++;
+    }
+    out.append(fmt+start, lit_end-start);
+    char num[15];
+    sprintf(num, "$%u", i+1);
+    out.append(num);
+    start=end;
+  }
+  out.append(fmt+start);
+}
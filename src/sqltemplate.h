@@ -0,0 +1,111 @@
+/* Copyright (C) 2004-2011 Daniel Verite
+
+   This file is part of Manitou-Mail (see http://www.manitou-mail.org)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#ifndef INC_SQLTEMPLATE_H
+#define INC_SQLTEMPLATE_H
+
+#include <vector>
+#include <string>
+
+/// sql_bind_param class. To be used for sql_stream internal purposes
+class sql_bind_param
+{
+public:
+  sql_bind_param() {
+    m_null=false;
+  }
+  virtual ~sql_bind_param() {}
+  /* value interpolated into the query text, or passed out-of-line
+     to a prepared statement */
+  void set_value(const char* v, int len) {
+    m_value.assign(v, len);
+    m_null=false;
+  }
+  void set_null() {
+    m_value.clear();
+    m_null=true;
+  }
+  const char* value() const {
+    return m_null ? NULL : m_value.c_str();
+  }
+  int size() const {
+    return (int)m_value.size();
+  }
+private:
+  std::string m_value;
+  bool m_null;
+};
+
+/**
+   sql_template class. A query text parsed for its :placeholders,
+   as literal segments separated by parameter slots. Templates are
+   kept in a process-wide cache keyed by the query text, so that
+   each distinct query is parsed only once and the final text can
+   be assembled in a single pass once all the values are known.
+*/
+class sql_template
+{
+public:
+  sql_template(const char* query);
+  virtual ~sql_template() {}
+  /** returns the template for 'query', from the cache when possible.
+      When the query is not cacheable (too long, or the cache is full),
+      a new template is returned with 'owned' set to true, and the
+      caller is responsible for deleting it */
+  static const sql_template* get(const char* query, bool* owned);
+
+  const std::string& text() const {
+    return m_text;
+  }
+  int params_count() const {
+    return (int)m_params.size();
+  }
+  const std::string& param_name(int i) const {
+    return m_params[i].name;
+  }
+  int param_pos(int i) const {
+    return m_params[i].pos;
+  }
+  /* true if the placeholder is preceded by a quote in the text,
+     meaning that the caller already encloses the value */
+  bool param_quoted(int i) const {
+    return m_params[i].pos>0 && m_text[m_params[i].pos-1]=='\'';
+  }
+  /// the text with the values of 'vars' in place of the placeholders
+  void build(std::string& out, const std::vector<sql_bind_param>& vars) const;
+  /// the text with $N in place of the placeholders, for PQprepare
+  void build_prepared(std::string& out) const;
+  /** the text normalized by query_stats, computed at the first call.
+      Defined in sqlstream.cpp, so that the template itself doesn't
+      depend on the rest of the database layer */
+  const std::string& stats_key() const;
+private:
+  struct param {
+    std::string name;
+    int pos;			/* position of the ':' character in text */
+    int end;			/* position following the name */
+  };
+  std::string m_text;
+  std::vector<param> m_params;
+  mutable std::string m_stats_key;
+  static const int max_cached_templates=1000;
+  static const int max_cached_length=4096;
+};
+
+#endif // INC_SQLTEMPLATE_H
@@ -0,0 +1,162 @@
+/* Copyright (C) 2004-2011 Daniel Verite
+
+   This file is part of Manitou-Mail (see http://www.manitou-mail.org)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#include "main.h"
+#include "query_stats.h"
+#include "string_pool.h"
+
+#include <QMutexLocker>
+
+// static members
+QMutex string_pool::m_mutex;
+QVector<QString> string_pool::m_strings;
+QVector<uint> string_pool::m_refs;
+QMultiHash<uint,uint> string_pool::m_ids;
+QVector<uint> string_pool::m_free_ids;
+int string_pool::m_purge_size=4096;
+qint64 string_pool::m_lookups;
+qint64 string_pool::m_hits;
+qint64 string_pool::m_bytes_saved;
+qint64 string_pool::m_bytes;
+qint64 string_pool::m_reported[5];
+
+/* Return the id of the string equal to 's', adding it to the table
+   if needed. m_mutex must be locked */
+//static
+uint
+string_pool::lookup(const QString& s)
+{
+  m_lookups++;
+  uint h = qHash(s);
+  QMultiHash<uint,uint>::const_iterator it = m_ids.find(h);
+  for (; it!=m_ids.end() && it.key()==h; ++it) {
+    const QString& t = m_strings.at(it.value());
+    if (t==s) {
+      m_hits++;
+      if (t.constData()!=s.constData())
+	m_bytes_saved += s.size()*sizeof(QChar);
+      return it.value();
+    }
+  }
+
+  if (m_strings.size()-m_free_ids.size() >= m_purge_size)
+    purge();
+  uint id;
+  if (!m_free_ids.isEmpty()) {
+    id = m_free_ids.back();
+    m_free_ids.pop_back();
+    m_strings[id] = s;
+    m_refs[id] = 0;
+  }
+  else {
+    id = m_strings.size();
+    m_strings.append(s);
+    m_refs.append(0);
+  }
+  m_ids.insert(h, id);
+  m_bytes += s.size()*sizeof(QChar);
+  return id;
+}
+
+/* Free the entries that have no id acquired and whose string is held
+   only by the table, and set the size of the next purge to twice the
+   number of the remaining entries */
+//static
+void
+string_pool::purge()
+{
+  int live=0;
+  for (int id=0; id<m_strings.size(); id++) {
+    if (m_strings.at(id).isNull())
+      continue;
+    if (m_refs.at(id)==0 && m_strings[id].isDetached()) {
+      m_ids.remove(qHash(m_strings.at(id)), id);
+      m_bytes -= m_strings.at(id).size()*sizeof(QChar);
+      m_strings[id] = QString();
+      m_free_ids.append(id);
+    }
+    else
+      live++;
+  }
+  m_purge_size = qMax(4096, 2*live);
+  DBG_PRINTF(5, "string_pool: %d entries after purge", live);
+}
+
+//static
+void
+string_pool::share(QString& s)
+{
+  if (s.isEmpty())
+    return;
+  QMutexLocker locker(&m_mutex);
+  s = m_strings.at(lookup(s));
+}
+
+//static
+uint
+string_pool::acquire(const QString& s)
+{
+  QMutexLocker locker(&m_mutex);
+  uint id = lookup(s);
+  m_refs[id]++;
+  return id;
+}
+
+//static
+void
+string_pool::release(uint id)
+{
+  QMutexLocker locker(&m_mutex);
+  if (id<(uint)m_refs.size() && m_refs.at(id)>0)
+    m_refs[id]--;
+}
+
+//static
+QString
+string_pool::get(uint id)
+{
+  QMutexLocker locker(&m_mutex);
+  return m_strings.at(id);
+}
+
+//static
+void
+string_pool::report_counters()
+{
+  static const char* names[5] = {
+    "string pool: lookups",
+    "string pool: hits",
+    "string pool: bytes saved",
+    "string pool: entries",
+    "string pool: bytes"
+  };
+  QMutexLocker locker(&m_mutex);
+  qint64 v[5];
+  v[0] = m_lookups;
+  v[1] = m_hits;
+  v[2] = m_bytes_saved;
+  v[3] = m_strings.size()-m_free_ids.size();
+  v[4] = m_bytes;
+  for (int i=0; i<5; i++) {
+    if (v[i]!=m_reported[i]) {
+      query_stats::add_counter(names[i], v[i]-m_reported[i]);
+      m_reported[i] = v[i];
+    }
+  }
+}
@@ -0,0 +1,76 @@
+/* Copyright (C) 2004-2011 Daniel Verite
+
+   This file is part of Manitou-Mail (see http://www.manitou-mail.org)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#ifndef INC_STRING_POOL_H
+#define INC_STRING_POOL_H
+
+#include <QString>
+#include <QVector>
+#include <QMultiHash>
+#include <QMutex>
+
+/*
+  Table of distinct strings for the senders, recipients and subjects
+  of the messages lists, where a few values are repeated over many
+  rows.
+
+  share() replaces a string by the copy held by the table, so that
+  the equal strings of mail_result and mail_msg share their buffer.
+  acquire() gives the id of a string in the table, for the rows of
+  mail_item_model, and the string stays there until the id is
+  released. Entries that are no longer used by anything are purged
+  when the table grows.
+
+  Used from the GUI and the fetch threads.
+*/
+class string_pool
+{
+public:
+  // replace 's' by the shared copy of an equal string
+  static void share(QString& s);
+  // id of the string equal to 's', to be released by the caller
+  static uint acquire(const QString& s);
+  static void release(uint id);
+  static QString get(uint id);
+
+  /* add the lookups, hits and bytes saved since the previous call,
+     and the size of the table, to the counters of query_stats */
+  static void report_counters();
+
+private:
+  static uint lookup(const QString& s);
+  static void purge();
+
+  static QMutex m_mutex;
+  static QVector<QString> m_strings; // a null string for a free id
+  static QVector<uint> m_refs;	// counts of acquire() by id
+  static QMultiHash<uint,uint> m_ids; // qHash of the string => id
+  static QVector<uint> m_free_ids;
+  static int m_purge_size;	// purge() when the table reaches it
+
+  // counters
+  static qint64 m_lookups;
+  static qint64 m_hits;
+  static qint64 m_bytes_saved;
+  static qint64 m_bytes;		// in the strings of the table
+  // values at the previous report_counters()
+  static qint64 m_reported[5];
+};
+
+#endif // INC_STRING_POOL_H
@@ -21,6 +21,7 @@
 #include "db.h"
 #include "sqlstream.h"
 #include "tags.h"
+#include "result_cache.h"
 #include <QStringList>
 
 // separator between parent and child tag
@@ -232,6 +233,8 @@ message_tag::remove()
     sql_stream s2("DELETE FROM tags WHERE tag_id=:p1", db);
     s2 << getId();
     db.commit_transaction();
+    // the selections by tag are affected without their messages changing
+    result_cache::invalidate();
   }
   catch(db_excpt& p) {
     db.rollback_transaction();
@@ -17,10 +17,16 @@
    Boston, MA 02111-1307, USA.
 */
 
+#include <algorithm>
+#include <iterator>
+#include <set>
+
 #include "main.h"
 #include "words.h"
 #include "db.h"
 #include "sqlstream.h"
+#include "query_stats.h"
+#include "wordvec_cache.h"
 
 #ifdef Q_OS_WIN
 #include <winsock2.h>
@@ -38,7 +44,7 @@ db_word::db_word() : m_word_id(0)
 
 db_word::~db_word()
 {
-  std::map<uint,bit_vector*>::iterator it;
+  std::map<uint,compressed_vector*>::iterator it;
   for (it = m_vectors.begin(); it!=m_vectors.end(); ++it) {
     delete it->second;
   }
@@ -95,10 +101,10 @@ db_word::fetch_id()
 
 /* Return the vector of bits related to 'part_no' partition, or NULL
  if that part of the vector if empty */
-const bit_vector*
+const compressed_vector*
 db_word::vector_part(uint part_no) const
 {
-  std::map<uint,bit_vector*>::const_iterator it;
+  std::map<uint,compressed_vector*>::const_iterator it;
   it = m_vectors.find(part_no);
   return (it!=m_vectors.end() ? it->second : NULL);
 }
@@ -116,6 +122,7 @@ db_word::fetch_vectors()
 
   QString query= QString("SELECT part_no,mailvec,nz_offset FROM inverted_word_index WHERE word_id=%1").arg(m_word_id);
 
+  qint64 start=query_stats::clock_us();
   PGresult* res = PQexecParams(pgconn,
 			       query.toLatin1().constData(),
 			       0, // number of params
@@ -125,6 +132,8 @@ db_word::fetch_vectors()
 			       NULL, // param formats
 			       1 // result format=binary
 			       );
+  query_stats::record(query.toLatin1().constData(),
+		      query_stats::clock_us()-start, res);
   if (res && PQresultStatus(res)==PGRES_TUPLES_OK) {
     for (int row=0; row<PQntuples(res); row++) {
       //int f=PQfformat(res,1);
@@ -135,7 +144,7 @@ db_word::fetch_vectors()
       uint nz_offset=(uint)nzo;
 //      DBG_PRINTF(5, "word='%s' word_id=%d, partno=%d, nz_offset=%d, mailvec.length=%d\n",
 //		 m_text.latin1(), m_word_id, part, nz_offset, PQgetlength(res, row, 1));
-      bit_vector* v = new bit_vector();
+      compressed_vector* v = new compressed_vector();
       v->set_buf((const uchar*)PQgetvalue(res, row, 1),
 		 PQgetlength(res, row, 1),
 		 nz_offset);
@@ -182,10 +191,10 @@ void
 wordsearch_resultset::and_word(const db_word& dbw)
 {
 //  DBG_PRINTF(7, "and_word('%s')\n", dbw.text().latin1());
-  std::map<uint,bit_vector*>::iterator it;
+  std::map<uint,compressed_vector*>::iterator it;
 
   for (it = m_vect.begin(); it!=m_vect.end(); ++it) {
-    const bit_vector* v = dbw.vector_part(it->first);
+    const compressed_vector* v = dbw.vector_part(it->first);
     if (!v) {
       it->second->clear();
     }
@@ -200,19 +209,17 @@ wordsearch_resultset::insert_word(const db_word& dbw)
 {
 //  DBG_PRINTF(7, "insert_word('%s')\n", dbw.text().latin1());
   // copy the vectors from dbw
-  const std::map<uint,bit_vector*>* w_vecs = dbw.vectors();
-  std::map<uint,bit_vector*>::const_iterator it;
+  const std::map<uint,compressed_vector*>* w_vecs = dbw.vectors();
+  std::map<uint,compressed_vector*>::const_iterator it;
   for (it=w_vecs->begin(); it!=w_vecs->end(); ++it) {
-    bit_vector* v = new bit_vector();
-    v->set_buf(it->second->buf(), it->second->size());
-    m_vect[it->first] = v;
+    m_vect[it->first] = new compressed_vector(*it->second);
   }
 }
 
 void
 wordsearch_resultset::clear()
 {
-  std::map<uint,bit_vector*>::iterator it;
+  std::map<uint,compressed_vector*>::iterator it;
   for (it = m_vect.begin(); it!=m_vect.end(); ++it) {
     delete it->second;
   }
@@ -227,51 +234,292 @@ wordsearch_resultset::clear()
  if direction==0, limit is ignored
 */
 void
-wordsearch_resultset::get_result_bits(std::list<mail_id_t>& l,
+wordsearch_resultset::get_result_bits(std::vector<mail_id_t>& l,
 				      mail_id_t limit,
 				      int direction,
 				      uint max_results)
 {
   DBG_PRINTF(7, "get_result_bits(limit=%d,direction=%d,max_results=%u)", limit, direction, max_results);
-  std::map<uint,bit_vector*>::iterator it;
-  uint cnt_results=0;
-/*  if (max_results==0)
-    return;*/
-  for (it = m_vect.begin(); it!=m_vect.end(); ++it) {
-    int part_offset = it->first*m_partsize;
-    uint sz=it->second->size();
-    const uchar* buf = it->second->buf();
-
-    for (uint o=0; o<sz; o++) {
-      uchar mask=1;
-      uchar c=buf[o];
-      if (!c) continue;		// shortcut
-      for (uint i=0; i<8; i++) {
-	if (c&mask) {
-	  mail_id_t id = part_offset+(o*8)+i+1;
-	  if (direction==0) {
-	    l.push_back(id);
-	    cnt_results++;
-	  }
-	  else if (direction==-1) {
-	    if (id<limit) {
-	      l.push_back(id);
-	      cnt_results++;
-	    }
-	  }
-	  else if (direction==1) {
-	    if (id>limit) {
-	      l.push_back(id);
-	      cnt_results++;
-	    }
-	  }
-	  if (max_results>0 && cnt_results >= max_results)
-	    return;		// shortcut to exit
-	}
-	mask = mask << 1;
+  std::map<uint,compressed_vector*>::iterator it;
+  size_t start=l.size();
+  /* the partitions come in increasing order, and so do the mail_id
+     inside a partition: l is sorted */
+  bool last=false;
+  for (it = m_vect.begin(); it!=m_vect.end() && !last; ++it) {
+    it->second->get_values(l, it->first*m_partsize);
+    if (direction==1) {
+      // drop the values up to the limit
+      l.erase(l.begin()+start, std::upper_bound(l.begin()+start, l.end(), limit));
+    }
+    else if (direction==-1 && l.size()>start && l.back()>=limit) {
+      // no more values under the limit
+      l.erase(std::lower_bound(l.begin()+start, l.end(), limit), l.end());
+      last=true;
+    }
+    if (max_results>0 && l.size()-start >= max_results) {
+      l.resize(start+max_results);
+      break;
+    }
+  }
+}
+
+void
+wordsearch_query::add_any(const QStringList& words)
+{
+  if (!words.isEmpty())
+    m_groups.append(words);
+}
+
+void
+wordsearch_query::add_word(const QString& word)
+{
+  add_any(QStringList(word));
+}
+
+void
+wordsearch_query::add_excluded(const QString& word)
+{
+  m_excluded.append(word);
+}
+
+// Format 'words' as a text[] literal
+static QString
+format_text_array(const QStringList& words)
+{
+  QString a="{";
+  for (int i=0; i<words.size(); i++) {
+    if (i>0)
+      a.append(',');
+    QString w=words.at(i);
+    w.replace('\\', "\\\\");
+    w.replace('"', "\\\"");
+    a.append('"' + w + '"');
+  }
+  a.append('}');
+  return a;
+}
+
+/*
+  Fetch the vectors of the words in 'arr' into 'vectors', the entries
+  of the local cache that are still valid being used instead of the
+  database contents. A first query lists the (word_id,part_no) entries
+  with their xmin and the nz_offset and size of their mailvec, and a
+  second one fetches the missing or changed ones. The partitions that new mail
+  may have changed are always fetched.
+*/
+//static
+void
+wordsearch_query::fetch_cached_vectors(db_cnx& db, const QString& arr,
+				       wordvec_cache* cache,
+				       std::map<QString,part_map>& vectors)
+{
+  typedef std::pair<uint,uint> key_t;
+  std::map<uint,QString> word_texts;
+  std::vector<key_t> missing;
+  int hits=0;
+
+  sql_stream s("SELECT w.wordtext,i.word_id,i.part_no,i.xmin::text::bigint,i.nz_offset,octet_length(i.mailvec),(SELECT coalesce(max(mail_id),0) FROM mail) FROM words w JOIN inverted_word_index i ON i.word_id=w.word_id WHERE w.wordtext=ANY(:p1::text[])", db);
+  s << arr;
+  while (!s.eos()) {
+    QString w;
+    int word_id, part_no, nz_offset, length, max_mail_id;
+    uint xmin;
+    s >> w >> word_id >> part_no >> xmin >> nz_offset >> length >> max_mail_id;
+    word_texts[word_id]=w;
+    /* new mail changes the partitions from the one of max(mail_id).
+       Counting from mail_id 1 gives it or the one before */
+    int top_part = max_mail_id>0 ? (max_mail_id-1)/wordsearch_resultset::m_partsize : 0;
+    compressed_vector* v = new compressed_vector();
+    if (part_no<top_part && cache->load(word_id, part_no, xmin, nz_offset, length, v)) {
+      part_map& pm = vectors[w];
+      if (pm.find(part_no)!=pm.end())
+	delete pm[part_no];
+      pm[part_no] = v;
+      hits++;
+    }
+    else {
+      delete v;
+      missing.push_back(key_t(word_id, part_no));
+    }
+  }
+
+  if (!missing.empty()) {
+    QString wids="{", parts="{";
+    for (uint i=0; i<missing.size(); i++) {
+      if (i>0) {
+	wids.append(',');
+	parts.append(',');
+      }
+      wids.append(QString::number(missing[i].first));
+      parts.append(QString::number(missing[i].second));
+    }
+    wids.append('}');
+    parts.append('}');
+
+    sql_stream sf("SELECT i.word_id,i.part_no,i.mailvec,i.nz_offset,i.xmin::text::bigint FROM inverted_word_index i JOIN (SELECT unnest(:wids::int[]) AS word_id, unnest(:parts::int[]) AS part_no) k ON (k.word_id=i.word_id AND k.part_no=i.part_no)", db);
+    sf.set_binary_results();
+    sf << wids << parts;
+    while (!sf.eos()) {
+      int word_id, part_no, nz_offset;
+      qint64 xmin;
+      QByteArray mailvec;
+      sf >> word_id >> part_no >> mailvec >> nz_offset >> xmin;
+      compressed_vector* v = new compressed_vector();
+      v->set_buf((const uchar*)mailvec.constData(), mailvec.size(), nz_offset);
+      cache->store(word_id, part_no, (uint)xmin, nz_offset,
+		   mailvec.constData(), mailvec.size());
+      part_map& pm = vectors[word_texts[word_id]];
+      if (pm.find(part_no)!=pm.end())
+	delete pm[part_no];
+      pm[part_no] = v;
+    }
+    cache->flush();
+  }
+  DBG_PRINTF(5, "word vectors: %d from the cache, %d fetched",
+	     hits, (int)missing.size());
+  query_stats::add_counter("word vectors cache, hits", hits);
+  query_stats::add_counter("word vectors cache, misses", (int)missing.size());
+}
+
+/*
+  The bit of a message in its partition of the index is bit b of
+  mailvec, counting from nz_offset bytes, with b=(mail_id-1)%partsize.
+  get_bit() numbers the bits like bit_vector: bit b%8 of byte b/8.
+  The CASE keeps get_bit() from being called out of the vector.
+*/
+//static
+QString
+wordsearch_query::excluded_clause(const QStringList& words, db_cnx& db)
+{
+  QString partsize = QString::number(wordsearch_resultset::m_partsize);
+  QString bit = QString("((m.mail_id-1)%%1-i.nz_offset*8)").arg(partsize);
+  return QString("NOT EXISTS (SELECT 1 FROM words w JOIN inverted_word_index i ON i.word_id=w.word_id WHERE w.wordtext=ANY(%1) AND i.part_no=(m.mail_id-1)/%2 AND CASE WHEN %3 BETWEEN 0 AND octet_length(i.mailvec)*8-1 THEN get_bit(i.mailvec,%3) ELSE 0 END=1)")
+    .arg(db_word::format_db_string_array(words, db), partsize, bit);
+}
+
+void
+wordsearch_query::evaluate(db_cnx& db, std::vector<mail_id_t>& result) const
+{
+  std::map<QString,part_map> vectors;
+  std::map<QString,part_map>::const_iterator vit;
+  part_map::const_iterator pit;
+
+  QStringList words = m_excluded;
+  for (int g=0; g<m_groups.size(); g++)
+    words += m_groups.at(g);
+  words.removeDuplicates();
+  const QString arr = format_text_array(words);
+
+  QStringList non_indexable;
+  qint64 flat_bytes=0, packed_bytes=0;
+  try {
+    sql_stream sn("SELECT wordtext FROM non_indexable_words WHERE wordtext=ANY(:p1::text[])", db);
+    sn << arr;
+    while (!sn.eos()) {
+      QString w;
+      sn >> w;
+      non_indexable.append(w);
+    }
+
+    wordvec_cache* cache = wordvec_cache::instance();
+    if (cache)
+      fetch_cached_vectors(db, arr, cache, vectors);
+    else {
+      sql_stream s("SELECT w.wordtext,i.part_no,i.mailvec,i.nz_offset FROM words w JOIN inverted_word_index i ON i.word_id=w.word_id WHERE w.wordtext=ANY(:p1::text[])", db);
+      s.set_binary_results();
+      s << arr;
+      while (!s.eos()) {
+	QString w;
+	int part_no, nz_offset;
+	QByteArray mailvec;
+	s >> w >> part_no >> mailvec >> nz_offset;
+	compressed_vector* v = new compressed_vector();
+	v->set_buf((const uchar*)mailvec.constData(), mailvec.size(), nz_offset);
+	part_map& pm = vectors[w];
+	if (pm.find(part_no)!=pm.end())
+	  delete pm[part_no];
+	pm[part_no] = v;
       }
     }
   }
+  catch(db_excpt& p) {
+    for (vit=vectors.begin(); vit!=vectors.end(); ++vit) {
+      for (pit=vit->second.begin(); pit!=vit->second.end(); ++pit)
+	delete pit->second;
+    }
+    throw p;
+  }
+
+  // compare with what the vectors would take as bit_vector
+  for (vit=vectors.begin(); vit!=vectors.end(); ++vit) {
+    for (pit=vit->second.begin(); pit!=vit->second.end(); ++pit) {
+      flat_bytes += pit->second->flat_size();
+      packed_bytes += pit->second->memory_size();
+    }
+  }
+  DBG_PRINTF(5, "word vectors: %lld bytes flat, %lld bytes compressed",
+	     flat_bytes, packed_bytes);
+  query_stats::add_counter("word vectors, flat bytes", flat_bytes);
+  query_stats::add_counter("word vectors, compressed bytes", packed_bytes);
+
+  // the groups that constrain the results, and the partitions they cover
+  QList<QStringList> groups;
+  std::set<uint> parts;
+  for (int g=0; g<m_groups.size(); g++) {
+    QStringList group;
+    std::set<uint> gparts;
+    for (int i=0; i<m_groups.at(g).size(); i++) {
+      const QString& w = m_groups.at(g).at(i);
+      if (w.length()<3 || non_indexable.contains(w))
+	continue;
+      group.append(w);
+      vit = vectors.find(w);
+      if (vit!=vectors.end()) {
+	for (pit=vit->second.begin(); pit!=vit->second.end(); ++pit)
+	  gparts.insert(pit->first);
+      }
+    }
+    if (group.isEmpty())
+      continue;			// only non-indexable words
+    if (groups.isEmpty())
+      parts = gparts;
+    else {
+      std::set<uint> common;
+      std::set_intersection(parts.begin(), parts.end(),
+			    gparts.begin(), gparts.end(),
+			    std::inserter(common, common.begin()));
+      parts.swap(common);
+    }
+    groups.append(group);
+  }
+
+  std::set<uint>::reverse_iterator it;
+  for (it=parts.rbegin(); !groups.isEmpty() && it!=parts.rend(); ++it) {
+    compressed_vector acc;
+    for (int g=0; g<groups.size(); g++) {
+      compressed_vector alt;
+      for (int i=0; i<groups.at(g).size(); i++) {
+	vit = vectors.find(groups.at(g).at(i));
+	if (vit!=vectors.end() && (pit=vit->second.find(*it))!=vit->second.end())
+	  alt.or_op(*pit->second);
+      }
+      if (g==0)
+	acc.or_op(alt);
+      else
+	acc.and_op(alt);
+    }
+    for (int i=0; i<m_excluded.size(); i++) {
+      vit = vectors.find(m_excluded.at(i));
+      if (vit!=vectors.end() && (pit=vit->second.find(*it))!=vit->second.end())
+	acc.and_not_op(*pit->second);
+    }
+    acc.get_values(result, (*it)*wordsearch_resultset::m_partsize);
+  }
+
+  for (vit=vectors.begin(); vit!=vectors.end(); ++vit) {
+    for (pit=vit->second.begin(); pit!=vit->second.end(); ++pit)
+      delete pit->second;
+  }
 }
 
 //static
@@ -21,7 +21,10 @@
 #define INC_WORDS_H
 
 #include <map>
+#include <vector>
 #include <qstring.h>
+#include <QStringList>
+#include <QList>
 #include "bitvector.h"
 #include "dbtypes.h"
 
@@ -42,9 +45,9 @@ public:
   // fetch the inverted index entries related to the word
   bool fetch_vectors();
 
-  const bit_vector* vector_part(uint part_no) const;
+  const compressed_vector* vector_part(uint part_no) const;
 
-  const std::map<uint,bit_vector*>* vectors() const {
+  const std::map<uint,compressed_vector*>* vectors() const {
     return &m_vectors;
   }
 
@@ -57,7 +60,7 @@ private:
   /* vector of mails containing this word, fetchable from the inverted index
      the map index is the partno column (number of partition) of
      inverted_word_index */
-  std::map<uint,bit_vector*> m_vectors;
+  std::map<uint,compressed_vector*> m_vectors;
 
   // wordtext.word_id
   uint m_word_id;
@@ -71,18 +74,59 @@ class wordsearch_resultset
 public:
   wordsearch_resultset();
   ~wordsearch_resultset();
-  void get_result_bits(std::list<uint>& l,
+  void get_result_bits(std::vector<mail_id_t>& l,
 		       mail_id_t limit,
 		       int direction, // -1,+1 or 0
 		       uint max_results);
   void and_word(const db_word& dbw);
   void insert_word(const db_word& dbw);
 private:
+  friend class wordsearch_query;
   void clear();
-  std::map<uint,bit_vector*> m_vect;
+  std::map<uint,compressed_vector*> m_vect;
   static int m_partsize;
 };
 
+class db_cnx;
+class wordvec_cache;
+
+/*
+  Boolean word search evaluated on the client from the vectors of the
+  inverted word index. The query is a conjunction of groups of
+  alternative words, minus excluded words. A phrase is searched by
+  adding each of its words, which gives the candidates to be checked
+  against the text. The vectors of all the words are fetched with one
+  query and combined partition by partition.
+*/
+class wordsearch_query
+{
+public:
+  // the results must contain at least one of 'words'
+  void add_any(const QStringList& words);
+  // the results must contain 'word'
+  void add_word(const QString& word);
+  // the results must not contain 'word'
+  void add_excluded(const QString& word);
+  bool empty() const {
+    return m_groups.isEmpty();
+  }
+  /* Append to 'result' the mail_id of the matching messages, by
+     decreasing partition and increasing mail_id inside a partition.
+     Non-indexable words are ignored. Throws db_excpt */
+  void evaluate(db_cnx& db, std::vector<mail_id_t>& result) const;
+  /* SQL condition on m.mail_id, false for the messages that contain
+     any of 'words' according to the inverted index. For the searches
+     that aren't evaluated by evaluate() */
+  static QString excluded_clause(const QStringList& words, db_cnx& db);
+private:
+  typedef std::map<uint,compressed_vector*> part_map;
+  static void fetch_cached_vectors(db_cnx& db, const QString& arr,
+				   wordvec_cache* cache,
+				   std::map<QString,part_map>& vectors);
+  QList<QStringList> m_groups;
+  QStringList m_excluded;
+};
+
 class progressive_wordsearch
 {
 public:
@@ -0,0 +1,363 @@
+/* Copyright (C) 2004-2011 Daniel Verite
+
+   This file is part of Manitou-Mail (see http://www.manitou-mail.org)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#include "main.h"
+#include "app_config.h"
+#include "database.h"
+#include "bitvector.h"
+#include "wordvec_cache.h"
+
+#include <algorithm>
+#include <string.h>
+#include <vector>
+#ifdef _WINDOWS
+#include <io.h>
+#include <sys/locking.h>
+#else
+#include <sys/file.h>
+#endif
+
+#include <QDesktopServices>
+#include <QDir>
+#include <QMutexLocker>
+#include <QRegExp>
+
+//static
+wordvec_cache*
+wordvec_cache::instance()
+{
+  static QMutex init_mutex;
+  static wordvec_cache* cache;
+  static bool initialized;
+
+  QMutexLocker locker(&init_mutex);
+  if (initialized)
+    return cache;
+  initialized=true;
+
+  if (!get_config().get_bool("search/vector_cache", true))
+    return NULL;
+  int size_mb = get_config().exists("search/vector_cache_size") ?
+    get_config().get_number("search/vector_cache_size") : 64;
+  if (size_mb<=0)
+    return NULL;
+
+  QString dir = QDesktopServices::storageLocation(QDesktopServices::CacheLocation);
+  if (dir.isEmpty() || !QDir().mkpath(dir)) {
+    DBG_PRINTF(2, "no directory for the word vectors cache");
+    return NULL;
+  }
+  /* word_id are specific to a database, so the file name is derived
+     from the connection parameters */
+  QString name = QString("iwi-%1-%2.cache")
+    .arg(QString(db_cnx::dbname()).replace(QRegExp("[^A-Za-z0-9_]"), "_"))
+    .arg(qHash(db_cnx::connect_string()), 0, 16);
+
+  wordvec_cache* c = new wordvec_cache(dir + "/" + name, (qint64)size_mb*1024*1024);
+  if (!c->open()) {
+    delete c;
+    return NULL;
+  }
+  cache=c;
+  return cache;
+}
+
+wordvec_cache::wordvec_cache(const QString& filename, qint64 max_size) :
+  m_filename(filename), m_read_only(false), m_map(NULL), m_mapped_size(0),
+  m_max_size(max_size),
+  m_dead_bytes(0), m_use_counter(0)
+{
+}
+
+wordvec_cache::~wordvec_cache()
+{
+  unmap();
+}
+
+//static
+qint64
+wordvec_cache::record_size(uint length)
+{
+  return sizeof(rec_header) + ((length+3)&~3);
+}
+
+/* Lock the file for writing. The lock goes away with the process,
+   even when it crashes */
+bool
+wordvec_cache::lock()
+{
+  m_lock_file.setFileName(m_filename + ".lock");
+  if (!m_lock_file.open(QIODevice::ReadWrite))
+    return false;
+#ifdef _WINDOWS
+  return _locking(m_lock_file.handle(), _LK_NBLCK, 1)==0;
+#else
+  return flock(m_lock_file.handle(), LOCK_EX|LOCK_NB)==0;
+#endif
+}
+
+bool
+wordvec_cache::open()
+{
+  m_read_only = !lock();
+  if (m_read_only) {
+    DBG_PRINTF(3, "%s is used by another process, opening it read-only",
+	       m_filename.toLocal8Bit().constData());
+  }
+  m_file.setFileName(m_filename);
+  if (!m_file.open(m_read_only ? QIODevice::ReadOnly : QIODevice::ReadWrite)) {
+    DBG_PRINTF(2, "Unable to open %s", m_filename.toLocal8Bit().constData());
+    return false;
+  }
+  quint32 hdr[2];
+  if (m_file.read((char*)hdr, sizeof(hdr))!=sizeof(hdr) ||
+      hdr[0]!=m_magic || hdr[1]!=m_version)
+  {
+    if (m_read_only)
+      return false;
+    // new or unusable file: start over
+    hdr[0]=m_magic;
+    hdr[1]=m_version;
+    if (!m_file.resize(0) || !m_file.seek(0) ||
+	m_file.write((const char*)hdr, sizeof(hdr))!=sizeof(hdr) ||
+	!m_file.flush())
+    {
+      DBG_PRINTF(2, "Unable to initialize %s", m_filename.toLocal8Bit().constData());
+      return false;
+    }
+  }
+  if (!map())
+    return false;
+  scan();
+  return true;
+}
+
+bool
+wordvec_cache::map()
+{
+  unmap();
+  m_file.flush();
+  qint64 size = m_file.size();
+  m_map = m_file.map(0, size);
+  if (!m_map) {
+    DBG_PRINTF(2, "Unable to map %s", m_filename.toLocal8Bit().constData());
+    return false;
+  }
+  m_mapped_size=size;
+  return true;
+}
+
+void
+wordvec_cache::unmap()
+{
+  if (m_map) {
+    m_file.unmap(m_map);
+    m_map=NULL;
+  }
+  m_mapped_size=0;
+}
+
+/* Build the index of the entries from the records of the file. The
+   records come in the order of their last use from a previous
+   compact(), or of their insertion. A truncated record, such as one
+   interrupted by a crash, ends the file. When read-only, it may also
+   be a record being written by the process that has the lock */
+void
+wordvec_cache::scan()
+{
+  qint64 offset = 2*sizeof(quint32);
+  m_entries.clear();
+  m_dead_bytes=0;
+  while (offset+(qint64)sizeof(rec_header) <= m_mapped_size) {
+    rec_header h;
+    memcpy(&h, m_map+offset, sizeof(h));
+    if (offset+record_size(h.length) > m_mapped_size)
+      break;
+    entry& e = m_entries[key_t(h.word_id, h.part_no)];
+    if (e.offset)
+      m_dead_bytes += record_size(e.length);
+    e.offset = offset+sizeof(rec_header);
+    e.xmin = h.xmin;
+    e.nz_offset = h.nz_offset;
+    e.length = h.length;
+    e.last_use = ++m_use_counter;
+    offset += record_size(h.length);
+  }
+  if (offset < m_mapped_size && !m_read_only) {
+    DBG_PRINTF(3, "truncating %s at %lld", m_filename.toLocal8Bit().constData(),
+	       offset);
+    unmap();
+    m_file.resize(offset);
+    map();
+  }
+  DBG_PRINTF(5, "word vectors cache: %d entries, %lld bytes",
+	     (int)m_entries.size(), m_mapped_size);
+}
+
+bool
+wordvec_cache::load(uint word_id, uint part_no, uint xmin, uint nz_offset,
+		    uint length, compressed_vector* v)
+{
+  QMutexLocker locker(&m_mutex);
+  std::map<key_t,entry>::iterator it = m_entries.find(key_t(word_id, part_no));
+  if (it==m_entries.end())
+    return false;
+  entry& e = it->second;
+  if (e.xmin!=xmin || e.nz_offset!=nz_offset || e.length!=length)
+    return false;
+  if (e.offset+e.length > m_mapped_size && !map())
+    return false;
+  v->set_buf(m_map+e.offset, e.length, e.nz_offset);
+  e.last_use = ++m_use_counter;
+  return true;
+}
+
+void
+wordvec_cache::store(uint word_id, uint part_no, uint xmin, uint nz_offset,
+		     const char* data, uint length)
+{
+  QMutexLocker locker(&m_mutex);
+  if (m_read_only || record_size(length) > m_max_size/2)
+    return;
+  rec_header h;
+  h.word_id = word_id;
+  h.part_no = part_no;
+  h.xmin = xmin;
+  h.nz_offset = nz_offset;
+  h.length = length;
+  static const char pad[4] = {0,0,0,0};
+  qint64 offset = m_file.size();
+  uint padlen = (uint)(record_size(length)-sizeof(h)-length);
+  if (!m_file.seek(offset) ||
+      m_file.write((const char*)&h, sizeof(h))!=sizeof(h) ||
+      m_file.write(data, length)!=length ||
+      m_file.write(pad, padlen)!=padlen)
+  {
+    DBG_PRINTF(2, "Unable to write into %s", m_filename.toLocal8Bit().constData());
+    m_file.resize(offset);
+    return;
+  }
+  std::map<key_t,entry>::iterator it = m_entries.find(key_t(word_id, part_no));
+  if (it!=m_entries.end())
+    m_dead_bytes += record_size(it->second.length);
+  entry& e = m_entries[key_t(word_id, part_no)];
+  e.offset = offset+sizeof(h);
+  e.xmin = xmin;
+  e.nz_offset = nz_offset;
+  e.length = length;
+  e.last_use = ++m_use_counter;
+}
+
+void
+wordvec_cache::flush()
+{
+  QMutexLocker locker(&m_mutex);
+  if (m_read_only)
+    return;
+  m_file.flush();
+  if (m_file.size() > m_max_size || m_dead_bytes > m_max_size/4)
+    compact();
+  else if (m_file.size() != m_mapped_size)
+    map();
+}
+
+namespace {
+  struct by_last_use {
+    bool operator()(const std::pair<quint64,std::pair<uint,uint> >& a,
+		    const std::pair<quint64,std::pair<uint,uint> >& b) const {
+      return a.first > b.first;
+    }
+  };
+}
+
+/* Rewrite the file with the most recently used entries filling up to
+   3/4 of the size limit, so that it's not rewritten at each store() */
+void
+wordvec_cache::compact()
+{
+  if (m_file.size() != m_mapped_size && !map())
+    return;
+
+  std::vector<std::pair<quint64,key_t> > order;
+  order.reserve(m_entries.size());
+  std::map<key_t,entry>::const_iterator it;
+  for (it=m_entries.begin(); it!=m_entries.end(); ++it)
+    order.push_back(std::make_pair(it->second.last_use, it->first));
+  std::sort(order.begin(), order.end(), by_last_use());
+
+  qint64 total = 2*sizeof(quint32);
+  size_t nb_kept=0;
+  while (nb_kept<order.size()) {
+    qint64 sz = record_size(m_entries[order[nb_kept].second].length);
+    if (total+sz > m_max_size*3/4)
+      break;
+    total += sz;
+    nb_kept++;
+  }
+
+  // least recently used first, which is how scan() will rank them
+  QFile tmp(m_filename + ".tmp");
+  if (!tmp.open(QIODevice::WriteOnly|QIODevice::Truncate)) {
+    DBG_PRINTF(2, "Unable to create %s", tmp.fileName().toLocal8Bit().constData());
+    return;
+  }
+  quint32 hdr[2] = {m_magic, m_version};
+  bool ok = (tmp.write((const char*)hdr, sizeof(hdr))==sizeof(hdr));
+  std::map<key_t,entry> kept;
+  for (size_t i=nb_kept; ok && i>0; i--) {
+    const key_t& k = order[i-1].second;
+    const entry& e = m_entries[k];
+    rec_header h;
+    h.word_id = k.first;
+    h.part_no = k.second;
+    h.xmin = e.xmin;
+    h.nz_offset = e.nz_offset;
+    h.length = e.length;
+    entry& ne = kept[k];
+    ne.offset = tmp.pos()+sizeof(h);
+    ne.xmin = e.xmin;
+    ne.nz_offset = e.nz_offset;
+    ne.length = e.length;
+    ne.last_use = e.last_use;
+    ok = (tmp.write((const char*)&h, sizeof(h))==sizeof(h) &&
+	  tmp.write((const char*)m_map+e.offset, record_size(e.length)-sizeof(h))
+	  ==record_size(e.length)-(qint64)sizeof(h));
+  }
+  tmp.close();
+  if (!ok) {
+    DBG_PRINTF(2, "Unable to write %s", tmp.fileName().toLocal8Bit().constData());
+    tmp.remove();
+    return;
+  }
+
+  unmap();
+  m_file.close();
+  if (!QFile::remove(m_filename) || !tmp.rename(m_filename) ||
+      !m_file.open(QIODevice::ReadWrite) || !map())
+  {
+    // what's already been loaded stays valid, but nothing more is cached
+    DBG_PRINTF(2, "Unable to replace %s", m_filename.toLocal8Bit().constData());
+    m_entries.clear();
+    return;
+  }
+  DBG_PRINTF(5, "word vectors cache: kept %d entries out of %d",
+	     (int)kept.size(), (int)m_entries.size());
+  m_entries.swap(kept);
+  m_dead_bytes=0;
+}
@@ -0,0 +1,115 @@
+/* Copyright (C) 2004-2011 Daniel Verite
+
+   This file is part of Manitou-Mail (see http://www.manitou-mail.org)
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330,
+   Boston, MA 02111-1307, USA.
+*/
+
+#ifndef INC_WORDVEC_CACHE_H
+#define INC_WORDVEC_CACHE_H
+
+#include <QString>
+#include <QFile>
+#include <QMutex>
+#include <map>
+#include <utility>
+
+class compressed_vector;
+
+/*
+  Local copy of inverted_word_index rows: (word_id,part_no) -> mailvec,
+  kept on disk across sessions in a memory-mapped file.
+
+  The file is a header followed by records appended one after the
+  other. A record replacing an older one for the same key makes it
+  dead space, which is reclaimed when the file is rewritten. The file
+  is rewritten when it exceeds the size limit, keeping only the most
+  recently used records.
+
+  An entry is valid as long as the xmin of the inverted_word_index row,
+  and the nz_offset and length of its mailvec, are the same as when it
+  was stored: any update of the row, such as a bit set by late
+  indexing or a reindex, gives it another xmin. Since mail_id are
+  increasing, new messages mostly change the partition holding the
+  highest mail_id, that the caller always refetches.
+
+  Shared by all threads through instance(). Between processes, the
+  file is written only by the one holding the lock on <file>.lock; the
+  others use it read-only, as it was when they opened it.
+*/
+class wordvec_cache
+{
+public:
+  /* The cache of the current database, or NULL if it's disabled or
+     can't be opened */
+  static wordvec_cache* instance();
+
+  /* If the entry for (word_id,part_no) exists and matches xmin,
+     nz_offset and length, load it into 'v' and return true */
+  bool load(uint word_id, uint part_no, uint xmin, uint nz_offset,
+	    uint length, compressed_vector* v);
+
+  // add or replace the entry for (word_id,part_no)
+  void store(uint word_id, uint part_no, uint xmin, uint nz_offset,
+	     const char* data, uint length);
+
+  // remap the records appended by store() and enforce the size limit
+  void flush();
+
+private:
+  wordvec_cache(const QString& filename, qint64 max_size);
+  ~wordvec_cache();
+  bool lock();
+  bool open();
+  bool map();
+  void unmap();
+  void scan();
+  void compact();
+
+  struct rec_header {
+    quint32 word_id;
+    quint32 part_no;
+    quint32 xmin;
+    quint32 nz_offset;
+    quint32 length;
+  };
+  struct entry {
+    qint64 offset;	// of the record's data in the file
+    uint xmin;		// of the inverted_word_index row
+    uint nz_offset;
+    uint length;
+    quint64 last_use;
+  };
+  typedef std::pair<uint,uint> key_t;
+
+  static qint64 record_size(uint length);
+
+  QString m_filename;
+  QFile m_file;
+  QFile m_lock_file;		// locked until the process exits
+  bool m_read_only;		// another process has the lock
+  uchar* m_map;
+  qint64 m_mapped_size;
+  qint64 m_max_size;
+  qint64 m_dead_bytes;
+  quint64 m_use_counter;
+  std::map<key_t,entry> m_entries;
+  QMutex m_mutex;
+
+  static const quint32 m_magic=0x4d575643;	// MWVC
+  static const quint32 m_version=2;
+};
+
+#endif // INC_WORDVEC_CACHE_H